@@ -0,0 +1,99 @@
+#ifndef RECONSTRUCTION_BASE_CONSISTENCY_CHECK_H_
+#define RECONSTRUCTION_BASE_CONSISTENCY_CHECK_H_
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+namespace recon {
+
+// Writes the 16-bit disparities of one row. left_row and right_row hold disparities multiplied by
+// the disparity factor, inverse_factor is its inverse. A left disparity d at x survives when the
+// right disparity at x - d is non-zero and within threshold of it, every other pixel is written
+// as 0. The surviving values are rounded and saturated to [0, 65535].
+inline void WriteConsistentRow(const float* left_row, const float* right_row, const int width,
+                               const double inverse_factor, const int threshold, uint16_t* disparity_row);
+
+namespace internal {
+
+// pixels [x_begin, width)
+inline void WriteConsistentRowScalar(const float* left_row, const float* right_row, const int x_begin,
+                                     const int width, const double inverse_factor, const int threshold,
+                                     uint16_t* disparity_row) {
+  for (int x = x_begin; x < width; x++) {
+    const float value = left_row[x];
+    const int left_disparity = static_cast<int>(value * inverse_factor + 0.5);
+    bool consistent = value != 0 && x - left_disparity >= 0;
+    if (consistent) {
+      const int right_disparity = static_cast<int>(right_row[x - left_disparity] * inverse_factor + 0.5);
+      consistent = right_disparity != 0 && std::abs(left_disparity - right_disparity) <= threshold;
+    }
+    disparity_row[x] = consistent ?
+        static_cast<uint16_t>(std::min(std::max(std::round(value), 0.0f), 65535.0f)) : 0;
+  }
+}
+
+#if defined(__AVX2__)
+// 4 pixels at a time, the right disparities are gathered and the rounding is done in double like
+// the scalar version, so both give the same output. Returns the first pixel which is left over.
+inline int WriteConsistentRowAVX2(const float* left_row, const float* right_row, const int width,
+                                  const double inverse_factor, const int threshold,
+                                  uint16_t* disparity_row) {
+  const __m256d inverse = _mm256_set1_pd(inverse_factor);
+  const __m256d half = _mm256_set1_pd(0.5);
+  const __m128i lanes = _mm_setr_epi32(0, 1, 2, 3);
+  const __m128i minus_one = _mm_set1_epi32(-1);
+  const __m128i max_difference = _mm_set1_epi32(threshold);
+  const __m128 one = _mm_set1_ps(1.0f);
+  const __m128 half_ps = _mm_set1_ps(0.5f);
+  const __m128 max_value = _mm_set1_ps(65535.0f);
+  int x = 0;
+  for (; x + 4 <= width; x += 4) {
+    const __m128 value = _mm_loadu_ps(left_row + x);
+    const __m128i left_disparity =
+        _mm256_cvttpd_epi32(_mm256_add_pd(_mm256_mul_pd(_mm256_cvtps_pd(value), inverse), half));
+    const __m128i right_x = _mm_sub_epi32(_mm_add_epi32(_mm_set1_epi32(x), lanes), left_disparity);
+    // non-zero left disparities which fall inside the right image, only those lanes are gathered
+    __m128i consistent = _mm_andnot_si128(_mm_castps_si128(_mm_cmpeq_ps(value, _mm_setzero_ps())),
+                                          _mm_cmpgt_epi32(right_x, minus_one));
+    const __m128 right_value = _mm_mask_i32gather_ps(_mm_setzero_ps(), right_row, right_x,
+                                                     _mm_castsi128_ps(consistent), sizeof(float));
+    const __m128i right_disparity =
+        _mm256_cvttpd_epi32(_mm256_add_pd(_mm256_mul_pd(_mm256_cvtps_pd(right_value), inverse), half));
+    consistent = _mm_andnot_si128(_mm_cmpeq_epi32(right_disparity, _mm_setzero_si128()), consistent);
+    consistent = _mm_andnot_si128(
+        _mm_cmpgt_epi32(_mm_abs_epi32(_mm_sub_epi32(left_disparity, right_disparity)), max_difference),
+        consistent);
+    // std::round: half-way values away from zero, value - trunc(value) is exact
+    const __m128 truncated = _mm_round_ps(value, _MM_FROUND_TO_ZERO | _MM_FROUND_NO_EXC);
+    const __m128 fraction = _mm_sub_ps(value, truncated);
+    __m128 rounded = _mm_add_ps(truncated, _mm_and_ps(_mm_cmpge_ps(fraction, half_ps), one));
+    rounded = _mm_sub_ps(rounded, _mm_and_ps(_mm_cmple_ps(fraction, _mm_sub_ps(_mm_setzero_ps(), half_ps)), one));
+    // saturated before the conversion, which would turn values beyond int32 into INT_MIN
+    rounded = _mm_min_ps(_mm_max_ps(rounded, _mm_setzero_ps()), max_value);
+    const __m128i output = _mm_and_si128(_mm_cvtps_epi32(rounded), consistent);
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(disparity_row + x), _mm_packus_epi32(output, output));
+  }
+  return x;
+}
+#endif
+
+} // namespace internal
+
+inline void WriteConsistentRow(const float* left_row, const float* right_row, const int width,
+                               const double inverse_factor, const int threshold, uint16_t* disparity_row) {
+  int x = 0;
+#if defined(__AVX2__)
+  x = internal::WriteConsistentRowAVX2(left_row, right_row, width, inverse_factor, threshold, disparity_row);
+#endif
+  internal::WriteConsistentRowScalar(left_row, right_row, x, width, inverse_factor, threshold, disparity_row);
+}
+
+} // namespace recon
+
+#endif // RECONSTRUCTION_BASE_CONSISTENCY_CHECK_H_
@@ -0,0 +1,374 @@
+#include "descriptor_costs.h"
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include <Eigen/Core>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+#include "half_float.h"
+
+namespace recon {
+
+namespace {
+
+typedef Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> RowMatrix;
+typedef Eigen::Map<const RowMatrix> ConstRowMatrixMap;
+
+// number of left pixels per matrix product, the right band is kBlockWidth + disp_range - 1 wide
+const int kBlockWidth = 64;
+// ||a||^2 + ||b||^2 - 2 a.b loses most of its precision when the descriptors are close,
+// these distances which decide the matches are recomputed directly
+const float kRecomputeRatio = 1e-2f;
+
+#if defined(__AVX2__)
+float HorizontalSum(const __m256 v) {
+  __m128 sum = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+  sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+  sum = _mm_add_ss(sum, _mm_movehdup_ps(sum));
+  return _mm_cvtss_f32(sum);
+}
+
+int32_t HorizontalSum(const __m256i v) {
+  __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+  sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0x4E));
+  sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0xB1));
+  return _mm_cvtsi128_si32(sum);
+}
+#endif
+
+// a.b of two fp16 descriptors
+float DotHalf(const uint16_t* a, const uint16_t* b, const int n) {
+  float dot = 0.0f;
+  int i = 0;
+#if defined(__AVX2__) && defined(__F16C__) && defined(__FMA__)
+  __m256 acc = _mm256_setzero_ps();
+  for (; i + 8 <= n; i += 8) {
+    const __m256 va = _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i)));
+    const __m256 vb = _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i)));
+    acc = _mm256_fmadd_ps(va, vb, acc);
+  }
+  dot = HorizontalSum(acc);
+#endif
+  for (; i < n; i++) dot += HalfToFloat(a[i]) * HalfToFloat(b[i]);
+  return dot;
+}
+
+// widens n fp16 values to fp32
+void DecodeHalf(const uint16_t* half, const size_t n, float* values) {
+  size_t i = 0;
+#if defined(__AVX2__) && defined(__F16C__)
+  for (; i + 8 <= n; i += 8)
+    _mm256_storeu_ps(values + i, _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(half + i))));
+#endif
+  for (; i < n; i++) values[i] = HalfToFloat(half[i]);
+}
+
+// ||a - b||^2 of two fp16 descriptors, from the differences so close descriptors keep their precision
+float SquaredDistanceHalf(const uint16_t* a, const uint16_t* b, const int n) {
+  float sq_dist = 0.0f;
+  int i = 0;
+#if defined(__AVX2__) && defined(__F16C__) && defined(__FMA__)
+  __m256 acc = _mm256_setzero_ps();
+  for (; i + 8 <= n; i += 8) {
+    const __m256 va = _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i)));
+    const __m256 vb = _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i)));
+    const __m256 diff = _mm256_sub_ps(va, vb);
+    acc = _mm256_fmadd_ps(diff, diff, acc);
+  }
+  sq_dist = HorizontalSum(acc);
+#endif
+  for (; i < n; i++) {
+    const float diff = HalfToFloat(a[i]) - HalfToFloat(b[i]);
+    sq_dist += diff * diff;
+  }
+  return sq_dist;
+}
+
+// exact a.b of two int8 descriptors
+int32_t DotInt8(const int8_t* a, const int8_t* b, const int n) {
+  int32_t dot = 0;
+  int i = 0;
+#if defined(__AVX2__)
+  __m256i acc = _mm256_setzero_si256();
+#if (defined(__AVX512VNNI__) && defined(__AVX512VL__)) || defined(__AVXVNNI__)
+  // vpdpbusd multiplies unsigned by signed bytes: a + 128 is unsigned and the 128 * sum(b) it adds
+  // is summed by a second vpdpbusd of 128 with b
+  const __m256i bias = _mm256_set1_epi8(-128);
+  __m256i bias_acc = _mm256_setzero_si256();
+  for (; i + 32 <= n; i += 32) {
+    const __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+    const __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+#if defined(__AVX512VNNI__) && defined(__AVX512VL__)
+    acc = _mm256_dpbusd_epi32(acc, _mm256_xor_si256(va, bias), vb);
+    bias_acc = _mm256_dpbusd_epi32(bias_acc, bias, vb);
+#else
+    acc = _mm256_dpbusd_avx_epi32(acc, _mm256_xor_si256(va, bias), vb);
+    bias_acc = _mm256_dpbusd_avx_epi32(bias_acc, bias, vb);
+#endif
+  }
+  acc = _mm256_sub_epi32(acc, bias_acc);
+#endif
+  // sign extended to 16 bits, vpmaddwd sums pairs of products in 32 bits
+  for (; i + 16 <= n; i += 16) {
+    const __m256i va = _mm256_cvtepi8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i)));
+    const __m256i vb = _mm256_cvtepi8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i)));
+    acc = _mm256_add_epi32(acc, _mm256_madd_epi16(va, vb));
+  }
+  dot = HorizontalSum(acc);
+#endif
+  for (; i < n; i++) dot += static_cast<int32_t>(a[i]) * b[i];
+  return dot;
+}
+
+// cost(x, xr) of left pixel x and right pixel xr for rows of fp16 descriptors
+class HalfPairCost {
+ public:
+  HalfPairCost(const uint16_t* left_row, const uint16_t* right_row, const int width, const int channels,
+               const DescriptorCost cost)
+      : left_row_(left_row), right_row_(right_row), channels_(channels), cost_(cost) {
+    if (cost == DescriptorCost::kCosine) {
+      left_norms_.resize(width);
+      right_norms_.resize(width);
+      for (int x = 0; x < width; x++) {
+        left_norms_[x] = std::sqrt(DotHalf(Left(x), Left(x), channels));
+        right_norms_[x] = std::sqrt(DotHalf(Right(x), Right(x), channels));
+      }
+    }
+  }
+
+  float operator()(const int x, const int xr) const {
+    switch (cost_) {
+      case DescriptorCost::kL2:
+        return std::sqrt(SquaredDistanceHalf(Left(x), Right(xr), channels_));
+      case DescriptorCost::kCosine: {
+        const float norms = left_norms_[x] * right_norms_[xr];
+        return norms > 0.0f ? 1.0f - DotHalf(Left(x), Right(xr), channels_) / norms : 1.0f;
+      }
+      case DescriptorCost::kDotProduct:
+        return 1.0f - DotHalf(Left(x), Right(xr), channels_);
+    }
+    return 0.0f;
+  }
+
+ private:
+  const uint16_t* Left(const int x) const { return left_row_ + static_cast<size_t>(x) * channels_; }
+  const uint16_t* Right(const int x) const { return right_row_ + static_cast<size_t>(x) * channels_; }
+
+  const uint16_t* left_row_;
+  const uint16_t* right_row_;
+  const int channels_;
+  const DescriptorCost cost_;
+  std::vector<float> left_norms_;
+  std::vector<float> right_norms_;
+};
+
+// cost(x, xr) of left pixel x and right pixel xr for rows of int8 descriptors, the norms and dot
+// products are exact integers which are scaled in double
+class Int8PairCost {
+ public:
+  Int8PairCost(const int8_t* left_row, const float left_scale, const int8_t* right_row, const float right_scale,
+               const int width, const int channels, const DescriptorCost cost)
+      : left_row_(left_row), right_row_(right_row), left_scale_(left_scale), right_scale_(right_scale),
+        channels_(channels), cost_(cost) {
+    if (cost != DescriptorCost::kDotProduct) {
+      left_sq_norms_.resize(width);
+      right_sq_norms_.resize(width);
+      for (int x = 0; x < width; x++) {
+        left_sq_norms_[x] = DotInt8(Left(x), Left(x), channels);
+        right_sq_norms_[x] = DotInt8(Right(x), Right(x), channels);
+      }
+    }
+  }
+
+  float operator()(const int x, const int xr) const {
+    const double dot = DotInt8(Left(x), Right(xr), channels_);
+    switch (cost_) {
+      case DescriptorCost::kL2: {
+        const double left_scale = left_scale_;
+        const double right_scale = right_scale_;
+        const double sq_dist = left_scale * left_scale * left_sq_norms_[x] +
+                               right_scale * right_scale * right_sq_norms_[xr] -
+                               2.0 * left_scale * right_scale * dot;
+        return static_cast<float>(std::sqrt(std::max(0.0, sq_dist)));
+      }
+      case DescriptorCost::kCosine: {
+        // the scales cancel
+        const double norms = std::sqrt(static_cast<double>(left_sq_norms_[x]) * right_sq_norms_[xr]);
+        return norms > 0.0 ? static_cast<float>(1.0 - dot / norms) : 1.0f;
+      }
+      case DescriptorCost::kDotProduct:
+        return static_cast<float>(1.0 - static_cast<double>(left_scale_) * right_scale_ * dot);
+    }
+    return 0.0f;
+  }
+
+ private:
+  const int8_t* Left(const int x) const { return left_row_ + static_cast<size_t>(x) * channels_; }
+  const int8_t* Right(const int x) const { return right_row_ + static_cast<size_t>(x) * channels_; }
+
+  const int8_t* left_row_;
+  const int8_t* right_row_;
+  const float left_scale_;
+  const float right_scale_;
+  const int channels_;
+  const DescriptorCost cost_;
+  std::vector<int32_t> left_sq_norms_;
+  std::vector<int32_t> right_sq_norms_;
+};
+
+// the full range costs of a row from pair_cost(x, xr), see ComputeDescriptorCostRow
+template <typename PairCost>
+void FillCostRow(const PairCost& pair_cost, const int width, const int disp_range, float* costs) {
+  for (int x = 0; x < width; x++) {
+    float* pixel_costs = costs + static_cast<size_t>(x) * disp_range;
+    const int max_disp = std::min(disp_range, x + 1);
+    for (int d = 0; d < max_disp; d++)
+      pixel_costs[d] = pair_cost(x, x - d);
+    for (int d = max_disp; d < disp_range; d++)
+      pixel_costs[d] = pixel_costs[max_disp - 1];
+  }
+}
+
+// the band costs of row y from pair_cost(x, xr), see ComputeDescriptorCostBandRow
+template <typename PairCost>
+void FillCostBandRow(const PairCost& pair_cost, const DisparityBand& band, const int y, float* costs) {
+  const size_t row_offset = band.Offset(y, 0);
+  for (int x = 0; x < band.width(); x++) {
+    float* pixel_costs = costs + (band.Offset(y, x) - row_offset);
+    const int lo = band.Lo(y, x);
+    for (int i = 0; i < band.Count(y, x); i++)
+      pixel_costs[i] = pair_cost(x, x - lo - i);
+  }
+}
+
+} // namespace
+
+void ComputeDescriptorCostRow(const float* left_row, const float* right_row,
+                              const int width, const int channels, const int disp_range,
+                              const DescriptorCost cost, float* costs) {
+  ConstRowMatrixMap left(left_row, width, channels);
+  ConstRowMatrixMap right(right_row, width, channels);
+  const Eigen::VectorXf left_sq_norms = left.rowwise().squaredNorm();
+  const Eigen::VectorXf right_sq_norms = right.rowwise().squaredNorm();
+
+  RowMatrix dots;
+  for (int x0 = 0; x0 < width; x0 += kBlockWidth) {
+    const int block_width = std::min(kBlockWidth, width - x0);
+    // right pixels x-d for all x in the block and d in [0, disp_range)
+    const int band_start = std::max(0, x0 - disp_range + 1);
+    const int band_width = x0 + block_width - band_start;
+    dots.noalias() = left.middleRows(x0, block_width) *
+                     right.middleRows(band_start, band_width).transpose();
+
+    for (int i = 0; i < block_width; i++) {
+      const int x = x0 + i;
+      float* pixel_costs = costs + static_cast<size_t>(x) * disp_range;
+      const float* pixel_dots = dots.data() + static_cast<size_t>(i) * band_width;
+      const int max_disp = std::min(disp_range, x + 1);
+      for (int d = 0; d < max_disp; d++) {
+        const float dot = pixel_dots[x - d - band_start];
+        switch (cost) {
+          case DescriptorCost::kL2: {
+            const float sq_norms = left_sq_norms[x] + right_sq_norms[x - d];
+            const float sq_dist = sq_norms - 2.0f * dot;
+            if (sq_dist > kRecomputeRatio * sq_norms)
+              pixel_costs[d] = std::sqrt(sq_dist);
+            else
+              pixel_costs[d] = (left.row(x) - right.row(x - d)).norm();
+            break;
+          }
+          case DescriptorCost::kCosine: {
+            const float norms = std::sqrt(left_sq_norms[x] * right_sq_norms[x - d]);
+            pixel_costs[d] = norms > 0.0f ? 1.0f - dot / norms : 1.0f;
+            break;
+          }
+          case DescriptorCost::kDotProduct:
+            pixel_costs[d] = 1.0f - dot;
+            break;
+        }
+      }
+      for (int d = max_disp; d < disp_range; d++)
+        pixel_costs[d] = pixel_costs[max_disp - 1];
+    }
+  }
+}
+
+void ComputeDescriptorCostBandRow(const float* left_row, const float* right_row,
+                                  const int channels, const DisparityBand& band, const int y,
+                                  const DescriptorCost cost, float* costs) {
+  const int width = band.width();
+  ConstRowMatrixMap left(left_row, width, channels);
+  ConstRowMatrixMap right(right_row, width, channels);
+  Eigen::VectorXf right_norms;
+  if (cost == DescriptorCost::kCosine) right_norms = right.rowwise().norm();
+
+  const size_t row_offset = band.Offset(y, 0);
+  for (int x = 0; x < width; x++) {
+    float* pixel_costs = costs + (band.Offset(y, x) - row_offset);
+    const int lo = band.Lo(y, x);
+    const float left_norm = cost == DescriptorCost::kCosine ? left.row(x).norm() : 0.0f;
+    for (int i = 0; i < band.Count(y, x); i++) {
+      const int xr = x - lo - i;
+      switch (cost) {
+        case DescriptorCost::kL2:
+          pixel_costs[i] = (left.row(x) - right.row(xr)).norm();
+          break;
+        case DescriptorCost::kCosine: {
+          const float norms = left_norm * right_norms[xr];
+          pixel_costs[i] = norms > 0.0f ? 1.0f - left.row(x).dot(right.row(xr)) / norms : 1.0f;
+          break;
+        }
+        case DescriptorCost::kDotProduct:
+          pixel_costs[i] = 1.0f - left.row(x).dot(right.row(xr));
+          break;
+      }
+    }
+  }
+}
+
+void ComputeDescriptorCostRow(const uint16_t* left_row, const uint16_t* right_row,
+                              const int width, const int channels, const int disp_range,
+                              const DescriptorCost cost, float* costs) {
+  // the rows are widened once, W * C conversions against the W * D * C of the blocked product
+  const size_t row_size = static_cast<size_t>(width) * channels;
+  std::vector<float> rows(2 * row_size);
+  DecodeHalf(left_row, row_size, rows.data());
+  DecodeHalf(right_row, row_size, rows.data() + row_size);
+  ComputeDescriptorCostRow(rows.data(), rows.data() + row_size, width, channels, disp_range, cost, costs);
+}
+
+void ComputeDescriptorCostRow(const int8_t* left_row, const float left_scale,
+                              const int8_t* right_row, const float right_scale,
+                              const int width, const int channels, const int disp_range,
+                              const DescriptorCost cost, float* costs) {
+  FillCostRow(Int8PairCost(left_row, left_scale, right_row, right_scale, width, channels, cost),
+              width, disp_range, costs);
+}
+
+void ComputeDescriptorCostBandRow(const uint16_t* left_row, const uint16_t* right_row,
+                                  const int channels, const DisparityBand& band, const int y,
+                                  const DescriptorCost cost, float* costs) {
+  FillCostBandRow(HalfPairCost(left_row, right_row, band.width(), channels, cost), band, y, costs);
+}
+
+void ComputeDescriptorCostBandRow(const int8_t* left_row, const float left_scale,
+                                  const int8_t* right_row, const float right_scale,
+                                  const int channels, const DisparityBand& band, const int y,
+                                  const DescriptorCost cost, float* costs) {
+  FillCostBandRow(Int8PairCost(left_row, left_scale, right_row, right_scale, band.width(), channels, cost),
+                  band, y, costs);
+}
+
+void QuantizeCosts(const float* costs, const size_t count, const float scale, const uint16_t max_cost,
+                   uint16_t* quantized) {
+  const float max_value = static_cast<float>(max_cost);
+  // the dot product and projected costs can be negative, their conversion would wrap past max_cost
+  for (size_t i = 0; i < count; i++)
+    quantized[i] = static_cast<uint16_t>(std::max(0.0f, std::min(costs[i] * scale + 0.5f, max_value)));
+}
+
+} // namespace recon
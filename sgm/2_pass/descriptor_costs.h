@@ -0,0 +1,59 @@
+#ifndef RECONSTRUCTION_BASE_DESCRIPTOR_COSTS_H_
+#define RECONSTRUCTION_BASE_DESCRIPTOR_COSTS_H_
+
+#include <cstddef>
+#include <cstdint>
+
+#include "../common/disparity_band.h"
+
+namespace recon {
+
+// Matching cost between two descriptors a and b:
+//   kL2         - ||a - b||
+//   kCosine     - 1 - a.b / (||a|| ||b||)
+//   kDotProduct - 1 - a.b, for descriptors which are already normalized
+enum class DescriptorCost { kL2, kCosine, kDotProduct };
+
+// Computes the costs of one image row for all disparities in a pixel-major
+// width x disp_range buffer. The dot products of a block of left descriptors with
+// the right descriptors of its disparity band come from one matrix product, the
+// L2 distance is then ||a||^2 + ||b||^2 - 2 a.b. Disparities which fall outside
+// the right image repeat the cost of the largest valid disparity d = x.
+void ComputeDescriptorCostRow(const float* left_row, const float* right_row,
+                              const int width, const int channels, const int disp_range,
+                              const DescriptorCost cost, float* costs);
+
+// Costs of row y for the disparities of its band only, pixel x gets band.Count(y, x) costs
+// starting at costs + band.Offset(y, x) - band.Offset(y, 0). The distances are computed
+// directly, the bands are too narrow and irregular for the blocked matrix product.
+void ComputeDescriptorCostBandRow(const float* left_row, const float* right_row,
+                                  const int channels, const DisparityBand& band, const int y,
+                                  const DescriptorCost cost, float* costs);
+
+// Reduced precision versions of both for fp16 and int8 descriptors, see DescriptorType. The int8
+// values stand for value * scale, the scales of the left and right rows may differ. The products
+// are widened before they are summed: fp16 is converted to fp32 (F16C), the full range rows once
+// for the blocked matrix product and the bands pixel pair by pixel pair. int8 pairs are summed in
+// int32 (vpdpbusd with AVX-VNNI, vpmaddwd with AVX2), so the int8 L2 distance comes from exact
+// integer norms and dot products.
+void ComputeDescriptorCostRow(const uint16_t* left_row, const uint16_t* right_row,
+                              const int width, const int channels, const int disp_range,
+                              const DescriptorCost cost, float* costs);
+void ComputeDescriptorCostRow(const int8_t* left_row, const float left_scale,
+                              const int8_t* right_row, const float right_scale,
+                              const int width, const int channels, const int disp_range,
+                              const DescriptorCost cost, float* costs);
+void ComputeDescriptorCostBandRow(const uint16_t* left_row, const uint16_t* right_row,
+                                  const int channels, const DisparityBand& band, const int y,
+                                  const DescriptorCost cost, float* costs);
+void ComputeDescriptorCostBandRow(const int8_t* left_row, const float left_scale,
+                                  const int8_t* right_row, const float right_scale,
+                                  const int channels, const DisparityBand& band, const int y,
+                                  const DescriptorCost cost, float* costs);
+
+// Quantizes count costs to round(cost * scale), saturated at 0 and max_cost.
+void QuantizeCosts(const float* costs, const size_t count, const float scale, const uint16_t max_cost,
+                   uint16_t* quantized);
+
+} // namespace recon
+#endif
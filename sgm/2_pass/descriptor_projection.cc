@@ -0,0 +1,104 @@
+#include "descriptor_projection.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <stdexcept>
+
+#include <Eigen/Eigenvalues>
+
+namespace recon {
+
+namespace {
+
+// "PRJ1" in the first 4 bytes
+const int32_t kProjectionMagic = 0x314A5250;
+
+} // namespace
+
+void DescriptorProjection::Load(const std::string& path) {
+  std::ifstream file(path, std::ios::binary);
+  if (!file) {
+    throw std::runtime_error("[DescriptorProjection::Load] can not open " + path);
+  }
+  int32_t header[4];
+  file.read(reinterpret_cast<char*>(header), sizeof(header));
+  if (!file || header[0] != kProjectionMagic || header[1] <= 0 || header[2] <= 0) {
+    throw std::runtime_error("[DescriptorProjection::Load] invalid projection file " + path);
+  }
+  Matrix matrix(header[2], header[1]);
+  file.read(reinterpret_cast<char*>(matrix.data()), matrix.size() * sizeof(float));
+  if (!file) {
+    throw std::runtime_error("[DescriptorProjection::Load] truncated projection file " + path);
+  }
+  matrix_.swap(matrix);
+}
+
+void DescriptorProjection::Save(const std::string& path) const {
+  std::ofstream file(path, std::ios::binary);
+  if (!file) {
+    throw std::runtime_error("[DescriptorProjection::Save] can not open " + path);
+  }
+  const int32_t header[4] = { kProjectionMagic, input_dims(), output_dims(), 0 };
+  file.write(reinterpret_cast<const char*>(header), sizeof(header));
+  file.write(reinterpret_cast<const char*>(matrix_.data()), matrix_.size() * sizeof(float));
+  if (!file) {
+    throw std::runtime_error("[DescriptorProjection::Save] writing " + path + " failed");
+  }
+}
+
+double DescriptorProjection::Fit(const std::vector<const DescriptorTensor*>& samples, const int output_dims,
+                                 const DescriptorCost cost, const size_t max_samples) {
+  if (samples.empty()) {
+    throw std::invalid_argument("[DescriptorProjection::Fit] no sample descriptors");
+  }
+  const int channels = samples[0]->channels();
+  if (output_dims < 1 || output_dims > channels) {
+    throw std::invalid_argument("[DescriptorProjection::Fit] output dimensions must be in [1, channels]");
+  }
+
+  // second moments in double, only the lower triangle is accumulated
+  Eigen::MatrixXd moments = Eigen::MatrixXd::Zero(channels, channels);
+  Eigen::VectorXd sum = Eigen::VectorXd::Zero(channels);
+  size_t count = 0;
+  std::vector<float> decoded(channels);
+  for (const DescriptorTensor* tensor : samples) {
+    if (tensor->channels() != channels) {
+      throw std::invalid_argument("[DescriptorProjection::Fit] the sample descriptors have different sizes");
+    }
+    const size_t pixels = static_cast<size_t>(tensor->height()) * tensor->width();
+    const size_t step = std::max<size_t>(1, pixels / std::max<size_t>(1, max_samples));
+    for (size_t i = 0; i < pixels; i += step) {
+      const int y = static_cast<int>(i / tensor->width());
+      const int x = static_cast<int>(i % tensor->width());
+      tensor->WaitForRow(y);
+      const Eigen::VectorXd descriptor =
+          Eigen::Map<const Eigen::VectorXf>(tensor->DecodePixel(y, x, decoded.data()), channels).cast<double>();
+      moments.selfadjointView<Eigen::Lower>().rankUpdate(descriptor);
+      sum += descriptor;
+      count++;
+    }
+  }
+  if (count == 0) {
+    throw std::invalid_argument("[DescriptorProjection::Fit] no sample descriptors");
+  }
+  if (cost == DescriptorCost::kL2) {
+    moments.triangularView<Eigen::Lower>() -= sum * sum.transpose() / static_cast<double>(count);
+  }
+
+  // eigenvalues in increasing order, the rows of the projection are the last output_dims eigenvectors
+  Eigen::SelfAdjointEigenSolver<Eigen::MatrixXd> solver(moments);
+  if (solver.info() != Eigen::Success) {
+    throw std::runtime_error("[DescriptorProjection::Fit] the eigendecomposition failed");
+  }
+  matrix_.resize(output_dims, channels);
+  double kept = 0.0;
+  for (int i = 0; i < output_dims; i++) {
+    matrix_.row(i) = solver.eigenvectors().col(channels - 1 - i).transpose().cast<float>();
+    kept += std::max(0.0, solver.eigenvalues()[channels - 1 - i]);
+  }
+  const double total = solver.eigenvalues().cwiseMax(0.0).sum();
+  return total > 0.0 ? kept / total : 1.0;
+}
+
+} // namespace recon
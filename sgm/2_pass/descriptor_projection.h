@@ -0,0 +1,45 @@
+#ifndef RECONSTRUCTION_BASE_DESCRIPTOR_PROJECTION_H_
+#define RECONSTRUCTION_BASE_DESCRIPTOR_PROJECTION_H_
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include <Eigen/Core>
+
+#include "descriptor_costs.h"
+#include "descriptor_tensor.h"
+
+namespace recon {
+
+// Linear k x C map which reduces C channel descriptors to k channels before matching, a PCA
+// fitted by Fit or a learned matrix. The map has no offset: an offset cancels in the L2 distances
+// and would change the dot products and cosines.
+// File layout: int32 magic "PRJ1", int32 C, int32 k, int32 reserved, k*C row-major floats.
+class DescriptorProjection {
+ public:
+  typedef Eigen::Matrix<float, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor> Matrix;
+
+  DescriptorProjection() {}
+  explicit DescriptorProjection(const Matrix& matrix) : matrix_(matrix) {}
+
+  void Load(const std::string& path);
+  void Save(const std::string& path) const;
+  // Principal components of the descriptors of the sample tensors, at most max_samples evenly spaced
+  // pixels of each. The L2 fit centers the descriptors, the cosine and dot product fits keep the
+  // second moments about 0 so that the descriptors themselves are kept, not only their differences.
+  // Returns the share of the sample energy the output_dims components keep.
+  double Fit(const std::vector<const DescriptorTensor*>& samples, const int output_dims,
+             const DescriptorCost cost, const size_t max_samples = 100000);
+
+  bool empty() const { return matrix_.size() == 0; }
+  int input_dims() const { return static_cast<int>(matrix_.cols()); }
+  int output_dims() const { return static_cast<int>(matrix_.rows()); }
+  const Matrix& matrix() const { return matrix_; }
+
+ private:
+  Matrix matrix_;
+};
+
+} // namespace recon
+#endif
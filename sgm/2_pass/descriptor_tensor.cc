@@ -0,0 +1,359 @@
+#include "descriptor_tensor.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <stdexcept>
+
+#include "descriptor_projection.h"
+#include "half_float.h"
+
+namespace recon {
+
+namespace {
+
+const size_t kHeaderSize = sizeof(int32_t) + 3 * sizeof(uint64_t);
+// "DES1" in the first 4 bytes, never a dimension count of the fp32 layout
+const int32_t kTypedMagic = 0x31534544;
+const size_t kTypedHeaderSize = 4 * sizeof(int32_t) + 3 * sizeof(uint64_t);
+const size_t kPageSize = 4096;
+
+} // namespace
+
+size_t DescriptorTypeSize(const DescriptorType type) {
+  switch (type) {
+    case DescriptorType::kFloat32:
+      return sizeof(float);
+    case DescriptorType::kFloat16:
+      return sizeof(uint16_t);
+    case DescriptorType::kInt8:
+      return sizeof(int8_t);
+  }
+  throw std::invalid_argument("[DescriptorTypeSize] unknown descriptor type");
+}
+
+DescriptorTensor::DescriptorTensor() : height_(0), width_(0), channels_(0), row_stride_(0),
+                                       type_(DescriptorType::kFloat32), scale_(1.0f), data_(nullptr),
+                                       mapping_(nullptr), mapping_size_(0), resident_rows_(0) {}
+
+DescriptorTensor::~DescriptorTensor() {
+  Close();
+}
+
+void DescriptorTensor::Load(const std::string& path, const bool overlapped) {
+  Close();
+
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw std::runtime_error("[DescriptorTensor::Load] can not open " + path);
+  }
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) != 0 || static_cast<size_t>(file_stat.st_size) < kHeaderSize) {
+    close(fd);
+    throw std::runtime_error("[DescriptorTensor::Load] invalid descriptor file " + path);
+  }
+  mapping_size_ = file_stat.st_size;
+  // without overlapping let the kernel read the whole file up front
+  int flags = MAP_PRIVATE | (overlapped ? 0 : MAP_POPULATE);
+  mapping_ = mmap(nullptr, mapping_size_, PROT_READ, flags, fd, 0);
+  close(fd);
+  if (mapping_ == MAP_FAILED) {
+    mapping_ = nullptr;
+    throw std::runtime_error("[DescriptorTensor::Load] mmap failed for " + path);
+  }
+
+  const char* bytes = static_cast<const char*>(mapping_);
+  int32_t dims;
+  std::memcpy(&dims, bytes, sizeof(dims));
+  size_t header_size = kHeaderSize;
+  DescriptorType type = DescriptorType::kFloat32;
+  float scale = 1.0f;
+  if (dims == kTypedMagic) {
+    int32_t type_id;
+    if (mapping_size_ < kTypedHeaderSize) {
+      Close();
+      throw std::runtime_error("[DescriptorTensor::Load] invalid descriptor file " + path);
+    }
+    std::memcpy(&type_id, bytes + sizeof(dims), sizeof(type_id));
+    std::memcpy(&scale, bytes + 2 * sizeof(int32_t), sizeof(scale));
+    if (type_id < 0 || type_id > static_cast<int32_t>(DescriptorType::kInt8)) {
+      Close();
+      throw std::runtime_error("[DescriptorTensor::Load] unknown descriptor type in " + path);
+    }
+    type = static_cast<DescriptorType>(type_id);
+    if (type != DescriptorType::kInt8) scale = 1.0f;
+    header_size = kTypedHeaderSize;
+  }
+  else if (dims != 3) {
+    Close();
+    throw std::runtime_error("[DescriptorTensor::Load] expected 3 dimensions in " + path);
+  }
+  uint64_t size[3];
+  std::memcpy(size, bytes + header_size - sizeof(size), sizeof(size));
+  for (int i = 0; i < 3; i++) {
+    if (size[i] > static_cast<uint64_t>(std::numeric_limits<int>::max())) {
+      Close();
+      throw std::runtime_error("[DescriptorTensor::Load] descriptor dimensions out of range in " + path);
+    }
+  }
+  // the payload is compared by division so that a malformed header can not wrap the product
+  uint64_t payload = DescriptorTypeSize(type);
+  const uint64_t available = mapping_size_ - header_size;
+  for (int i = 0; i < 3; i++) {
+    if (size[i] != 0 && payload > available / size[i]) {
+      Close();
+      throw std::runtime_error("[DescriptorTensor::Load] truncated descriptor file " + path);
+    }
+    payload *= size[i];
+  }
+  height_ = static_cast<int>(size[0]);
+  width_ = static_cast<int>(size[1]);
+  channels_ = static_cast<int>(size[2]);
+  row_stride_ = static_cast<size_t>(width_) * channels_;
+  type_ = type;
+  scale_ = scale;
+  data_ = bytes + header_size;
+
+  if (overlapped) {
+    resident_rows_.store(0);
+    // the advice values are not flags, each one needs its own call
+    if (madvise(mapping_, mapping_size_, MADV_SEQUENTIAL) != 0 ||
+        madvise(mapping_, mapping_size_, MADV_WILLNEED) != 0) {
+      Close();
+      throw std::runtime_error("[DescriptorTensor::Load] madvise failed for " + path);
+    }
+    prefetch_thread_ = std::thread(&DescriptorTensor::PrefetchRows, this);
+  }
+  else {
+    resident_rows_.store(height_);
+  }
+}
+
+void DescriptorTensor::Wrap(const void* data, const int height, const int width, const int channels,
+                            const size_t row_stride, const DescriptorType type, const float scale) {
+  Close();
+  if (height < 0 || width < 0 || channels < 0 || row_stride < static_cast<size_t>(width) * channels) {
+    throw std::invalid_argument("[DescriptorTensor::Wrap] invalid descriptor geometry");
+  }
+  if (type == DescriptorType::kInt8 && !(scale > 0.0f)) {
+    throw std::invalid_argument("[DescriptorTensor::Wrap] int8 descriptors need a positive scale");
+  }
+  height_ = height;
+  width_ = width;
+  channels_ = channels;
+  row_stride_ = row_stride;
+  type_ = type;
+  scale_ = type == DescriptorType::kInt8 ? scale : 1.0f;
+  data_ = static_cast<const char*>(data);
+  resident_rows_.store(height_);
+}
+
+void DescriptorTensor::Save(const std::string& path) const {
+  std::ofstream file(path, std::ios::binary);
+  if (!file) {
+    throw std::runtime_error("[DescriptorTensor::Save] can not open " + path);
+  }
+  char header[kTypedHeaderSize];
+  const int32_t fields[4] = { kTypedMagic, static_cast<int32_t>(type_), 0, 0 };
+  const uint64_t size[3] = { static_cast<uint64_t>(height_), static_cast<uint64_t>(width_),
+                             static_cast<uint64_t>(channels_) };
+  std::memcpy(header, fields, sizeof(fields));
+  std::memcpy(header + 2 * sizeof(int32_t), &scale_, sizeof(scale_));
+  std::memcpy(header + sizeof(fields), size, sizeof(size));
+  file.write(header, sizeof(header));
+  const size_t row_size = static_cast<size_t>(width_) * channels_ * element_size();
+  for (int y = 0; y < height_; y++) {
+    WaitForRow(y);
+    file.write(static_cast<const char*>(RawRow(y)), row_size);
+  }
+  if (!file) {
+    throw std::runtime_error("[DescriptorTensor::Save] writing " + path + " failed");
+  }
+}
+
+void DescriptorTensor::Close() {
+  if (prefetch_thread_.joinable()) prefetch_thread_.join();
+  if (mapping_ != nullptr) munmap(mapping_, mapping_size_);
+  mapping_ = nullptr;
+  mapping_size_ = 0;
+  data_ = nullptr;
+  height_ = width_ = channels_ = 0;
+  row_stride_ = 0;
+  type_ = DescriptorType::kFloat32;
+  scale_ = 1.0f;
+  resident_rows_.store(0);
+}
+
+void DescriptorTensor::Downsample(const DescriptorTensor& fine) {
+  Close();
+  height_ = (fine.height() + 1) / 2;
+  width_ = (fine.width() + 1) / 2;
+  channels_ = fine.channels();
+  row_stride_ = static_cast<size_t>(width_) * channels_;
+  owned_.resize(static_cast<size_t>(height_) * width_ * channels_);
+  #pragma omp parallel
+  {
+    // decoded fine pixels of the reduced precision types
+    std::vector<float> decoded(fine.type() == DescriptorType::kFloat32 ? 0 : 4 * channels_);
+    #pragma omp for
+    for (int y = 0; y < height_; y++) {
+      // odd sizes repeat the last row and column
+      const int y0 = 2*y;
+      const int y1 = std::min(2*y + 1, fine.height() - 1);
+      fine.WaitForRow(y1);
+      float* coarse_row = owned_.data() + static_cast<size_t>(y) * width_ * channels_;
+      for (int x = 0; x < width_; x++) {
+        const int x0 = 2*x;
+        const int x1 = std::min(2*x + 1, fine.width() - 1);
+        float* coarse_pixel = coarse_row + static_cast<size_t>(x) * channels_;
+        const float* p00 = fine.DecodePixel(y0, x0, decoded.data());
+        const float* p01 = fine.DecodePixel(y0, x1, decoded.data() + channels_);
+        const float* p10 = fine.DecodePixel(y1, x0, decoded.data() + 2 * channels_);
+        const float* p11 = fine.DecodePixel(y1, x1, decoded.data() + 3 * channels_);
+        for (int c = 0; c < channels_; c++)
+          coarse_pixel[c] = 0.25f * (p00[c] + p01[c] + p10[c] + p11[c]);
+      }
+    }
+  }
+  data_ = reinterpret_cast<const char*>(owned_.data());
+  resident_rows_.store(height_);
+}
+
+void DescriptorTensor::Convert(const DescriptorTensor& source, const DescriptorType type, const float scale) {
+  Close();
+  height_ = source.height();
+  width_ = source.width();
+  channels_ = source.channels();
+  row_stride_ = static_cast<size_t>(width_) * channels_;
+  type_ = type;
+  const size_t count = static_cast<size_t>(height_) * row_stride_;
+  std::vector<float> decoded(channels_);
+  scale_ = 1.0f;
+  if (type == DescriptorType::kInt8) {
+    scale_ = scale;
+    if (scale_ <= 0.0f) {
+      float max_abs = 0.0f;
+      for (int y = 0; y < height_; y++) {
+        source.WaitForRow(y);
+        for (int x = 0; x < width_; x++) {
+          const float* pixel = source.DecodePixel(y, x, decoded.data());
+          for (int c = 0; c < channels_; c++) max_abs = std::max(max_abs, std::abs(pixel[c]));
+        }
+      }
+      // all zero descriptors keep a valid scale
+      scale_ = max_abs > 0.0f ? max_abs / 127.0f : 1.0f;
+    }
+  }
+  // the storage is counted in floats
+  owned_.resize((count * element_size() + sizeof(float) - 1) / sizeof(float));
+  void* data = owned_.data();
+  for (int y = 0; y < height_; y++) {
+    source.WaitForRow(y);
+    for (int x = 0; x < width_; x++) {
+      const float* pixel = source.DecodePixel(y, x, decoded.data());
+      const size_t offset = y * row_stride_ + static_cast<size_t>(x) * channels_;
+      for (int c = 0; c < channels_; c++) {
+        switch (type) {
+          case DescriptorType::kFloat32:
+            static_cast<float*>(data)[offset + c] = pixel[c];
+            break;
+          case DescriptorType::kFloat16:
+            static_cast<uint16_t*>(data)[offset + c] = FloatToHalf(pixel[c]);
+            break;
+          case DescriptorType::kInt8: {
+            const float value = std::max(-127.0f, std::min(127.0f, std::round(pixel[c] / scale_)));
+            static_cast<int8_t*>(data)[offset + c] = static_cast<int8_t>(value);
+            break;
+          }
+        }
+      }
+    }
+  }
+  data_ = reinterpret_cast<const char*>(owned_.data());
+  resident_rows_.store(height_);
+}
+
+void DescriptorTensor::Project(const DescriptorTensor& source, const DescriptorProjection& projection) {
+  if (projection.input_dims() != source.channels()) {
+    throw std::invalid_argument("[DescriptorTensor::Project] the projection does not match the descriptor size");
+  }
+  typedef DescriptorProjection::Matrix RowMatrix;
+  Close();
+  height_ = source.height();
+  width_ = source.width();
+  channels_ = projection.output_dims();
+  row_stride_ = static_cast<size_t>(width_) * channels_;
+  owned_.resize(static_cast<size_t>(height_) * row_stride_);
+  const int source_channels = source.channels();
+  #pragma omp parallel
+  {
+    // decoded source rows of the reduced precision types
+    std::vector<float> decoded(source.type() == DescriptorType::kFloat32 ? 0 :
+                               static_cast<size_t>(width_) * source_channels);
+    #pragma omp for schedule(dynamic, 1)
+    for (int y = 0; y < height_; y++) {
+      source.WaitForRow(y);
+      const float* row = source.type() == DescriptorType::kFloat32 ? source.Row(y) : decoded.data();
+      if (source.type() != DescriptorType::kFloat32) {
+        for (int x = 0; x < width_; x++)
+          source.DecodePixel(y, x, decoded.data() + static_cast<size_t>(x) * source_channels);
+      }
+      Eigen::Map<const RowMatrix> in(row, width_, source_channels);
+      Eigen::Map<RowMatrix> out(owned_.data() + static_cast<size_t>(y) * row_stride_, width_, channels_);
+      out.noalias() = in * projection.matrix().transpose();
+    }
+  }
+  data_ = reinterpret_cast<const char*>(owned_.data());
+  resident_rows_.store(height_);
+}
+
+const float* DescriptorTensor::DecodePixel(const int y, const int x, float* buffer) const {
+  const size_t offset = static_cast<size_t>(x) * channels_;
+  switch (type_) {
+    case DescriptorType::kFloat32:
+      return Pixel(y, x);
+    case DescriptorType::kFloat16: {
+      const uint16_t* pixel = static_cast<const uint16_t*>(RawRow(y)) + offset;
+      for (int c = 0; c < channels_; c++) buffer[c] = HalfToFloat(pixel[c]);
+      break;
+    }
+    case DescriptorType::kInt8: {
+      const int8_t* pixel = static_cast<const int8_t*>(RawRow(y)) + offset;
+      for (int c = 0; c < channels_; c++) buffer[c] = scale_ * pixel[c];
+      break;
+    }
+  }
+  return buffer;
+}
+
+void DescriptorTensor::WaitForRow(const int y) const {
+  if (resident_rows_.load(std::memory_order_acquire) > y) return;
+  std::unique_lock<std::mutex> lock(mutex_);
+  row_ready_.wait(lock, [this, y] { return resident_rows_.load(std::memory_order_acquire) > y; });
+}
+
+void DescriptorTensor::PrefetchRows() {
+  const size_t row_size = static_cast<size_t>(width_) * channels_ * element_size();
+  const volatile char* bytes = data_;
+  for (int y = 0; y < height_; y++) {
+    // touch one byte per page to fault the row in
+    size_t row_start = y * row_size;
+    for (size_t offset = 0; offset < row_size; offset += kPageSize)
+      (void)bytes[row_start + offset];
+    if (row_size > 0) (void)bytes[row_start + row_size - 1];
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      resident_rows_.store(y + 1, std::memory_order_release);
+    }
+    row_ready_.notify_all();
+  }
+}
+
+} // namespace recon
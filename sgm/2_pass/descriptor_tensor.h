@@ -0,0 +1,107 @@
+#ifndef RECONSTRUCTION_BASE_DESCRIPTOR_TENSOR_H_
+#define RECONSTRUCTION_BASE_DESCRIPTOR_TENSOR_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <Eigen/Core>
+
+namespace recon {
+
+class DescriptorProjection;
+
+// Element type of the descriptors. kInt8 values stand for value * scale.
+enum class DescriptorType { kFloat32, kFloat16, kInt8 };
+
+size_t DescriptorTypeSize(const DescriptorType type);
+
+// Read-only H x W x C view of a descriptor file mapped into memory. Two file layouts:
+//   fp32   - int32 dims (= 3), uint64 sizes[3] = {H, W, C}, H*W*C row-major floats
+//   typed  - int32 magic "DES1", int32 type, float scale, int32 reserved, uint64 sizes[3],
+//            H*W*C row-major elements of the type, see Save
+// The elements are used in place, the fp32 layout is only float aligned (the header is 28 bytes),
+// the typed header is 40 bytes. A tensor can also own its descriptors, see Downsample, Convert and
+// Project, or view descriptors in the caller's memory, see Wrap.
+class DescriptorTensor {
+ public:
+  typedef Eigen::Map<const Eigen::VectorXf> DescriptorMap;
+
+  DescriptorTensor();
+  ~DescriptorTensor();
+  DescriptorTensor(const DescriptorTensor&) = delete;
+  DescriptorTensor& operator=(const DescriptorTensor&) = delete;
+
+  // Maps the file. If overlapped is false all pages are read before returning,
+  // otherwise a background thread faults the rows in order and WaitForRow()
+  // must be called before a row is accessed.
+  void Load(const std::string& path, const bool overlapped = false);
+  // Views H x W x C descriptors the caller keeps alive, the rows are row_stride elements apart
+  // (at least W * C) and the descriptors of a row are contiguous. Nothing is copied.
+  void Wrap(const void* data, const int height, const int width, const int channels, const size_t row_stride,
+            const DescriptorType type = DescriptorType::kFloat32, const float scale = 1.0f);
+  // Writes the tensor in the typed layout, the rows are written without their padding.
+  void Save(const std::string& path) const;
+  void Close();
+  // Replaces the tensor with the 2x2 averages of the fine descriptors, a ceil(H/2) x ceil(W/2) x C
+  // fp32 tensor held in memory. The storage is reused by the next Downsample of the same or smaller size.
+  void Downsample(const DescriptorTensor& fine);
+  // Replaces the tensor with the descriptors of source in the given type, held in memory like Downsample.
+  // int8 stores round(v / scale) clamped to [-127, 127], a scale of 0 picks max |v| / 127 of the source.
+  void Convert(const DescriptorTensor& source, const DescriptorType type, const float scale = 0.0f);
+  // Replaces the tensor with the descriptors of source mapped to k channels by the projection, an
+  // H x W x k fp32 tensor held in memory like Downsample. The rows are projected in parallel in
+  // order, so with overlapped loading the projection follows the rows as they are read.
+  void Project(const DescriptorTensor& source, const DescriptorProjection& projection);
+
+  // Blocks until all rows up to and including y are resident.
+  void WaitForRow(const int y) const;
+
+  int height() const { return height_; }
+  int width() const { return width_; }
+  int channels() const { return channels_; }
+  DescriptorType type() const { return type_; }
+  // int8 quantization scale, 1 for the float types
+  float scale() const { return scale_; }
+  size_t element_size() const { return DescriptorTypeSize(type_); }
+  // elements between the starts of two rows
+  size_t row_stride() const { return row_stride_; }
+  // row y in the element type of the tensor
+  const void* RawRow(const int y) const { return data_ + static_cast<size_t>(y) * row_stride_ * element_size(); }
+
+  // the float accessors are only valid for kFloat32 tensors
+  const float* Row(const int y) const { return static_cast<const float*>(RawRow(y)); }
+  const float* Pixel(const int y, const int x) const { return Row(y) + static_cast<size_t>(x) * channels_; }
+  DescriptorMap Descriptor(const int y, const int x) const { return DescriptorMap(Pixel(y, x), channels_); }
+  // the descriptor of pixel (y, x) as floats for any type, decoded into buffer (channels floats)
+  // unless the tensor already holds floats
+  const float* DecodePixel(const int y, const int x, float* buffer) const;
+
+ private:
+  void PrefetchRows();
+
+  int height_;
+  int width_;
+  int channels_;
+  size_t row_stride_;
+  DescriptorType type_;
+  float scale_;
+  const char* data_;
+  void* mapping_;
+  size_t mapping_size_;
+  std::vector<float> owned_;
+
+  // overlapped loading state
+  std::thread prefetch_thread_;
+  std::atomic<int> resident_rows_;
+  mutable std::mutex mutex_;
+  mutable std::condition_variable row_ready_;
+};
+
+} // namespace recon
+#endif
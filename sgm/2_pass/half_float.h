@@ -0,0 +1,75 @@
+#ifndef RECONSTRUCTION_BASE_HALF_FLOAT_H_
+#define RECONSTRUCTION_BASE_HALF_FLOAT_H_
+
+#include <cstdint>
+#include <cstring>
+
+namespace recon {
+
+// IEEE 754 binary16 <-> binary32 conversions of the fp16 descriptors for the scalar code paths,
+// the kernels convert 8 values at a time with F16C.
+
+inline float HalfToFloat(const uint16_t half) {
+  const uint32_t sign = static_cast<uint32_t>(half & 0x8000) << 16;
+  const uint32_t exponent = (half >> 10) & 0x1F;
+  uint32_t mantissa = half & 0x3FF;
+  uint32_t bits;
+  if (exponent == 0x1F) {
+    // inf and nan
+    bits = sign | 0x7F800000 | (mantissa << 13);
+  }
+  else if (exponent != 0) {
+    bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+  }
+  else if (mantissa == 0) {
+    bits = sign;
+  }
+  else {
+    // subnormal, normalize the mantissa
+    int shift = 0;
+    while ((mantissa & 0x400) == 0) {
+      mantissa <<= 1;
+      shift++;
+    }
+    bits = sign | (static_cast<uint32_t>(113 - shift) << 23) | ((mantissa & 0x3FF) << 13);
+  }
+  float value;
+  std::memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+// rounds to the nearest half, ties to even, values beyond the half range become inf
+inline uint16_t FloatToHalf(const float value) {
+  uint32_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+  const uint16_t sign = static_cast<uint16_t>((bits >> 16) & 0x8000);
+  const uint32_t abs_bits = bits & 0x7FFFFFFF;
+  if (abs_bits >= 0x7F800000) {
+    // inf stays inf, nan stays a quiet nan
+    return sign | (abs_bits > 0x7F800000 ? 0x7E00 : 0x7C00);
+  }
+  if (abs_bits >= 0x477FF000) {
+    // rounds to 65536 or more
+    return sign | 0x7C00;
+  }
+  if (abs_bits < 0x38800000) {
+    // subnormal half: the mantissa with its implicit bit shifted into place
+    if (abs_bits < 0x33000000) return sign;
+    const int exponent = static_cast<int>(abs_bits >> 23);
+    const uint32_t mantissa = (abs_bits & 0x7FFFFF) | 0x800000;
+    const int shift = 126 - exponent;
+    uint32_t half = mantissa >> shift;
+    const uint32_t rest = mantissa & ((1u << shift) - 1);
+    const uint32_t halfway = 1u << (shift - 1);
+    if (rest > halfway || (rest == halfway && (half & 1))) half++;
+    return sign | static_cast<uint16_t>(half);
+  }
+  // normal half, a carry out of the mantissa correctly increments the exponent
+  uint32_t half = ((abs_bits - 0x38000000) >> 13);
+  const uint32_t rest = abs_bits & 0x1FFF;
+  if (rest > 0x1000 || (rest == 0x1000 && (half & 1))) half++;
+  return sign | static_cast<uint16_t>(half);
+}
+
+} // namespace recon
+#endif
@@ -1,15 +1,71 @@
 #include "sgm_stereo.h"
-#include <stack>
 #include <algorithm>
+#include <cmath>
+#include <exception>
+#include <numeric>
 #include <stdexcept>
+#include <string>
+#include <thread>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "consistency_check.h"
+#include "../common/path_aggregation.h"
 
 namespace recon {
 
+namespace {
+
+// threads of the parallel regions, 1 when built without OpenMP
+int MaxThreads() {
+#ifdef _OPENMP
+  return omp_get_max_threads();
+#else
+  return 1;
+#endif
+}
+
+} // namespace
+
 SGMStereo::SGMStereo() : disp_range_(kDisparityRange),
                          disparity_factor_(kDisparityFactor),
                          P1_(kP1),
                          P2_(kP2),
-                         consistency_threshold_(kConsistencyThreshold) {}
+                         consistency_threshold_(kConsistencyThreshold),
+                         overlapped_loading_(false),
+                         descriptor_cost_(DescriptorCost::kL2),
+                         single_aggregation_(false),
+                         pyramid_levels_(0),
+                         band_radius_(4),
+                         min_disp_(0),
+                         memory_limit_(0),
+                         halo_rows_(kStripHalo),
+                         quantized_(false),
+                         quantization_scale_(kQuantizationScale),
+                         num_candidates_(0),
+                         width_(0),
+                         height_(0),
+                         left_cost_(nullptr),
+                         right_cost_(nullptr),
+                         left_disp_image_(nullptr),
+                         right_disp_image_(nullptr),
+                         buffer_width_(0),
+                         buffer_height_(0),
+                         buffer_disp_range_(0),
+                         buffer_single_aggregation_(false),
+                         buffer_banded_(false),
+                         buffer_strip_rows_(0),
+                         buffer_quantized_(false),
+                         buffer_num_candidates_(0),
+                         buffer_num_threads_(0) {
+  for (int i = 0; i < kNumPaths; i++)
+    lr_min_prev_[i] = lr_min_curr_[i] = nullptr;
+}
+
+SGMStereo::~SGMStereo() {
+  FreeDataBuffer();
+}
 
 void SGMStereo::SetSmoothnessCostParameters(const int P1, const int P2) {
   if (P1 < 0 || P2 < 0) {
@@ -23,6 +79,7 @@ void SGMStereo::SetSmoothnessCostParameters(const int P1, const int P2) {
 
   P1_ = static_cast<CostType>(P1);
   P2_ = static_cast<CostType>(P2);
+  coarse_.reset();
 }
 
 void SGMStereo::SetConsistencyThreshold(const int consistency_threshold) {
@@ -33,124 +90,688 @@ void SGMStereo::SetConsistencyThreshold(const int consistency_threshold) {
   consistency_threshold_ = consistency_threshold;
 }
 
+void SGMStereo::SetDisparityRange(const int disp_range) {
+  if (disp_range < 2) {
+    throw std::invalid_argument("[SGMStereo::SetDisparityRange] disparity range must be at least 2");
+  }
+  if (disp_range > kMaxDisparityRange) {
+    throw std::invalid_argument("[SGMStereo::SetDisparityRange] disparity range must be at most " +
+                                std::to_string(kMaxDisparityRange) + " for the 16-bit output");
+  }
+  disp_range_ = disp_range;
+  coarse_.reset();
+}
+
+void SGMStereo::SetDisparityBounds(const int min_disp, const int max_disp) {
+  if (min_disp < 0 || max_disp < min_disp) {
+    throw std::invalid_argument("[SGMStereo::SetDisparityBounds] bounds must satisfy 0 <= min_disp <= max_disp");
+  }
+  if (max_disp >= kMaxDisparityRange) {
+    throw std::invalid_argument("[SGMStereo::SetDisparityBounds] max_disp must be below " +
+                                std::to_string(kMaxDisparityRange) + " for the 16-bit output");
+  }
+  SetDisparityRange(std::max(2, max_disp + 1));
+  min_disp_ = min_disp;
+}
+
+void SGMStereo::SetRowDisparityBounds(const std::vector<int>& row_min, const std::vector<int>& row_max) {
+  row_min_disp_ = row_min;
+  row_max_disp_ = row_max;
+  coarse_.reset();
+}
+
+void SGMStereo::SetOverlappedLoading(const bool overlapped) {
+  overlapped_loading_ = overlapped;
+}
+
+void SGMStereo::SetDescriptorCost(const DescriptorCost cost) {
+  descriptor_cost_ = cost;
+  coarse_.reset();
+}
+
+void SGMStereo::SetSingleAggregation(const bool single_aggregation) {
+  single_aggregation_ = single_aggregation;
+}
+
+void SGMStereo::SetPyramid(const int levels, const int band_radius) {
+  if (levels < 0 || band_radius < 0) {
+    throw std::invalid_argument("[SGMStereo::SetPyramid] levels and band radius must not be negative");
+  }
+  pyramid_levels_ = levels;
+  band_radius_ = band_radius;
+  coarse_.reset();
+}
+
+void SGMStereo::SetMemoryLimit(const size_t max_bytes, const int halo_rows) {
+  if (halo_rows < 0) {
+    throw std::invalid_argument("[SGMStereo::SetMemoryLimit] halo rows must not be negative");
+  }
+  memory_limit_ = max_bytes;
+  halo_rows_ = halo_rows;
+}
+
+void SGMStereo::SetQuantization(const bool quantized, const float scale) {
+  if (scale <= 0.0f) {
+    throw std::invalid_argument("[SGMStereo::SetQuantization] scale must be positive");
+  }
+  quantized_ = quantized;
+  quantization_scale_ = scale;
+}
+
+void SGMStereo::SetCandidateAggregation(const int num_candidates) {
+  if (num_candidates < 0) {
+    throw std::invalid_argument("[SGMStereo::SetCandidateAggregation] number of candidates must not be negative");
+  }
+  num_candidates_ = num_candidates;
+}
+
+void SGMStereo::SetProjection(const DescriptorProjection& projection) {
+  projection_ = projection;
+}
+
+void SGMStereo::Warmup(const int width, const int height) {
+  if (width <= 0 || height <= 0) {
+    throw std::invalid_argument("[SGMStereo::Warmup] image size must be positive");
+  }
+  width_ = width;
+  height_ = height;
+  AllocateDataBuffer();
+  // writing every buffer once faults all of their pages in, the band volumes depend on the
+  // disparities of each frame so only the coarse levels are warmed up in the band mode
+  if (Banded()) {
+    if (pyramid_levels_ > 0) CoarseEngine().Warmup((width + 1) / 2, (height + 1) / 2);
+  }
+  // the candidates are completely overwritten by the first sweep, only the disparity images are faulted in
+  else if (!CandidateAggregation()) {
+    if (Quantized()) {
+      std::fill(quantized_cost_.begin(), quantized_cost_.end(), static_cast<QuantizedCostType>(0));
+      std::fill(quantized_sum_cost_.begin(), quantized_sum_cost_.end(), static_cast<QuantizedCostType>(0));
+      for (int i = 0; i < kNumPaths; i++) {
+        std::fill(quantized_lr_prev_[i].begin(), quantized_lr_prev_[i].end(), static_cast<QuantizedCostType>(0));
+        std::fill(quantized_lr_curr_[i].begin(), quantized_lr_curr_[i].end(), static_cast<QuantizedCostType>(0));
+      }
+    }
+    else {
+      const int volume_rows = buffer_strip_rows_ > 0 ? std::min(height_, buffer_strip_rows_ + halo_rows_) : height_;
+      const size_t volume = static_cast<size_t>(width_) * volume_rows * disp_range_;
+      std::fill(left_cost_, left_cost_ + volume, static_cast<CostType>(0));
+      if (right_cost_ != nullptr) std::fill(right_cost_, right_cost_ + volume, static_cast<CostType>(0));
+      // the scratch vectors are zeroed by their allocation
+    }
+  }
+  for (int i = 0; i < kNumPaths; i++) {
+    if (lr_min_prev_[i] == nullptr) continue;
+    std::fill(lr_min_prev_[i], lr_min_prev_[i] + width_, static_cast<CostType>(0));
+    std::fill(lr_min_curr_[i], lr_min_curr_[i] + width_, static_cast<CostType>(0));
+  }
+  std::fill(left_disp_image_, left_disp_image_ + width_*height_, static_cast<DisparityType>(0));
+  std::fill(right_disp_image_, right_disp_image_ + width_*height_, static_cast<DisparityType>(0));
+}
+
 void SGMStereo::Compute(const std::string left_descriptors_path,
                         const std::string right_descriptors_path,
-                        cv::Mat* disparity) {
-
+                        cv::Mat* disparity,
+                        FrameStats* stats) {
   DescriptorTensor left_descriptors, right_descriptors;
-  LoadRepresentationFromFile(left_descriptors_path, &left_descriptors);
-  LoadRepresentationFromFile(right_descriptors_path, &right_descriptors);
+  {
+    ScopedStage stage(stats, "load");
+    LoadRepresentationFromFile(left_descriptors_path, &left_descriptors);
+    LoadRepresentationFromFile(right_descriptors_path, &right_descriptors);
+    stage.Allocated(DescriptorBytes(left_descriptors) + DescriptorBytes(right_descriptors));
+  }
+  Compute(left_descriptors, right_descriptors, disparity, stats);
+  if (stats != nullptr)
+    stats->Released(DescriptorBytes(left_descriptors) + DescriptorBytes(right_descriptors));
+}
 
-  Initialize(left_descriptors, right_descriptors);
+size_t SGMStereo::DescriptorBytes(const DescriptorTensor& descriptors) const {
+  return descriptors.element_size() * static_cast<size_t>(descriptors.height()) * descriptors.width() *
+         descriptors.channels();
+}
 
-  std::cout << "Computing data costs...\n";
-  ComputeCostImage(left_descriptors, right_descriptors);
+void SGMStereo::Compute(const DescriptorTensor& left_descriptors,
+                        const DescriptorTensor& right_descriptors,
+                        cv::Mat* disparity,
+                        FrameStats* stats) {
+  disparity->create(left_descriptors.height(), left_descriptors.width(), CV_16U);
+  Compute(left_descriptors, right_descriptors, disparity->ptr<uint16_t>(),
+          disparity->step / sizeof(uint16_t), stats);
+}
 
-  DisparityType* left_disp_image = new DisparityType[width_*height_];
-  std::cout << "Computing left to right SGM...\n";
-  PerformSGM(left_cost_, left_disp_image);
-  DisparityType* right_disp_image = new DisparityType[width_*height_];
-  std::cout << "Computing right to left SGM...\n";
-  PerformSGM(right_cost_, right_disp_image);
+void SGMStereo::Compute(const DescriptorTensor& left_descriptors,
+                        const DescriptorTensor& right_descriptors,
+                        uint16_t* disparity,
+                        const size_t stride,
+                        FrameStats* stats) {
+  const bool projected = !projection_.empty();
+  if (projected) {
+    ScopedStage stage(stats, "project");
+    projected_left_.Project(left_descriptors, projection_);
+    projected_right_.Project(right_descriptors, projection_);
+    stage.Allocated(DescriptorBytes(projected_left_) + DescriptorBytes(projected_right_));
+  }
+  Match(projected ? projected_left_ : left_descriptors, projected ? projected_right_ : right_descriptors, stats);
 
-  std::cout << "Computing disparity image...\n";
-  // TODO
-  EnforceLeftRightConsistency(left_disp_image, right_disp_image);
+  {
+    ScopedStage stage(stats, "speckle");
+    const DisparityType max_difference = static_cast<DisparityType>(static_cast<int>(2*disparity_factor_));
+    speckle_filter_.Apply(left_disp_image_, width_, height_, width_, 100, max_difference);
+    speckle_filter_.Apply(right_disp_image_, width_, height_, width_, 100, max_difference);
+  }
 
-  disparity->create(height_, width_, CV_16U);
-  for (int y = 0; y < height_; ++y) {
-    for (int x = 0; x < width_; ++x) {
-      //std::cout << left_disp_image[width_*y + x] << "\n";
-      DisparityType scaled_disp = std::round(left_disp_image[width_*y + x]);
-      disparity->at<uint16_t>(y,x) = static_cast<uint16_t>(scaled_disp);
+  {
+    ScopedStage stage(stats, "lr_check_output");
+    WriteConsistentDisparities(disparity, stride);
+  }
+
+  if (stats != nullptr) {
+    stats->Released(DataBufferBytes());
+    if (projected) stats->Released(DescriptorBytes(projected_left_) + DescriptorBytes(projected_right_));
+  }
+}
+
+
+void SGMStereo::Match(const DescriptorTensor& left_descriptors,
+                      const DescriptorTensor& right_descriptors,
+                      FrameStats* stats) {
+  {
+    ScopedStage stage(stats, "init");
+    // the workspace counts towards the peak of every call but is only allocated when it changes
+    if (Initialize(left_descriptors, right_descriptors)) stage.Allocated(DataBufferBytes());
+    else if (stats != nullptr) stats->Allocated(DataBufferBytes());
+  }
+  if (Banded()) {
+    MatchBand(left_descriptors, right_descriptors, stats);
+    return;
+  }
+  if (buffer_num_candidates_ > 0) {
+    MatchCandidates(left_descriptors, right_descriptors, stats);
+    return;
+  }
+  if (buffer_quantized_) {
+    MatchQuantized(left_descriptors, right_descriptors, stats);
+    return;
+  }
+  if (buffer_strip_rows_ > 0) {
+    MatchStrips(left_descriptors, right_descriptors, stats);
+    return;
+  }
+
+  {
+    ScopedStage stage(stats, "cost");
+    ComputeCostImage(left_descriptors, right_descriptors);
+  }
+
+  if (single_aggregation_) {
+    PerformSGM(left_cost_, left_disp_image_, right_disp_image_, &left_scratch_, stats);
+  }
+  else if (right_scratch_.num_threads == 0) {
+    // one thread aggregates the volumes one after the other in the same scratch
+    PerformSGM(left_cost_, left_disp_image_, nullptr, &left_scratch_, stats);
+    PerformSGM(right_cost_, right_disp_image_, nullptr, &left_scratch_, stats);
+  }
+  else {
+    // the right volume is aggregated next to the left one on its own half of the threads,
+    // the stages only time the left aggregation which the right one overlaps
+    // the thread is joined before any exception of either aggregation leaves Match
+    std::exception_ptr right_error;
+    std::thread right_sgm([this, &right_error]() {
+      try {
+        PerformSGM(right_cost_, right_disp_image_, nullptr, &right_scratch_, nullptr);
+      } catch (...) {
+        right_error = std::current_exception();
+      }
+    });
+    try {
+      PerformSGM(left_cost_, left_disp_image_, nullptr, &left_scratch_, stats);
+    } catch (...) {
+      right_sgm.join();
+      throw;
     }
+    right_sgm.join();
+    if (right_error) std::rethrow_exception(right_error);
   }
+}
 
-  FreeDataBuffer();
-  delete[] left_disp_image;
-  delete[] right_disp_image;
+void SGMStereo::MatchQuantized(const DescriptorTensor& left_descriptors,
+                               const DescriptorTensor& right_descriptors,
+                               FrameStats* stats) {
+  const size_t row_volume = static_cast<size_t>(width_) * disp_range_;
+  const int P2 = static_cast<int>(P2_ * quantization_scale_ + 0.5f);
+  const int max_cost = 0xFFFF / (2 * kNumPaths) - P2;
+  if (max_cost <= 0) {
+    throw std::invalid_argument("[SGMStereo::MatchQuantized] P2 does not fit 16 bits at the quantization scale");
+  }
+  {
+    ScopedStage stage(stats, "cost");
+    #pragma omp parallel
+    {
+      std::vector<CostType> row_costs(row_volume);
+      #pragma omp for schedule(dynamic, 1)
+      for (int y = 0; y < height_; y++) {
+        left_descriptors.WaitForRow(y);
+        right_descriptors.WaitForRow(y);
+        ComputeCostRow(left_descriptors, right_descriptors, y, row_costs.data());
+        QuantizeCosts(row_costs.data(), row_volume, quantization_scale_, static_cast<QuantizedCostType>(max_cost),
+                      quantized_cost_.data() + y*row_volume);
+      }
+    }
+  }
+  PerformQuantizedSGM(left_disp_image_, right_disp_image_, stats);
+}
+
+// Candidate mode of the full range search. The sweeps ask for the costs of a few rows at a time
+// which are computed in parallel. The right pixel x - d is matched by the left candidates at d,
+// the best of them gives its disparity like in the band mode.
+void SGMStereo::MatchCandidates(const DescriptorTensor& left_descriptors,
+                                const DescriptorTensor& right_descriptors,
+                                FrameStats* stats) {
+  const size_t row_volume = static_cast<size_t>(width_) * disp_range_;
+  {
+    ScopedStage stage(stats, "aggregate");
+    auto row_costs = [&](const int first_row, const int num_rows, CostType* costs) {
+      #pragma omp parallel for schedule(dynamic, 1)
+      for (int i = 0; i < num_rows; i++) {
+        const int y = first_row + i;
+        left_descriptors.WaitForRow(y);
+        right_descriptors.WaitForRow(y);
+        ComputeCostRow(left_descriptors, right_descriptors, y, costs + i*row_volume);
+      }
+    };
+    candidate_aggregator_.aggregate(row_costs, static_cast<int>(P1_), static_cast<int>(P2_));
+  }
+
+  ScopedStage stage(stats, "wta");
+  const int num_candidates = candidate_aggregator_.num_candidates();
+  #pragma omp parallel
+  {
+    std::vector<CostType> right_cost(width_);
+    #pragma omp for
+    for (int y = 0; y < height_; y++) {
+      DisparityType* disparityRow = left_disp_image_ + width_*y;
+      DisparityType* rightDisparityRow = right_disp_image_ + width_*y;
+      std::fill(rightDisparityRow, rightDisparityRow + width_, static_cast<DisparityType>(0));
+      std::fill(right_cost.begin(), right_cost.end(), std::numeric_limits<CostType>::max());
+      for (int x = 0; x < width_; x++) {
+        const CandidateAggregatorType::Candidate* candidates = candidate_aggregator_.candidates(y, x);
+        const CandidateAggregatorType::Candidate& best =
+            candidates[CandidateAggregatorType::best(candidates, num_candidates)];
+        if (best.disp > 0 && best.disp < disp_range_ - 1)
+          disparityRow[x] = RefineDisparity(best.disp, best.sums[0], best.sums[1], best.sums[2]);
+        else
+          disparityRow[x] = static_cast<DisparityType>(best.disp*disparity_factor_);
+        // the right disparities only feed the LR check so they are not refined
+        for (int i = 0; i < num_candidates; i++) {
+          const int xr = x - candidates[i].disp;
+          if (xr >= 0 && candidates[i].sums[1] < right_cost[xr]) {
+            right_cost[xr] = candidates[i].sums[1];
+            rightDisparityRow[xr] = static_cast<DisparityType>(candidates[i].disp*disparity_factor_);
+          }
+        }
+      }
+    }
+  }
 }
 
+// Strip mode of the full range search. Strip rows [y0, y1) are aggregated top-down from the
+// path state the previous strip carried over and bottom-up from the last halo row
+// y2 - 1, so only the volumes of the rows [y0, y2) are held. The halo costs are computed
+// again by the next strip.
+void SGMStereo::MatchStrips(const DescriptorTensor& left_descriptors,
+                            const DescriptorTensor& right_descriptors,
+                            FrameStats* stats) {
+  const size_t row_volume = static_cast<size_t>(width_) * disp_range_;
+  for (int y0 = 0; y0 < height_; y0 += buffer_strip_rows_) {
+    const int y1 = std::min(height_, y0 + buffer_strip_rows_);
+    const int y2 = std::min(height_, y1 + halo_rows_);
+    {
+      ScopedStage stage(stats, "cost");
+      ComputeLeftCostImage(left_descriptors, right_descriptors, y0, y2);
+    }
+    CostType* sum_cost = left_scratch_.sum_cost.data();
+    // the top-down pass sets the sums of the strip rows, the halo rows are only reached bottom-up
+    std::fill(sum_cost + (y1 - y0)*row_volume, sum_cost + (y2 - y0)*row_volume, static_cast<CostType>(0));
+
+    {
+      ScopedStage stage(stats, "aggregate_pass1");
+      // continues from the paths of the previous strip's last row and keeps the ones of this strip's
+      AggregatePass(left_cost_, sum_cost, y1 - y0, 0, y0 > 0, true, &left_scratch_, nullptr);
+    }
+
+    ScopedStage stage(stats, "aggregate_pass2");
+    std::vector<double> wta_ms(stats != nullptr ? y2 - y0 : 0, 0.0);
+    AggregatePass(left_cost_, sum_cost, y2 - y0, 1, false, false, &left_scratch_, [&](const int row) {
+      // the halo rows only lead the paths into the strip
+      if (y0 + row >= y1) return;
+      ScopedStage::Clock::time_point wta_start;
+      if (stats != nullptr) wta_start = ScopedStage::Clock::now();
+      SelectRowDisparities(sum_cost + row*row_volume, y0 + row, left_disp_image_, right_disp_image_);
+      if (stats != nullptr) wta_ms[row] = ScopedStage::ElapsedMs(wta_start);
+    });
+    if (stats != nullptr) stats->AddStage("wta", std::accumulate(wta_ms.begin(), wta_ms.end(), 0.0));
+  }
+}
+
+// Only the costs in the band of each pixel are computed and aggregated. The band is given by the
+// disparity bounds of the rows and, in the pyramid mode, by the disparities the coarse engine
+// finds on the 2x2 averaged descriptors.
+void SGMStereo::MatchBand(const DescriptorTensor& left_descriptors,
+                          const DescriptorTensor& right_descriptors,
+                          FrameStats* stats) {
+  const size_t bytes_before = DataBufferBytes();
+  if ((!row_min_disp_.empty() && static_cast<int>(row_min_disp_.size()) != height_) ||
+      (!row_max_disp_.empty() && static_cast<int>(row_max_disp_.size()) != height_)) {
+    throw std::invalid_argument("[SGMStereo::MatchBand] the row disparity bounds need one entry per row");
+  }
+  if (min_disp_ >= disp_range_) {
+    throw std::invalid_argument("[SGMStereo::MatchBand] minimum disparity is outside the disparity range");
+  }
+  ComputeRowBounds(min_disp_, disp_range_ - 1, row_min_disp_, row_max_disp_, 0, height_, &row_lo_, &row_hi_);
+  {
+    ScopedStage stage(stats, pyramid_levels_ > 0 ? "coarse" : "band");
+    if (pyramid_levels_ > 0) ComputeCoarseBand(left_descriptors, right_descriptors);
+    else band_.FromRowBounds(width_, height_, row_lo_.data(), row_hi_.data());
 
-void SGMStereo::Initialize(const DescriptorTensor& left_desc, const DescriptorTensor& right_desc) {
+    // the band buffers only grow, a frame with narrower bands reuses them
+    const size_t band_size = band_.Size();
+    const size_t row_size = band_.MaxRowSize();
+    if (band_cost_.size() < band_size) band_cost_.resize(band_size);
+    if (band_sum_cost_.size() < band_size) band_sum_cost_.resize(band_size);
+    for (int i = 0; i < kNumPaths; i++) {
+      if (band_lr_prev_[i].size() < row_size) band_lr_prev_[i].resize(row_size);
+      if (band_lr_curr_[i].size() < row_size) band_lr_curr_[i].resize(row_size);
+    }
+    band_right_cost_.resize(width_);
+    // the coarse engine and the band buffers are only known now
+    stage.Allocated(DataBufferBytes() - bytes_before);
+  }
+
+  {
+    ScopedStage stage(stats, "cost");
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (int y = 0; y < height_; y++) {
+      left_descriptors.WaitForRow(y);
+      right_descriptors.WaitForRow(y);
+      ComputeCostBandRow(left_descriptors, right_descriptors, y, band_cost_.data() + band_.Offset(y, 0));
+    }
+  }
+
+  PerformBandSGM(left_disp_image_, right_disp_image_, stats);
+}
+
+void SGMStereo::ComputeCoarseBand(const DescriptorTensor& left_descriptors,
+                                const DescriptorTensor& right_descriptors) {
+  coarse_left_.Downsample(left_descriptors);
+  coarse_right_.Downsample(right_descriptors);
+  SGMStereo& coarse = CoarseEngine();
+  coarse.Match(coarse_left_, coarse_right_, nullptr);
+  const int coarse_size = coarse.width_ * coarse.height_;
+  coarse_disp_.resize(coarse_size);
+  for (int i = 0; i < coarse_size; i++) {
+    coarse_disp_[i] = static_cast<int>(static_cast<double>(coarse.left_disp_image_[i]) /
+                                       coarse.disparity_factor_ + 0.5);
+  }
+  band_.FromCoarse(coarse_disp_.data(), coarse.width_, coarse.height_, width_, height_, 0,
+                   band_radius_, row_lo_.data(), row_hi_.data());
+}
+
+SGMStereo& SGMStereo::CoarseEngine() {
+  if (!coarse_) {
+    coarse_.reset(new SGMStereo);
+    coarse_->SetSmoothnessCostParameters(static_cast<int>(P1_), static_cast<int>(P2_));
+    coarse_->SetDisparityRange(std::max(2, (disp_range_ + 1) / 2));
+    coarse_->SetDescriptorCost(descriptor_cost_);
+    coarse_->SetSingleAggregation(true);
+    coarse_->SetPyramid(pyramid_levels_ - 1, band_radius_);
+    coarse_->min_disp_ = min_disp_ / 2;
+    coarse_->SetRowDisparityBounds(HalveRowMin(row_min_disp_), HalveRowMax(row_max_disp_));
+  }
+  return *coarse_;
+}
+
+bool SGMStereo::Initialize(const DescriptorTensor& left_desc, const DescriptorTensor& right_desc) {
   SetImageSize(left_desc, right_desc);
-  AllocateDataBuffer();
+  return AllocateDataBuffer();
 }
 
 void SGMStereo::SetImageSize(const DescriptorTensor& left_desc, const DescriptorTensor& right_desc) {
-  width_ = static_cast<int>(left_desc[0].size());
-  height_ = static_cast<int>(left_desc.size());
-  if (right_desc[0].size() != width_ || right_desc.size() != height_) {
+  width_ = left_desc.width();
+  height_ = left_desc.height();
+  if (right_desc.width() != width_ || right_desc.height() != height_) {
     throw std::invalid_argument("[SGMStereo::setImageSize] sizes of left and right images are different");
   }
+  if (right_desc.channels() != left_desc.channels()) {
+    throw std::invalid_argument("[SGMStereo::setImageSize] left and right descriptor sizes are different");
+  }
+  if (right_desc.type() != left_desc.type()) {
+    throw std::invalid_argument("[SGMStereo::setImageSize] left and right descriptor types are different");
+  }
+  if (pyramid_levels_ > 0 && (width_ < 2 || height_ < 2)) {
+    throw std::invalid_argument("[SGMStereo::setImageSize] image too small for the pyramid levels");
+  }
 }
 
-void SGMStereo::AllocateDataBuffer() {
-  left_cost_ = new CostType[width_ * height_ * disp_range_]();
-  right_cost_ = new CostType[width_ * height_ * disp_range_]();
+// returns false when the buffers of the previous call already have the right geometry,
+// all buffers are completely overwritten by each call so they are not initialized
+bool SGMStereo::AllocateDataBuffer() {
+  const bool banded = Banded();
+  const bool quantized = Quantized();
+  const int num_candidates = CandidateAggregation() ? num_candidates_ : 0;
+  const int strip_rows = banded || quantized || num_candidates > 0 ? 0 : StripRows();
+  const int num_threads = MaxThreads();
+  if (buffer_width_ == width_ && buffer_height_ == height_ && buffer_disp_range_ == disp_range_ &&
+      buffer_single_aggregation_ == single_aggregation_ && buffer_banded_ == banded &&
+      buffer_strip_rows_ == strip_rows && buffer_quantized_ == quantized &&
+      buffer_num_candidates_ == num_candidates && buffer_num_threads_ == num_threads) {
+    return false;
+  }
+  FreeDataBuffer();
+  buffer_width_ = width_;
+  buffer_height_ = height_;
+  buffer_disp_range_ = disp_range_;
+  buffer_single_aggregation_ = single_aggregation_;
+  buffer_banded_ = banded;
+  buffer_strip_rows_ = strip_rows;
+  buffer_quantized_ = quantized;
+  buffer_num_candidates_ = num_candidates;
+  buffer_num_threads_ = num_threads;
+
+  // the band levels only need the row minima and the disparity images, their volumes are sized per frame
+  if (banded) {
+    for (int i = 0; i < kNumPaths; i++) {
+      lr_min_prev_[i] = new CostType[width_];
+      lr_min_curr_[i] = new CostType[width_];
+    }
+    left_disp_image_ = new DisparityType[width_ * height_];
+    right_disp_image_ = new DisparityType[width_ * height_];
+    return true;
+  }
 
-  // size of the final summed costs
-  int sum_cost_size = width_ * height_ * disp_range_;
-  sum_cost_ = new CostType[sum_cost_size];
+  if (num_candidates > 0) {
+    candidate_aggregator_.reserve(width_, height_, disp_range_, num_candidates);
+    left_disp_image_ = new DisparityType[width_ * height_];
+    right_disp_image_ = new DisparityType[width_ * height_];
+    return true;
+  }
 
-  // size of aggregated cost buffer for one image row
-  int lr_size = width_ * disp_range_;
-  for (int i = 0; i < kNumPaths; i++) {
-    // buffers for storing the min values across all disparities for each path
-    // which are then used to normalize the aggregated cost to achieve upper bound: L <= C_max + P2
-    lr_min_prev_[i] = new CostType[width_];
-    lr_min_curr_[i] = new CostType[width_];
-    // buffers used to store the aggregated costs for each path and each disparity value
-    lr_curr_[i] = new CostType[lr_size];
-    lr_prev_[i] = new CostType[lr_size];
+  if (quantized) {
+    const size_t row_volume = static_cast<size_t>(width_) * disp_range_;
+    quantized_cost_.resize(row_volume * height_);
+    quantized_sum_cost_.resize(row_volume * height_);
+    for (int i = 0; i < kNumPaths; i++) {
+      quantized_lr_prev_[i].resize(row_volume);
+      quantized_lr_curr_[i].resize(row_volume);
+      quantized_lr_min_prev_[i].resize(width_);
+      quantized_lr_min_curr_[i].resize(width_);
+    }
+    left_disp_image_ = new DisparityType[width_ * height_];
+    right_disp_image_ = new DisparityType[width_ * height_];
+    return true;
+  }
+
+  // the strips hold the volumes of their own and their halo rows
+  const int volume_rows = strip_rows > 0 ? std::min(height_, strip_rows + halo_rows_) : height_;
+  const size_t volume = static_cast<size_t>(width_) * volume_rows * disp_range_;
+  left_cost_ = new CostType[volume];
+  // the right disparities come from the left volume in the single aggregation mode and the strips
+  right_cost_ = single_aggregation_ || strip_rows > 0 ? nullptr : new CostType[volume];
+
+  // the summed costs and path rows of each aggregation, the concurrent left and right
+  // aggregations split the threads
+  if (right_cost_ != nullptr && ConcurrentAggregation(num_threads)) {
+    AllocateScratch(num_threads / 2, volume_rows, false, &left_scratch_);
+    AllocateScratch(num_threads - num_threads / 2, volume_rows, false, &right_scratch_);
   }
+  else {
+    AllocateScratch(num_threads, volume_rows, strip_rows > 0, &left_scratch_);
+  }
+  left_disp_image_ = new DisparityType[width_ * height_];
+  right_disp_image_ = new DisparityType[width_ * height_];
+  return true;
+}
+
+size_t SGMStereo::DataBufferBytes() const {
+  const size_t disp_images = 2 * sizeof(DisparityType) * width_ * height_;
+  if (Banded()) {
+    size_t band_elements = band_cost_.capacity() + band_sum_cost_.capacity() + band_right_cost_.capacity() +
+                           2 * kNumPaths * static_cast<size_t>(width_);
+    for (int i = 0; i < kNumPaths; i++)
+      band_elements += band_lr_prev_[i].capacity() + band_lr_curr_[i].capacity();
+    const size_t coarse_bytes = coarse_ ? coarse_->DataBufferBytes() + coarse_left_.height() * sizeof(float) *
+                                          coarse_left_.width() * coarse_left_.channels() * 2 : 0;
+    return sizeof(CostType) * band_elements + disp_images + coarse_bytes;
+  }
+  if (buffer_num_candidates_ > 0) return candidate_aggregator_.bytes() + disp_images;
+  const size_t row_volume = static_cast<size_t>(width_) * disp_range_;
+  if (buffer_quantized_) {
+    const size_t path_buffers = 2 * kNumPaths * (row_volume + width_);
+    return sizeof(QuantizedCostType) * (2 * height_ * row_volume + path_buffers) + disp_images;
+  }
+  const size_t volume_rows = buffer_strip_rows_ > 0 ? std::min(height_, buffer_strip_rows_ + halo_rows_) : height_;
+  const size_t num_cost_volumes = right_cost_ != nullptr ? 2 : 1;
+  return sizeof(CostType) * num_cost_volumes * volume_rows * row_volume + ScratchBytes(left_scratch_) +
+         ScratchBytes(right_scratch_) + disp_images;
+}
+
+int SGMStereo::StripRows() const {
+  if (memory_limit_ == 0) return 0;
+  const size_t row_bytes = sizeof(CostType) * static_cast<size_t>(width_) * disp_range_;
+  const size_t slot_bytes = kNumPaths * (row_bytes + sizeof(CostType) * width_);
+  const size_t disp_images = 2 * sizeof(DisparityType) * width_ * height_;
+  // every aggregation holds a summed volume and a path row per thread and one more
+  const int num_threads = MaxThreads();
+  const bool concurrent = ConcurrentAggregation(num_threads);
+  const size_t num_volumes = single_aggregation_ ? 2 : (concurrent ? 4 : 3);
+  const size_t num_slots = concurrent ? num_threads + 2 : num_threads + 1;
+  if (num_volumes * height_ * row_bytes + num_slots * slot_bytes + disp_images <= memory_limit_) return 0;
+  // the strips hold a cost and a summed volume, the path rows and the carried top-down paths
+  const size_t fixed = (num_threads + 2) * slot_bytes + disp_images;
+  const size_t rows = memory_limit_ > fixed ? (memory_limit_ - fixed) / (2 * row_bytes) : 0;
+  if (rows <= static_cast<size_t>(halo_rows_)) {
+    throw std::runtime_error("[SGMStereo::StripRows] memory limit of " + std::to_string(memory_limit_) +
+                             " bytes does not hold a strip with " + std::to_string(halo_rows_) + " halo rows");
+  }
+  return static_cast<int>(std::min<size_t>(height_, rows - halo_rows_));
 }
 
 void SGMStereo::FreeDataBuffer() {
   delete[] left_cost_;
   delete[] right_cost_;
-  delete[] sum_cost_;
+  left_cost_ = right_cost_ = nullptr;
+  left_scratch_ = AggregationScratch();
+  right_scratch_ = AggregationScratch();
   for (int i = 0; i < kNumPaths; i++) {
     delete[] lr_min_prev_[i];
     delete[] lr_min_curr_[i];
-    delete[] lr_prev_[i];
-    delete[] lr_curr_[i];
+    lr_min_prev_[i] = lr_min_curr_[i] = nullptr;
+  }
+  delete[] left_disp_image_;
+  delete[] right_disp_image_;
+  left_disp_image_ = right_disp_image_ = nullptr;
+  buffer_width_ = buffer_height_ = buffer_disp_range_ = 0;
+  buffer_banded_ = false;
+  buffer_strip_rows_ = 0;
+  buffer_quantized_ = false;
+  buffer_num_candidates_ = 0;
+  buffer_num_threads_ = 0;
+  candidate_aggregator_ = CandidateAggregatorType();
+  std::vector<QuantizedCostType>().swap(quantized_cost_);
+  std::vector<QuantizedCostType>().swap(quantized_sum_cost_);
+  for (int i = 0; i < kNumPaths; i++) {
+    std::vector<QuantizedCostType>().swap(quantized_lr_prev_[i]);
+    std::vector<QuantizedCostType>().swap(quantized_lr_curr_[i]);
+    std::vector<QuantizedCostType>().swap(quantized_lr_min_prev_[i]);
+    std::vector<QuantizedCostType>().swap(quantized_lr_min_curr_[i]);
   }
 }
 
 void SGMStereo::ComputeCostImage(const DescriptorTensor& left_descriptors,
                                  const DescriptorTensor& right_descriptors) {
-  ComputeLeftCostImage(left_descriptors, right_descriptors);
-  ComputeRightCostImage();
+  ComputeLeftCostImage(left_descriptors, right_descriptors, 0, height_);
+  if (!single_aggregation_)
+    ComputeRightCostImage();
 }
 
 
 void SGMStereo::ComputeLeftCostImage(const DescriptorTensor& left_descriptors,
-                                     const DescriptorTensor& right_descriptors) {
-  int y_skip = width_ * disp_range_;
-  #pragma omp parallel for
-  for(int y = 0; y < height_; y++) {
-    for(int x = 0; x < width_; x++) {
-      for(int d = 0; d < disp_range_; d++) {
-        int idx = y*y_skip + x*disp_range_ + d;
-        if (x >= d) {
-          left_cost_[idx] = (left_descriptors[y][x] - right_descriptors[y][x-d]).norm();
-          assert(left_cost_[idx] >= 0 && left_cost_[idx] < 1000);
-          //std::cout << left_cost_[idx] << "\n";
-        }
-        else {
-          // TODO
-          left_cost_[idx] = left_cost_[idx-1];
-          assert(left_cost_[idx] >= 0 && left_cost_[idx] < 1000);
-          //left_cost_[idx] = std::numeric_limits<CostType>::max();
-        }
-      }
-    }
+                                     const DescriptorTensor& right_descriptors,
+                                     const int first_row, const int last_row) {
+  const size_t y_skip = static_cast<size_t>(width_) * disp_range_;
+  // with overlapped loading the rows become resident in order so hand them out in order
+  #pragma omp parallel for schedule(dynamic, 1)
+  for(int y = first_row; y < last_row; y++) {
+    left_descriptors.WaitForRow(y);
+    right_descriptors.WaitForRow(y);
+    // disparities outside the right image repeat the cost of d = x, see ComputeDescriptorCostRow
+    ComputeCostRow(left_descriptors, right_descriptors, y, left_cost_ + (y - first_row)*y_skip);
+  }
+}
+
+void SGMStereo::ComputeCostRow(const DescriptorTensor& left_descriptors, const DescriptorTensor& right_descriptors,
+                               const int y, CostType* costs) const {
+  const int channels = left_descriptors.channels();
+  switch (left_descriptors.type()) {
+    case DescriptorType::kFloat32:
+      ComputeDescriptorCostRow(left_descriptors.Row(y), right_descriptors.Row(y), width_, channels, disp_range_,
+                               descriptor_cost_, costs);
+      break;
+    case DescriptorType::kFloat16:
+      ComputeDescriptorCostRow(static_cast<const uint16_t*>(left_descriptors.RawRow(y)),
+                               static_cast<const uint16_t*>(right_descriptors.RawRow(y)), width_, channels,
+                               disp_range_, descriptor_cost_, costs);
+      break;
+    case DescriptorType::kInt8:
+      ComputeDescriptorCostRow(static_cast<const int8_t*>(left_descriptors.RawRow(y)), left_descriptors.scale(),
+                               static_cast<const int8_t*>(right_descriptors.RawRow(y)), right_descriptors.scale(),
+                               width_, channels, disp_range_, descriptor_cost_, costs);
+      break;
+  }
+}
+
+void SGMStereo::ComputeCostBandRow(const DescriptorTensor& left_descriptors,
+                                   const DescriptorTensor& right_descriptors,
+                                   const int y, CostType* costs) const {
+  const int channels = left_descriptors.channels();
+  switch (left_descriptors.type()) {
+    case DescriptorType::kFloat32:
+      ComputeDescriptorCostBandRow(left_descriptors.Row(y), right_descriptors.Row(y), channels, band_, y,
+                                   descriptor_cost_, costs);
+      break;
+    case DescriptorType::kFloat16:
+      ComputeDescriptorCostBandRow(static_cast<const uint16_t*>(left_descriptors.RawRow(y)),
+                                   static_cast<const uint16_t*>(right_descriptors.RawRow(y)), channels, band_, y,
+                                   descriptor_cost_, costs);
+      break;
+    case DescriptorType::kInt8:
+      ComputeDescriptorCostBandRow(static_cast<const int8_t*>(left_descriptors.RawRow(y)), left_descriptors.scale(),
+                                   static_cast<const int8_t*>(right_descriptors.RawRow(y)),
+                                   right_descriptors.scale(), channels, band_, y, descriptor_cost_, costs);
+      break;
   }
 }
 
 void SGMStereo::ComputeRightCostImage() {
-  const int widthStepCost = width_*disp_range_;
+  const size_t widthStepCost = static_cast<size_t>(width_) * disp_range_;
 
   for (int y = 0; y < height_; ++y) {
     CostType* leftCostRow = left_cost_ + widthStepCost*y;
@@ -189,300 +810,451 @@ void SGMStereo::ComputeRightCostImage() {
   }
 }
 
-void SGMStereo::PerformSGM(const CostType* data_cost, DisparityType* disparity_img) {
-  const CostType kCostMax = std::numeric_limits<CostType>::max();
+void SGMStereo::AllocateScratch(const int num_threads, const int volume_rows, const bool carry,
+                                AggregationScratch* scratch) const {
+  const size_t row_volume = static_cast<size_t>(width_) * disp_range_;
+  scratch->num_threads = num_threads;
+  // the slot of a row is reused num_threads + 1 rows later, when the row reading it is complete
+  scratch->num_slots = num_threads + 1;
+  const size_t num_slots = scratch->num_slots + (carry ? 1 : 0);
+  scratch->sum_cost.resize(volume_rows * row_volume);
+  scratch->path_costs.resize(num_slots * kNumPaths * row_volume);
+  scratch->path_mins.resize(num_slots * kNumPaths * width_);
+  scratch->progress.reset(new std::atomic<int>[volume_rows]);
+}
+
+size_t SGMStereo::ScratchBytes(const AggregationScratch& scratch) const {
+  return sizeof(CostType) * (scratch.sum_cost.capacity() + scratch.path_costs.capacity() +
+                             scratch.path_mins.capacity());
+}
+
+SGMStereo::PathRows SGMStereo::ScratchRows(AggregationScratch* scratch, const int slot) const {
+  const size_t row_volume = static_cast<size_t>(width_) * disp_range_;
+  PathRows rows;
+  for (int r = 0; r < kNumPaths; r++) {
+    rows.costs[r] = scratch->path_costs.data() + (slot*kNumPaths + r)*row_volume;
+    rows.mins[r] = scratch->path_mins.data() + (slot*kNumPaths + r)*static_cast<size_t>(width_);
+  }
+  return rows;
+}
+
+void SGMStereo::PerformSGM(const CostType* data_cost, DisparityType* disparity_img,
+                           DisparityType* right_disparity_img, AggregationScratch* scratch,
+                           FrameStats* stats) const {
+  const size_t row_volume = static_cast<size_t>(width_) * disp_range_;
+  CostType* sum_cost = scratch->sum_cost.data();
 
   // we have 2 passes each aggregating the costs from 4 paths
   // where 1 pass starts from top left pixel and 2 pass from bottom right pixel
-  const int kNumPasses = 2;
-  for (int pass_cnt = 0; pass_cnt < kNumPasses; pass_cnt++) {
-    int startX, endX, stepX;
-    int startY, endY, stepY;
-    // first pass performs row-wise iteration starting from top left pixel
-    if (pass_cnt == 0) {
-      startX = 0; endX = width_; stepX = 1;
-      startY = 0; endY = height_; stepY = 1;
+  {
+    ScopedStage stage(stats, "aggregate_pass1");
+    AggregatePass(data_cost, sum_cost, height_, 0, false, false, scratch, nullptr);
+  }
+  ScopedStage stage(stats, "aggregate_pass2");
+  // WTA runs on each row of the last pass as soon as it is aggregated, timed per row since the
+  // rows run on several threads
+  std::vector<double> wta_ms(stats != nullptr ? height_ : 0, 0.0);
+  AggregatePass(data_cost, sum_cost, height_, 1, false, false, scratch, [&](const int y) {
+    ScopedStage::Clock::time_point wta_start;
+    if (stats != nullptr) wta_start = ScopedStage::Clock::now();
+    SelectRowDisparities(sum_cost + y*row_volume, y, disparity_img, right_disparity_img);
+    if (stats != nullptr) wta_ms[y] = ScopedStage::ElapsedMs(wta_start);
+  });
+  // part of the time of the last pass
+  if (stats != nullptr) stats->AddStage("wta", std::accumulate(wta_ms.begin(), wta_ms.end(), 0.0));
+}
+
+// Aggregates one pass over the num_rows rows of data_cost into sum_cost, top-down for pass 0 and
+// bottom-up for pass 1. The first pass sets the sums and the second adds to them. The rows run as
+// a wavefront: thread t of the team takes rows t, t + team, ... of the pass and each block of a row
+// waits until the row before it is one pixel ahead, so the sums are the same as row by row. The
+// first row continues the carried paths when carry_in is set, carry_out keeps the paths of the
+// last row. row_done(y) runs on the thread of row y as soon as its sums are final.
+void SGMStereo::AggregatePass(const CostType* data_cost, CostType* sum_cost, const int num_rows,
+                              const int pass_cnt, const bool carry_in, const bool carry_out,
+                              AggregationScratch* scratch, const std::function<void(int)>& row_done) const {
+  const size_t row_volume = static_cast<size_t>(width_) * disp_range_;
+  const int num_slots = scratch->num_slots;
+  std::atomic<int>* progress = scratch->progress.get();
+  for (int i = 0; i < num_rows; i++) progress[i].store(0, std::memory_order_relaxed);
+  PathRows carry;
+  if (carry_in || carry_out) carry = ScratchRows(scratch, num_slots);
+
+  #pragma omp parallel num_threads(scratch->num_threads)
+  {
+#ifdef _OPENMP
+    const int thread = omp_get_thread_num();
+    const int team = omp_get_num_threads();
+#else
+    const int thread = 0;
+    const int team = 1;
+#endif
+    for (int i = thread; i < num_rows; i += team) {
+      // first pass performs row-wise iteration starting from top left pixel,
+      // second pass performs reverse row-wise iteration starting from bottom right pixel
+      const int y = pass_cnt == 0 ? i : num_rows - 1 - i;
+      const PathRows curr = ScratchRows(scratch, i % num_slots);
+      PathRows prev_rows;
+      const PathRows* prev = nullptr;
+      if (i > 0) {
+        prev_rows = ScratchRows(scratch, (i - 1) % num_slots);
+        prev = &prev_rows;
+      }
+      else if (carry_in) {
+        prev = &carry;
+      }
+      AggregateRow(data_cost + y*row_volume, prev, curr, sum_cost + y*row_volume, pass_cnt,
+                   i > 0 ? &progress[i - 1] : nullptr, &progress[i]);
+      if (row_done) row_done(y);
     }
-    // second pass performs reverse row-wise iteration starting from bottom right pixel
-    else {
-      startX = width_ - 1; endX = -1; stepX = -1;
-      startY = height_ - 1; endY = -1; stepY = -1;
+  }
+
+  if (carry_out && num_rows > 0) {
+    const PathRows last = ScratchRows(scratch, (num_rows - 1) % num_slots);
+    for (int r = 0; r < kNumPaths; r++) {
+      std::copy(last.costs[r], last.costs[r] + row_volume, carry.costs[r]);
+      std::copy(last.mins[r], last.mins[r] + width_, carry.mins[r]);
     }
+  }
+}
 
-    // iterate over rows
-    for (int y = startY; y != endY; y += stepY) {
-      // pointer to data cost for current row
-      const CostType* data_cost_row = data_cost + y*width_*disp_range_;
-      // pointer to aggregated cost for current row
-      CostType* sum_cost_row = sum_cost_ + y*width_*disp_range_;
+// Aggregates the 4 paths of one pass into one row, the paths of the previous row of the pass are
+// in prev unless it is null and the row starts them. The columns run in blocks which first wait
+// for prev_done to reach the last pixel the block reads, done counts the finished pixels.
+void SGMStereo::AggregateRow(const CostType* data_cost_row, const PathRows* prev, const PathRows& curr,
+                             CostType* sum_cost_row, const int pass_cnt, const std::atomic<int>* prev_done,
+                             std::atomic<int>* done) const {
+  const CostType kCostMax = std::numeric_limits<CostType>::max();
+  const int startX = pass_cnt == 0 ? 0 : width_ - 1;
+  const int endX = pass_cnt == 0 ? width_ : -1;
+  const int stepX = pass_cnt == 0 ? 1 : -1;
 
-      // iterate over columns
-      for (int x = startX; x != endX; x += stepX) {
-        // pointers to 4 paths cost for current pixel
-        const CostType* lr_p[kNumPaths] = { nullptr };
-        // buffer to store temp minimum costs for each of the 4 paths
-        CostType min_lr_p[kNumPaths] = { 0.0 };
-
-        // set the write pointers for each path for the current pixel
-        int x_skip = x * disp_range_;
-        CostType* lr_curr_p[kNumPaths];
-        for (int r = 0; r < kNumPaths; r++)
-          lr_curr_p[r] = lr_curr_[r] + x_skip;
-
-        // set the pointers for each path cost and min_cost
-        // to appropriate neighbour of the current pixel
+  // iterate over blocks of columns in the order of the pass
+  for (int j0 = 0; j0 < width_; j0 += kWavefrontBlock) {
+    const int j1 = std::min(width_, j0 + kWavefrontBlock);
+    // the diagonal path of the last column reads one pixel past the block
+    if (prev_done != nullptr) {
+      const int needed = std::min(width_, j1 + 1);
+      while (prev_done->load(std::memory_order_acquire) < needed)
+        std::this_thread::yield();
+    }
+
+    // iterate over columns
+    for (int x = startX + j0*stepX; x != startX + j1*stepX; x += stepX) {
+      // pointers to 4 paths cost for current pixel
+      const CostType* lr_p[kNumPaths] = { nullptr };
+      // buffer to store temp minimum costs for each of the 4 paths
+      CostType min_lr_p[kNumPaths] = { 0.0 };
+
+      // set the write pointers for each path for the current pixel
+      int x_skip = x * disp_range_;
+      CostType* lr_curr_p[kNumPaths];
+      for (int r = 0; r < kNumPaths; r++)
+        lr_curr_p[r] = curr.costs[r] + x_skip;
+
+      // set the pointers for each path cost and min_cost
+      // to appropriate neighbour of the current pixel
+      if (x != startX) {
+        // 1. left/right pixel is in the current row
+        lr_p[0] = curr.costs[0] + (x-stepX)*disp_range_;
+        min_lr_p[0] = curr.mins[0][x-stepX];
+      }
+      if (prev != nullptr) {
+        // 2. upper/lower center pixel is in the previous row
+        lr_p[2] = prev->costs[2] + x*disp_range_;
+        min_lr_p[2] = prev->mins[2][x];
+        // 3. upper/lower left pixel is in the previous row
         if (x != startX) {
-          // 1. left/right pixel is in current row lr_curr_
-          lr_p[0] = lr_curr_[0] + (x-stepX)*disp_range_;
-          min_lr_p[0] = lr_min_curr_[0][x-stepX];
+          lr_p[1] = prev->costs[1] + (x-stepX)*disp_range_;
+          min_lr_p[1] = prev->mins[1][x-stepX];
         }
-        if (y != startY) {
-          // 2. upper/lower center pixel is in lr_prev_
-          lr_p[2] = lr_prev_[2] + x*disp_range_;
-          min_lr_p[2] = lr_min_prev_[2][x];
-          // 3. upper/lower left pixel is in lr_prev_
-          if (x != startX) {
-            lr_p[1] = lr_prev_[1] + (x-stepX)*disp_range_;
-            min_lr_p[1] = lr_min_prev_[1][x-stepX];
-          }
-          // 4. upper/lower right pixel is in lr_prev_
-          if (x != (endX-stepX)) {
-            lr_p[3] = lr_prev_[3] + (x+stepX)*disp_range_;
-            min_lr_p[3] = lr_min_prev_[3][x+stepX];
-          }
+        // 4. upper/lower right pixel is in the previous row
+        if (x != (endX-stepX)) {
+          lr_p[3] = prev->costs[3] + (x+stepX)*disp_range_;
+          min_lr_p[3] = prev->mins[3][x+stepX];
         }
+      }
 
-        const CostType* dc_p = data_cost_row + x_skip;
-        for (int r = 0; r < kNumPaths; r++)
-          lr_min_curr_[r][x] = kCostMax;
-        CostType* sum_cost_p = sum_cost_row + x_skip;
-        // iterate over disparities
-        for (int d = 0; d < disp_range_; d++) {
-          // code below computes the following SGM cost:
-          // L_r(p, d) = C(p, d) + min(L_r(p-r, d),
-          // L_r(p-r, d-1) + P1, L_r(p-r, d+1) + P1,
-          // min_k L_r(p-r, k) + P2) - min_k L_r(p-r, k)
-          // where p = (x,y), r is one of the directions.
-
-          // aggregate costs for each path
-          for (int r = 0; r < kNumPaths; r++) {
-            // we dont need to initialize lr_curr_ in the beginning because of this line
-            lr_curr_p[r][d] = dc_p[d];
-            // fist check if the path exists
-            if (lr_p[r] != nullptr) {
-              CostType agg_cost = std::min(min_lr_p[r] + P2_, lr_p[r][d]);
-              // check if disp-1 exists
-              if (d > 0) {
-                CostType tmp_cost = lr_p[r][d-1] + P1_;
-                // we need min
-                if (agg_cost > tmp_cost)
-                  agg_cost = tmp_cost;
-              }
-              // check if disp+1 exists
-              if (d < (disp_range_ - 1)) {
-                CostType tmp_cost = lr_p[r][d+1] + P1_;
-                // we need min
-                if (agg_cost > tmp_cost)
-                  agg_cost = tmp_cost;
-              }
-              lr_curr_p[r][d] += agg_cost - min_lr_p[r];
+      const CostType* dc_p = data_cost_row + x_skip;
+      for (int r = 0; r < kNumPaths; r++)
+        curr.mins[r][x] = kCostMax;
+      CostType* sum_cost_p = sum_cost_row + x_skip;
+      // iterate over disparities
+      for (int d = 0; d < disp_range_; d++) {
+        // code below computes the following SGM cost:
+        // L_r(p, d) = C(p, d) + min(L_r(p-r, d),
+        // L_r(p-r, d-1) + P1, L_r(p-r, d+1) + P1,
+        // min_k L_r(p-r, k) + P2) - min_k L_r(p-r, k)
+        // where p = (x,y), r is one of the directions.
+
+        // aggregate costs for each path
+        for (int r = 0; r < kNumPaths; r++) {
+          // we dont need to initialize the path rows in the beginning because of this line
+          lr_curr_p[r][d] = dc_p[d];
+          // fist check if the path exists
+          if (lr_p[r] != nullptr) {
+            CostType agg_cost = std::min(min_lr_p[r] + P2_, lr_p[r][d]);
+            // check if disp-1 exists
+            if (d > 0) {
+              CostType tmp_cost = lr_p[r][d-1] + P1_;
+              // we need min
+              if (agg_cost > tmp_cost)
+                agg_cost = tmp_cost;
             }
-            // if the cost is smallest so far set new min which is needed for next iterations
-            if (lr_min_curr_[r][x] > lr_curr_p[r][d])
-              lr_min_curr_[r][x] = lr_curr_p[r][d];
-            // finally sum the costs over all paths
-            sum_cost_p[d] += lr_curr_p[r][d];
+            // check if disp+1 exists
+            if (d < (disp_range_ - 1)) {
+              CostType tmp_cost = lr_p[r][d+1] + P1_;
+              // we need min
+              if (agg_cost > tmp_cost)
+                agg_cost = tmp_cost;
+            }
+            lr_curr_p[r][d] += agg_cost - min_lr_p[r];
           }
+          // if the cost is smallest so far set new min which is needed for next iterations
+          if (curr.mins[r][x] > lr_curr_p[r][d])
+            curr.mins[r][x] = lr_curr_p[r][d];
+          // finally sum the costs over all paths, the first pass sets the sums
+          if (pass_cnt == 0 && r == 0)
+            sum_cost_p[d] = lr_curr_p[r][d];
+          else
+            sum_cost_p[d] += lr_curr_p[r][d];
         }
       }
+    }
+    if (done != nullptr) done->store(j1, std::memory_order_release);
+  }
+}
 
-      // compute the disparity map
-      if (pass_cnt == kNumPasses - 1) {
-        DisparityType* disparityRow = disparity_img + width_*y;
+// PerformSGM on the quantized volumes. The path steps are the saturating 16-bit kernels of the
+// 8-pass engine and every path cost is bounded by C_max + P2, so the sums of the 8 paths can
+// not overflow.
+void SGMStereo::PerformQuantizedSGM(DisparityType* disparity_img, DisparityType* right_disparity_img,
+                                    FrameStats* stats) {
+  const int P1 = static_cast<int>(P1_ * quantization_scale_ + 0.5f);
+  const int P2 = static_cast<int>(P2_ * quantization_scale_ + 0.5f);
+  const size_t row_volume = static_cast<size_t>(width_) * disp_range_;
+  std::fill(quantized_sum_cost_.begin(), quantized_sum_cost_.end(), static_cast<QuantizedCostType>(0));
 
-        for (int x = 0; x < width_; ++x) {
-          const CostType* costSumCurrent = sum_cost_row + disp_range_*x;
-          CostType bestSumCost = costSumCurrent[0];
-          int bestDisparity = 0;
-          for (int d = 1; d < disp_range_; ++d) {
-            if (costSumCurrent[d] < bestSumCost) {
-              bestSumCost = costSumCurrent[d];
-              bestDisparity = d;
-            }
-          }
-          //std::cout << bestDisparity << "\n";
-
-          if (bestDisparity > 0 && bestDisparity < disp_range_ - 1) {
-            CostType centerCostValue = costSumCurrent[bestDisparity];
-            CostType leftCostValue = costSumCurrent[bestDisparity - 1];
-            CostType rightCostValue = costSumCurrent[bestDisparity + 1];
-            if (rightCostValue < leftCostValue) {
-              disparityRow[x] = static_cast<CostType>(bestDisparity*disparity_factor_
-                  + static_cast<double>(rightCostValue - leftCostValue) /
-                  (centerCostValue - leftCostValue)/2.0*disparity_factor_ + 0.5);
-            }
-            else {
-              disparityRow[x] = static_cast<CostType>(bestDisparity*disparity_factor_
-                  + static_cast<double>(rightCostValue - leftCostValue) /
-                  (centerCostValue - rightCostValue)/2.0*disparity_factor_ + 0.5);
-            }
+  const int kNumPasses = 2;
+  for (int pass_cnt = 0; pass_cnt < kNumPasses; pass_cnt++) {
+    ScopedStage stage(stats, pass_cnt == 0 ? "aggregate_pass1" : "aggregate_pass2");
+    double wta_ms = 0.0;
+    const int startX = pass_cnt == 0 ? 0 : width_ - 1;
+    const int endX = pass_cnt == 0 ? width_ : -1;
+    const int stepX = pass_cnt == 0 ? 1 : -1;
+    const int startY = pass_cnt == 0 ? 0 : height_ - 1;
+    const int endY = pass_cnt == 0 ? height_ : -1;
+    const int stepY = pass_cnt == 0 ? 1 : -1;
+
+    for (int y = startY; y != endY; y += stepY) {
+      const QuantizedCostType* cost_row = quantized_cost_.data() + y*row_volume;
+      QuantizedCostType* sum_cost_row = quantized_sum_cost_.data() + y*row_volume;
+      for (int x = startX; x != endX; x += stepX) {
+        const QuantizedCostType* dc_p = cost_row + x*disp_range_;
+        QuantizedCostType* sum_cost_p = sum_cost_row + x*disp_range_;
+        // same neighbours as in AggregateRow: left/right, upper/lower left, upper/lower center
+        // and upper/lower right pixel, the first one in the current row
+        const int px[kNumPaths] = { x - stepX, x - stepX, x, x + stepX };
+        for (int r = 0; r < kNumPaths; r++) {
+          const bool has_prior = (r == 0) ? x != startX : y != startY && px[r] >= 0 && px[r] < width_;
+          QuantizedCostType* lr_curr_p = quantized_lr_curr_[r].data() + x*disp_range_;
+          if (has_prior) {
+            const QuantizedCostType* lr_p = (r == 0 ? quantized_lr_curr_[r] : quantized_lr_prev_[r]).data() +
+                                            px[r]*disp_range_;
+            const QuantizedCostType min_lr_p = (r == 0) ? quantized_lr_min_curr_[r][px[r]]
+                                                        : quantized_lr_min_prev_[r][px[r]];
+            quantized_lr_min_curr_[r][x] = aggregate_path_step(lr_p, min_lr_p, dc_p, lr_curr_p, disp_range_,
+                                                               P1, P2);
           }
           else {
-           disparityRow[x] = static_cast<CostType>(bestDisparity*disparity_factor_);
+            std::copy(dc_p, dc_p + disp_range_, lr_curr_p);
+            quantized_lr_min_curr_[r][x] = *std::min_element(dc_p, dc_p + disp_range_);
           }
+          for (int d = 0; d < disp_range_; d++)
+            sum_cost_p[d] += lr_curr_p[d];
         }
       }
 
-      // set current row buffer as previous row buffer for next iteration
-      std::swap(lr_curr_, lr_prev_);
-      std::swap(lr_min_curr_, lr_min_prev_);
+      if (pass_cnt == kNumPasses - 1) {
+        ScopedStage::Clock::time_point wta_start;
+        if (stats != nullptr) wta_start = ScopedStage::Clock::now();
+        SelectRowDisparities(sum_cost_row, y, disparity_img, right_disparity_img);
+        if (stats != nullptr) wta_ms += ScopedStage::ElapsedMs(wta_start);
+      }
+      std::swap(quantized_lr_curr_, quantized_lr_prev_);
+      std::swap(quantized_lr_min_curr_, quantized_lr_min_prev_);
     }
+    if (stats != nullptr && pass_cnt == kNumPasses - 1) stats->AddStage("wta", wta_ms);
   }
-
-  // TODO check this code
-  SpeckleFilter(100, static_cast<int>(2*disparity_factor_), disparity_img);
 }
 
-void SGMStereo::SpeckleFilter(const int maxSpeckleSize, const int maxDifference, DisparityType* image) const {
-  std::vector<int> labels(width_*height_, 0);
-  std::vector<bool> regionTypes(1);
-  regionTypes[0] = false;
+// winner takes all of the summed costs of row y
+template<typename SumCostType>
+void SGMStereo::SelectRowDisparities(const SumCostType* sum_cost_row, const int y, DisparityType* disparity_img,
+                                     DisparityType* right_disparity_img) const {
+  DisparityType* disparityRow = disparity_img + width_*y;
+  for (int x = 0; x < width_; ++x)
+    disparityRow[x] = SelectDisparity(sum_cost_row + disp_range_*x, 1, disp_range_);
+  if (right_disparity_img != nullptr) {
+    // right pixel x matches left pixel x+d so its costs lie on a diagonal of the row
+    DisparityType* rightDisparityRow = right_disparity_img + width_*y;
+    for (int x = 0; x < width_; ++x)
+      rightDisparityRow[x] = SelectDisparity(sum_cost_row + disp_range_*x, disp_range_ + 1,
+                                             std::min(disp_range_, width_ - x));
+  }
+}
 
-  int currentLabelIndex = 0;
+// PerformSGM on the band volumes, the right disparities are always taken from the left volume
+void SGMStereo::PerformBandSGM(DisparityType* disparity_img, DisparityType* right_disparity_img,
+                               FrameStats* stats) {
+  const int P1 = static_cast<int>(P1_);
+  const int P2 = static_cast<int>(P2_);
+  std::fill(band_sum_cost_.begin(), band_sum_cost_.begin() + band_.Size(), static_cast<CostType>(0));
 
-  for (int y = 0; y < height_; ++y) {
-    for (int x = 0; x < width_; ++x) {
-      int pixelIndex = width_*y + x;
-      if (image[width_*y + x] != 0) {
-        if (labels[pixelIndex] > 0) {
-          if (regionTypes[labels[pixelIndex]]) {
-            image[width_*y + x] = 0;
-          }
-        } else {
-          std::stack<int> wavefrontIndices;
-          wavefrontIndices.push(pixelIndex);
-          ++currentLabelIndex;
-          regionTypes.push_back(false);
-          int regionPixelTotal = 0;
-          labels[pixelIndex] = currentLabelIndex;
-
-          while (!wavefrontIndices.empty()) {
-            int currentPixelIndex = wavefrontIndices.top();
-            wavefrontIndices.pop();
-            int currentX = currentPixelIndex%width_;
-            int currentY = currentPixelIndex/width_;
-            ++regionPixelTotal;
-            CostType pixelValue = image[width_*currentY + currentX];
-
-            if (currentX < width_ - 1 && labels[currentPixelIndex + 1] == 0
-                && image[width_*currentY + currentX + 1] != 0
-                && std::abs(pixelValue - image[width_*currentY + currentX + 1]) <= maxDifference)
-            {
-              labels[currentPixelIndex + 1] = currentLabelIndex;
-              wavefrontIndices.push(currentPixelIndex + 1);
-            }
+  const int kNumPasses = 2;
+  for (int pass_cnt = 0; pass_cnt < kNumPasses; pass_cnt++) {
+    ScopedStage stage(stats, pass_cnt == 0 ? "aggregate_pass1" : "aggregate_pass2");
+    double wta_ms = 0.0;
+    int startX, endX, stepX;
+    int startY, endY, stepY;
+    if (pass_cnt == 0) {
+      startX = 0; endX = width_; stepX = 1;
+      startY = 0; endY = height_; stepY = 1;
+    }
+    else {
+      startX = width_ - 1; endX = -1; stepX = -1;
+      startY = height_ - 1; endY = -1; stepY = -1;
+    }
 
-            if (currentX > 0 && labels[currentPixelIndex - 1] == 0
-                && image[width_*currentY + currentX - 1] != 0
-                && std::abs(pixelValue - image[width_*currentY + currentX - 1]) <= maxDifference)
-            {
-              labels[currentPixelIndex - 1] = currentLabelIndex;
-              wavefrontIndices.push(currentPixelIndex - 1);
-            }
+    for (int y = startY; y != endY; y += stepY) {
+      // the row buffers are indexed like the band volume rows
+      const size_t row_offset = band_.Offset(y, 0);
+      const int prev_y = y - stepY;
+      const size_t prev_row_offset = (y != startY) ? band_.Offset(prev_y, 0) : 0;
+      const CostType* data_cost_row = band_cost_.data() + row_offset;
+      CostType* sum_cost_row = band_sum_cost_.data() + row_offset;
 
-            if (currentY < height_ - 1 && labels[currentPixelIndex + width_] == 0
-                && image[width_*(currentY + 1) + currentX] != 0
-                && std::abs(pixelValue - image[width_*(currentY + 1) + currentX]) <= maxDifference)
-            {
-              labels[currentPixelIndex + width_] = currentLabelIndex;
-              wavefrontIndices.push(currentPixelIndex + width_);
-            }
+      for (int x = startX; x != endX; x += stepX) {
+        const size_t x_skip = band_.Offset(y, x) - row_offset;
+        const int lo = band_.Lo(y, x);
+        const int count = band_.Count(y, x);
+        const CostType* dc_p = data_cost_row + x_skip;
+        CostType* sum_cost_p = sum_cost_row + x_skip;
+        // the previous pixel of each path: 1. left/right in the current row,
+        // 2. - 4. upper/lower left, center and right in the previous row
+        const int prior_x[kNumPaths] = { x - stepX, x - stepX, x, x + stepX };
 
-            if (currentY > 0 && labels[currentPixelIndex - width_] == 0
-                && image[width_*(currentY - 1) + currentX] != 0
-                && std::abs(pixelValue - image[width_*(currentY - 1) + currentX]) <= maxDifference)
-            {
-              labels[currentPixelIndex - width_] = currentLabelIndex;
-              wavefrontIndices.push(currentPixelIndex - width_);
-            }
+        for (int r = 0; r < kNumPaths; r++) {
+          CostType* lr_curr_p = band_lr_curr_[r].data() + x_skip;
+          const int px = prior_x[r];
+          const int py = (r == 0) ? y : prev_y;
+          const bool has_prior = (r == 0 ? x != startX : y != startY) && px >= 0 && px < width_;
+          if (!has_prior) {
+            std::copy(dc_p, dc_p + count, lr_curr_p);
+            lr_min_curr_[r][x] = *std::min_element(lr_curr_p, lr_curr_p + count);
           }
+          else {
+            const CostType* lr_p = (r == 0) ? band_lr_curr_[r].data() + (band_.Offset(py, px) - row_offset)
+                                            : band_lr_prev_[r].data() + (band_.Offset(py, px) - prev_row_offset);
+            const CostType min_lr_p = (r == 0) ? lr_min_curr_[r][px] : lr_min_prev_[r][px];
+            lr_min_curr_[r][x] = aggregate_band_step(lr_p, band_.Lo(py, px), band_.PathCount(py, px), min_lr_p,
+                                                     dc_p, lo, count, lr_curr_p, P1, P2);
+          }
+          for (int i = 0; i < count; i++)
+            sum_cost_p[i] += lr_curr_p[i];
+        }
+      }
 
-          if (regionPixelTotal <= maxSpeckleSize) {
-            regionTypes[currentLabelIndex] = true;
-            image[width_*y + x] = 0;
+      if (pass_cnt == kNumPasses - 1) {
+        ScopedStage::Clock::time_point wta_start;
+        if (stats != nullptr) wta_start = ScopedStage::Clock::now();
+        DisparityType* disparityRow = disparity_img + width_*y;
+        DisparityType* rightDisparityRow = right_disparity_img + width_*y;
+        std::fill(rightDisparityRow, rightDisparityRow + width_, static_cast<DisparityType>(0));
+        std::fill(band_right_cost_.begin(), band_right_cost_.end(), std::numeric_limits<CostType>::max());
+        for (int x = 0; x < width_; ++x) {
+          // pixels which can not match within the bounds stay invalid
+          if (band_.Empty(y, x)) {
+            disparityRow[x] = 0;
+            continue;
+          }
+          const CostType* sum_cost_p = sum_cost_row + (band_.Offset(y, x) - row_offset);
+          const int lo = band_.Lo(y, x);
+          const int count = band_.Count(y, x);
+          disparityRow[x] = static_cast<DisparityType>(lo*disparity_factor_) +
+                            SelectDisparity(sum_cost_p, 1, count);
+          // right pixel x-d matches left pixel x, the right disparities only feed the LR check
+          // so they are not refined
+          for (int i = 0; i < count; i++) {
+            const int xr = x - lo - i;
+            if (sum_cost_p[i] < band_right_cost_[xr]) {
+              band_right_cost_[xr] = sum_cost_p[i];
+              rightDisparityRow[xr] = static_cast<DisparityType>((lo + i)*disparity_factor_);
+            }
           }
         }
+        if (stats != nullptr) wta_ms += ScopedStage::ElapsedMs(wta_start);
       }
+
+      std::swap(band_lr_curr_, band_lr_prev_);
+      std::swap(lr_min_curr_, lr_min_prev_);
     }
+    if (stats != nullptr && pass_cnt == kNumPasses - 1) stats->AddStage("wta", wta_ms);
   }
 }
 
-void SGMStereo::EnforceLeftRightConsistency(DisparityType* left_disparity_image,
-                                            DisparityType* right_disparity_image) const {
-  // Check left disparity image
-  for (int y = 0; y < height_; ++y) {
-    for (int x = 0; x < width_; ++x) {
-      if (left_disparity_image[width_*y + x] == 0) continue;
-
-      int leftDisparityValue = static_cast<int>(static_cast<double>(
-            left_disparity_image[width_*y + x])/disparity_factor_ + 0.5);
-      if (x - leftDisparityValue < 0) {
-        left_disparity_image[width_*y + x] = 0;
-        continue;
-      }
-
-      int rightDisparityValue = static_cast<int>(static_cast<double>(
-            right_disparity_image[width_*y + x-leftDisparityValue])/disparity_factor_ + 0.5);
-      if (rightDisparityValue == 0 || abs(leftDisparityValue - rightDisparityValue) > consistency_threshold_) {
-        left_disparity_image[width_*y + x] = 0;
-      }
+// winner takes all with parabolic subpixel refinement, costs[d*stride] is the cost of disparity d
+template<typename SumCostType>
+SGMStereo::DisparityType SGMStereo::SelectDisparity(const SumCostType* costs, const int stride,
+                                                    const int num_disparities) const {
+  SumCostType bestSumCost = costs[0];
+  int bestDisparity = 0;
+  for (int d = 1; d < num_disparities; ++d) {
+    if (costs[d*stride] < bestSumCost) {
+      bestSumCost = costs[d*stride];
+      bestDisparity = d;
     }
   }
+  //std::cout << bestDisparity << "\n";
 
-  // Check right disparity image
-  for (int y = 0; y < height_; ++y) {
-    for (int x = 0; x < width_; ++x) {
-      if (right_disparity_image[width_*y + x] == 0)  continue;
-
-      int rightDisparityValue = static_cast<int>(static_cast<double>(
-            right_disparity_image[width_*y + x])/disparity_factor_ + 0.5);
-      if (x + rightDisparityValue >= width_) {
-        right_disparity_image[width_*y + x] = 0;
-        continue;
-      }
+  if (bestDisparity > 0 && bestDisparity < num_disparities - 1) {
+    // the refinement is done in float, the differences of 16-bit costs would wrap
+    return RefineDisparity(bestDisparity, costs[(bestDisparity - 1)*stride], costs[bestDisparity*stride],
+                           costs[(bestDisparity + 1)*stride]);
+  }
+  return static_cast<CostType>(bestDisparity*disparity_factor_);
+}
 
-      int leftDisparityValue = static_cast<int>(static_cast<double>(
-            left_disparity_image[width_*y + x+rightDisparityValue])/disparity_factor_ + 0.5);
-      if (leftDisparityValue == 0 || abs(rightDisparityValue - leftDisparityValue) > consistency_threshold_) {
-        right_disparity_image[width_*y + x] = 0;
-      }
-    }
+SGMStereo::DisparityType SGMStereo::RefineDisparity(const int disparity, const float left_cost,
+                                                    const float center_cost, const float right_cost) const {
+  if (right_cost < left_cost) {
+    return static_cast<CostType>(disparity*disparity_factor_
+        + static_cast<double>(right_cost - left_cost) /
+        (center_cost - left_cost)/2.0*disparity_factor_ + 0.5);
+  }
+  else {
+    return static_cast<CostType>(disparity*disparity_factor_
+        + static_cast<double>(right_cost - left_cost) /
+        (center_cost - right_cost)/2.0*disparity_factor_ + 0.5);
   }
 }
 
-void SGMStereo::LoadRepresentationFromFile(const std::string& descriptors_path,
-                                           DescriptorTensor* descriptors) {
-  std::ifstream file(descriptors_path, std::ios::binary);
-
-  int dims;
-  file.read(reinterpret_cast<char*>(&dims), sizeof(dims));
-  if (dims != 3) throw 1;
-  std::vector<uint64_t> size;
-  size.assign(dims, 0);
-  for (int i = 0; i < dims; i++) {
-    file.read(reinterpret_cast<char*>(&size[i]), sizeof(size[i]));
-  }
-  height_ = size[0];
-  width_ = size[1];
-
-  descriptors->resize(size[0]);
-  for (uint64_t i = 0; i < size[0]; i++) {
-    (*descriptors)[i].assign(size[1], Eigen::VectorXf(size[2]));
-    for (uint64_t j = 0; j < size[1]; j++) {
-      for (uint64_t k = 0; k < size[2]; k++)
-        file.read(reinterpret_cast<char*>(&(*descriptors)[i][j][k]), sizeof((*descriptors)[i][j][k]));
-    }
+// Only the left disparities are output so the right image is checked against nothing, it is
+// just read.
+void SGMStereo::WriteConsistentDisparities(uint16_t* disparity, const size_t stride) const {
+  // the factor is a power of two so the product is exactly the quotient
+  const double inverse_factor = 1.0 / disparity_factor_;
+  #pragma omp parallel for
+  for (int y = 0; y < height_; y++) {
+    WriteConsistentRow(left_disp_image_ + width_*y, right_disp_image_ + width_*y, width_, inverse_factor,
+                       consistency_threshold_, disparity + y*stride);
   }
 }
 
+void SGMStereo::LoadRepresentationFromFile(const std::string& descriptors_path,
+                                           DescriptorTensor* descriptors) const {
+  // the tensor is mapped in place, there is no per pixel allocation or copy
+  descriptors->Load(descriptors_path, overlapped_loading_);
+}
+
 } // namespace recon
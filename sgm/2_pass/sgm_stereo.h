@@ -1,17 +1,31 @@
 #ifndef RECONSTRUCTION_BASE_SGM_STEREO_H_
 #define RECONSTRUCTION_BASE_SGM_STEREO_H_
 
+#include <atomic>
+#include <cstdint>
+#include <functional>
 #include <iostream>
 #include <fstream>
+#include <memory>
+#include <vector>
 #include <opencv2/core/core.hpp>
 #include <Eigen/Core>
 
+#include "descriptor_costs.h"
+#include "descriptor_projection.h"
+#include "descriptor_tensor.h"
+#include "../common/candidate_aggregation.h"
+#include "../common/disparity_band.h"
+#include "../common/speckle_filter.h"
+#include "../common/stage_stats.h"
+
 namespace recon {
 
 class SGMStereo {
   typedef float CostType;
   typedef float DisparityType;
-  typedef std::vector<std::vector<Eigen::VectorXf, Eigen::aligned_allocator<Eigen::VectorXf>>> DescriptorTensor;
+  typedef uint16_t QuantizedCostType;
+  typedef CandidateAggregator<CostType, CostType, CostType> CandidateAggregatorType;
 
   // Default parameters
   static const int kNumPaths = 4;
@@ -20,31 +34,187 @@ class SGMStereo {
   static const int kP1 = 3;
   static const int kP2 = 40;
   static const int kConsistencyThreshold = 1;
+  static const int kStripHalo = 64;
+  static const int kQuantizationScale = 64;
+  static const int kWavefrontBlock = 32;
+
+  // the aggregated costs of the 4 paths for one image row and their minima per pixel
+  struct PathRows {
+    CostType* costs[kNumPaths];
+    CostType* mins[kNumPaths];
+  };
+  // State of one aggregation of a full range volume, every concurrent aggregation has its own.
+  // The rows of a pass are a wavefront over num_threads threads which cycle through num_slots
+  // path rows, the strips keep one more slot for the top-down paths they hand on.
+  struct AggregationScratch {
+    int num_threads = 0;
+    int num_slots = 0;
+    std::vector<CostType> sum_cost;
+    std::vector<CostType> path_costs;
+    std::vector<CostType> path_mins;
+    // pixels finished in each row of the pass
+    std::unique_ptr<std::atomic<int>[]> progress;
+  };
 
  public:
+  // the largest range whose disparities * kDisparityFactor still fit the 16-bit output
+  static const int kMaxDisparityRange = 65536 / kDisparityFactor;
+
   SGMStereo();
+  ~SGMStereo();
+  SGMStereo(const SGMStereo&) = delete;
+  SGMStereo& operator=(const SGMStereo&) = delete;
+  // stats is optional, when given it receives the time and memory of every stage
   void Compute(const std::string left_descriptors_path,
                const std::string right_descriptors_path,
-               cv::Mat* disparity);
+               cv::Mat* disparity,
+               FrameStats* stats = nullptr);
+  // same on descriptors which are already loaded, with overlapped loading the rows are
+  // waited for as the costs are computed
+  void Compute(const DescriptorTensor& left_descriptors,
+               const DescriptorTensor& right_descriptors,
+               cv::Mat* disparity,
+               FrameStats* stats = nullptr);
+  // same writing the 16-bit disparities (disparity * 256, 0 is invalid) straight into the caller's
+  // buffer of height rows of width values, stride elements apart
+  void Compute(const DescriptorTensor& left_descriptors,
+               const DescriptorTensor& right_descriptors,
+               uint16_t* disparity,
+               const size_t stride,
+               FrameStats* stats = nullptr);
+  bool overlapped_loading() const { return overlapped_loading_; }
   void SetSmoothnessCostParameters(const int P1, const int P2);
+  // between 2 and kMaxDisparityRange
+  void SetDisparityRange(const int disp_range);
   void SetConsistencyThreshold(const int consistency_threshold);
+  // start computing the costs of the rows which are already loaded while the rest of the descriptors are read
+  void SetOverlappedLoading(const bool overlapped);
+  void SetDescriptorCost(const DescriptorCost cost);
+  // aggregate only the left cost volume and read the right disparities diagonally from it
+  // instead of aggregating a second, sheared right cost volume. Otherwise the two volumes are
+  // aggregated at once on half of the threads each, which takes a second summed volume.
+  void SetSingleAggregation(const bool single_aggregation);
+  // Coarse-to-fine search: the full disparity range is only searched on the descriptors
+  // downsampled levels times, every finer level searches band_radius disparities around the
+  // upsampled disparities of the level below. The band levels always take the right
+  // disparities from the left volume. 0 levels searches the full range at full resolution.
+  void SetPyramid(const int levels, const int band_radius);
+  // Searches only [min_disp, max_disp], the disparity range becomes max_disp + 1 and is limited to
+  // kMaxDisparityRange like SetDisparityRange. Pixels closer
+  // to the left border than min_disp have no match and stay invalid.
+  void SetDisparityBounds(const int min_disp, const int max_disp);
+  // Optional inclusive per-row bounds, e.g. from a ground plane prior, which narrow the
+  // disparity bounds further. Each table is empty or holds one entry per image row.
+  void SetRowDisparityBounds(const std::vector<int>& row_min, const std::vector<int>& row_max);
+  // Caps the buffers of the full range search at max_bytes, 0 removes the cap. Images whose
+  // volumes do not fit are processed in horizontal strips which only hold the volumes of the
+  // strip and of halo_rows rows below it. The top-down paths continue exactly from strip to strip,
+  // the bottom-up paths of a strip start at the bottom of its halo. Strips always take the right
+  // disparities from the left volume. The band modes size their volumes per frame and ignore the cap,
+  // the mapped descriptors are file backed and not counted either.
+  void SetMemoryLimit(const size_t max_bytes, const int halo_rows = kStripHalo);
+  // Quantizes the costs of the full range search to 16 bits, round(cost * scale), and aggregates
+  // the paths in saturating 16-bit arithmetic, P1 and P2 are scaled alike. The costs saturate
+  // at 65535 / 8 - P2 * scale so the sum of the 8 paths, each bounded by C_max + P2, fits
+  // 16 bits. The quantized volumes take half the memory and always give the right disparities
+  // from the left volume, the whole image is matched at once and the band modes keep float costs.
+  // Unlike the float volumes the quantized ones are aggregated on a single thread.
+  void SetQuantization(const bool quantized, const float scale = kQuantizationScale);
+  // Memory efficient full range search which stores neither the cost nor the summed volume:
+  // every pixel keeps the num_candidates disparities with the smallest sums of each pass and the
+  // costs are computed again by each of the three sweeps (see CandidateAggregator), so the memory
+  // is W x H x 2 * num_candidates candidates instead of W x H x D volumes. The winner is the same
+  // as the full search's whenever it is among the candidates. The right disparities are the best
+  // candidates which fall on each right pixel. Takes precedence over the quantization and the
+  // memory limit, the band modes ignore it. 0 turns it off.
+  void SetCandidateAggregation(const int num_candidates);
+  // Maps the descriptors of every frame to k channels before matching, see DescriptorProjection.
+  // The W x H x D costs then take C / k times less work for W x H x C x k of projection. An empty
+  // projection matches the descriptors as they are.
+  void SetProjection(const DescriptorProjection& projection);
+  // The cost volumes and row buffers are kept between calls and only reallocated when the
+  // image size, disparity range or aggregation mode change. Warmup allocates them for
+  // width x height descriptors ahead of the first frame and faults their pages in.
+  void Warmup(const int width, const int height);
 
  private:
   void LoadRepresentationFromFile(const std::string& descriptors_path,
-                                  DescriptorTensor* descriptors);
-  void Initialize(const DescriptorTensor& left_desc, const DescriptorTensor& right_desc);
+                                  DescriptorTensor* descriptors) const;
+  size_t DescriptorBytes(const DescriptorTensor& descriptors) const;
+  // fills left_disp_image_ and right_disp_image_ before any filtering
+  void Match(const DescriptorTensor& left_descriptors,
+             const DescriptorTensor& right_descriptors,
+             FrameStats* stats);
+  void MatchQuantized(const DescriptorTensor& left_descriptors,
+                      const DescriptorTensor& right_descriptors,
+                      FrameStats* stats);
+  void MatchCandidates(const DescriptorTensor& left_descriptors,
+                       const DescriptorTensor& right_descriptors,
+                       FrameStats* stats);
+  void MatchStrips(const DescriptorTensor& left_descriptors,
+                   const DescriptorTensor& right_descriptors,
+                   FrameStats* stats);
+  void MatchBand(const DescriptorTensor& left_descriptors,
+                 const DescriptorTensor& right_descriptors,
+                 FrameStats* stats);
+  void ComputeCoarseBand(const DescriptorTensor& left_descriptors,
+                         const DescriptorTensor& right_descriptors);
+  SGMStereo& CoarseEngine();
+  // the band volumes are used whenever not the full range of every pixel is searched
+  bool Banded() const {
+    return pyramid_levels_ > 0 || min_disp_ > 0 || !row_min_disp_.empty() || !row_max_disp_.empty();
+  }
+  bool Initialize(const DescriptorTensor& left_desc, const DescriptorTensor& right_desc);
   void SetImageSize(const DescriptorTensor& left_desc, const DescriptorTensor& right_desc);
-  void AllocateDataBuffer();
+  bool AllocateDataBuffer();
+  // rows per strip under the memory limit, 0 when the volumes of the whole image fit
+  int StripRows() const;
+  size_t DataBufferBytes() const;
   void ComputeCostImage(const DescriptorTensor& left_descriptors,
                         const DescriptorTensor& right_descriptors);
+  // costs of the rows [first_row, last_row), stored from the start of left_cost_
   void ComputeLeftCostImage(const DescriptorTensor& left_descriptors,
-                            const DescriptorTensor& right_descriptors);
+                            const DescriptorTensor& right_descriptors,
+                            const int first_row, const int last_row);
   void ComputeRightCostImage();
+  // costs of row y with the kernels of the descriptor type, see ComputeDescriptorCostRow
+  void ComputeCostRow(const DescriptorTensor& left_descriptors, const DescriptorTensor& right_descriptors,
+                      const int y, CostType* costs) const;
+  // costs of row y for the disparities of band_, see ComputeDescriptorCostBandRow
+  void ComputeCostBandRow(const DescriptorTensor& left_descriptors, const DescriptorTensor& right_descriptors,
+                          const int y, CostType* costs) const;
 
-  void PerformSGM(const CostType* data_cost, DisparityType* disparity_img);
-  void EnforceLeftRightConsistency(DisparityType* left_disparity_image,
-                                   DisparityType* right_disparity_image) const;
-  void SpeckleFilter(const int maxSpeckleSize, const int maxDifference, DisparityType* image) const;
+  // the left and right volumes are aggregated at once when they do not share one scratch
+  bool ConcurrentAggregation(const int num_threads) const { return !single_aggregation_ && num_threads > 1; }
+  void AllocateScratch(const int num_threads, const int volume_rows, const bool carry,
+                       AggregationScratch* scratch) const;
+  size_t ScratchBytes(const AggregationScratch& scratch) const;
+  // path rows of a slot of the scratch, slot num_slots holds the carried paths
+  PathRows ScratchRows(AggregationScratch* scratch, const int slot) const;
+  void PerformSGM(const CostType* data_cost, DisparityType* disparity_img,
+                  DisparityType* right_disparity_img, AggregationScratch* scratch, FrameStats* stats) const;
+  void AggregatePass(const CostType* data_cost, CostType* sum_cost, const int num_rows, const int pass_cnt,
+                     const bool carry_in, const bool carry_out, AggregationScratch* scratch,
+                     const std::function<void(int)>& row_done) const;
+  void AggregateRow(const CostType* data_cost_row, const PathRows* prev, const PathRows& curr,
+                    CostType* sum_cost_row, const int pass_cnt, const std::atomic<int>* prev_done,
+                    std::atomic<int>* done) const;
+  void PerformQuantizedSGM(DisparityType* disparity_img, DisparityType* right_disparity_img,
+                           FrameStats* stats);
+  bool CandidateAggregation() const { return num_candidates_ > 0 && !Banded(); }
+  // the quantized mode selects from 16-bit costs
+  bool Quantized() const { return quantized_ && !Banded() && !CandidateAggregation(); }
+  template<typename SumCostType>
+  void SelectRowDisparities(const SumCostType* sum_cost_row, const int y, DisparityType* disparity_img,
+                            DisparityType* right_disparity_img) const;
+  void PerformBandSGM(DisparityType* disparity_img, DisparityType* right_disparity_img, FrameStats* stats);
+  template<typename SumCostType>
+  DisparityType SelectDisparity(const SumCostType* costs, const int stride, const int num_disparities) const;
+  // parabolic subpixel refinement of an integer disparity whose neighbours are both searched
+  DisparityType RefineDisparity(const int disparity, const float left_cost, const float center_cost,
+                                const float right_cost) const;
+  // LR check of the left disparities and their fixed-point output in one row-parallel sweep
+  void WriteConsistentDisparities(uint16_t* disparity, const size_t stride) const;
   void FreeDataBuffer();
 
   // Parameter
@@ -54,6 +224,19 @@ class SGMStereo {
   CostType P1_;
   CostType P2_;
   int consistency_threshold_;
+  bool overlapped_loading_;
+  DescriptorCost descriptor_cost_;
+  bool single_aggregation_;
+  int pyramid_levels_;
+  int band_radius_;
+  int min_disp_;
+  std::vector<int> row_min_disp_;
+  std::vector<int> row_max_disp_;
+  size_t memory_limit_;
+  int halo_rows_;
+  bool quantized_;
+  float quantization_scale_;
+  int num_candidates_;
 
   // Data
   int width_;
@@ -61,11 +244,56 @@ class SGMStereo {
   //int widthStep_;
   CostType* left_cost_;
   CostType* right_cost_;
-  CostType* sum_cost_;
-  CostType* lr_prev_[kNumPaths];
-  CostType* lr_curr_[kNumPaths];
+  // band mode, the row minima of the paths
   CostType* lr_min_prev_[kNumPaths];
   CostType* lr_min_curr_[kNumPaths];
+  // full range and strip modes, the right scratch is only allocated for concurrent aggregations
+  AggregationScratch left_scratch_;
+  AggregationScratch right_scratch_;
+  DisparityType* left_disp_image_;
+  DisparityType* right_disp_image_;
+  // geometry of the allocated buffers, buffer_width_ is 0 when nothing is allocated
+  int buffer_width_;
+  int buffer_height_;
+  int buffer_disp_range_;
+  bool buffer_single_aggregation_;
+  bool buffer_banded_;
+  int buffer_strip_rows_;
+  bool buffer_quantized_;
+  int buffer_num_candidates_;
+  int buffer_num_threads_;
+
+  SpeckleFilter<DisparityType> speckle_filter_;
+
+  // quantized mode, the 16-bit cost volumes and path rows
+  std::vector<QuantizedCostType> quantized_cost_;
+  std::vector<QuantizedCostType> quantized_sum_cost_;
+  std::vector<QuantizedCostType> quantized_lr_prev_[kNumPaths];
+  std::vector<QuantizedCostType> quantized_lr_curr_[kNumPaths];
+  std::vector<QuantizedCostType> quantized_lr_min_prev_[kNumPaths];
+  std::vector<QuantizedCostType> quantized_lr_min_curr_[kNumPaths];
+
+  // candidate mode, the candidates of every pixel and the rows of the sweeps
+  CandidateAggregatorType candidate_aggregator_;
+
+  // band mode, the inclusive bounds of every row, the engine of the next coarser level
+  // and the ragged band volumes
+  std::vector<int> row_lo_;
+  std::vector<int> row_hi_;
+  std::unique_ptr<SGMStereo> coarse_;
+  DescriptorTensor coarse_left_;
+  DescriptorTensor coarse_right_;
+  // the projected descriptors of the current frame
+  DescriptorProjection projection_;
+  DescriptorTensor projected_left_;
+  DescriptorTensor projected_right_;
+  std::vector<int> coarse_disp_;
+  DisparityBand band_;
+  std::vector<CostType> band_cost_;
+  std::vector<CostType> band_sum_cost_;
+  std::vector<CostType> band_lr_prev_[kNumPaths];
+  std::vector<CostType> band_lr_curr_[kNumPaths];
+  std::vector<CostType> band_right_cost_;
 };
 
 } // namespace recon
@@ -1,5 +1,9 @@
+#include <deque>
 #include <iostream>
 #include <fstream>
+#include <future>
+#include <memory>
+#include <stdexcept>
 #include <string>
 #include <vector>
 
@@ -8,6 +12,8 @@
 #include <opencv2/highgui/highgui.hpp>
 
 #include "sgm_stereo.h"
+#include "sgm_stereo_stream.h"
+#include "../common/pair_list.h"
 
 //void ConvertDispImageToCvMat8(const png::image<png::gray_pixel_16>& img, cv::Mat& cvimg) {
 //  cvimg.create(img.get_height(), img.get_width(), CV_8U);
@@ -41,55 +47,163 @@ void ConvertFloatDispToMat16(const float* disp, const int width, const int heigh
   }
 }
 
+std::string OutputName(const std::string& left_desc_path) {
+  std::string outputBaseFilename = left_desc_path;
+  size_t slashPosition = outputBaseFilename.rfind('/');
+  if (slashPosition != std::string::npos) outputBaseFilename.erase(0, slashPosition+1);
+  size_t dotPosition = outputBaseFilename.rfind('.');
+  if (dotPosition != std::string::npos) outputBaseFilename.erase(dotPosition);
+  return outputBaseFilename + ".png";
+}
+
+void WriteDisparity(const std::string& out_folder, const std::string& left_desc_path, const cv::Mat& img16) {
+  std::string save_name = OutputName(left_desc_path);
+  cv::Mat img8;
+  //ConvertFloatDispToMat16(disparities, width, height, &img16);
+  //cv::medianBlur(img16, img16, 3);
+  ConvertMat16ToMat8(img16, &img8);
+  cv::normalize(img8, img8, 0, 255, cv::NORM_MINMAX);
+  if (!cv::imwrite(out_folder + "/disparities/" + save_name, img16)) {
+    throw std::runtime_error("[WriteDisparity] can not write the disparities of " + left_desc_path);
+  }
+  if (!cv::imwrite(out_folder + "/norm_hist/" + save_name, img8)) {
+    throw std::runtime_error("[WriteDisparity] can not write the normalized disparities of " + left_desc_path);
+  }
+}
+
+// Batch mode: one engine and workspace for all pairs, the stream loads the next pairs in the
+// background while the finished disparities are written here. Returns the number of failed pairs.
+int RunBatch(const recon::PairList& pairs, const std::string& out_folder,
+             const recon::SGMStereoStream::EngineFactory& factory) {
+  const size_t kMaxInFlight = 3;
+  recon::SGMStereoStream stream(factory, 1, kMaxInFlight);
+  std::deque<std::pair<std::string, std::future<recon::SGMStereoFrame>>> pending;
+  int failed = 0;
+  auto finish_oldest = [&]() {
+    const std::string left_path = pending.front().first;
+    try {
+      recon::SGMStereoFrame frame = pending.front().second.get();
+      WriteDisparity(out_folder, left_path, frame.disparity);
+    } catch (const std::exception& e) {
+      std::cerr << "failed " << left_path << ": " << e.what() << std::endl;
+      failed++;
+    }
+    pending.pop_front();
+  };
+  for (const auto& pair : pairs) {
+    recon::SGMStereoFrame frame;
+    frame.left_descriptors_path = pair.first;
+    frame.right_descriptors_path = pair.second;
+    if (pending.size() == kMaxInFlight) finish_oldest();
+    pending.push_back(std::make_pair(pair.first, stream.Submit(std::move(frame))));
+  }
+  while (!pending.empty()) finish_oldest();
+  std::cerr << pairs.size() - failed << "/" << pairs.size() << " pairs done" << std::endl;
+  return failed;
+}
+
 int main(int argc, char* argv[]) {
-  if (argc < 7) {
-    std::cerr << "usage: ./sgm left right out_folder P1 P2 consistency_threshold" << std::endl;
+  const std::string usage = "usage: ./sgm left right out_folder P1 P2 consistency_threshold [l2|cosine|dot]"
+                            " [memory_limit_mb] [projection]\n"
+                            "       ./sgm --list pairs.txt out_folder P1 P2 consistency_threshold [l2|cosine|dot]"
+                            " [memory_limit_mb] [projection]\n"
+                            "       ./sgm --glob 'left/*.bin' 'right/*.bin' out_folder P1 P2 consistency_threshold"
+                            " [l2|cosine|dot] [memory_limit_mb] [projection]";
+  if (argc < 2) {
+    std::cerr << usage << std::endl;
+    exit(1);
+  }
+  // pairs.txt holds one "left right" pair of descriptor paths per line
+  recon::PairList pairs;
+  const std::string mode = argv[1];
+  const bool batch = mode == "--list" || mode == "--glob";
+  int arg = 3;
+  try {
+    if (mode == "--list" && argc > 2) {
+      pairs = recon::ReadPairList(argv[2]);
+    }
+    else if (mode == "--glob" && argc > 3) {
+      pairs = recon::GlobPairs(argv[2], argv[3]);
+      arg = 4;
+    }
+    else if (!batch && argc > 2) {
+      pairs.push_back(std::make_pair(std::string(argv[1]), std::string(argv[2])));
+    }
+  } catch (const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    exit(1);
+  }
+  if (argc < arg + 4) {
+    std::cerr << usage << std::endl;
     exit(1);
   }
 
-  std::string left_desc_path = argv[1];
-  std::string right_desc_path = argv[2];
-  std::string out_folder = argv[3];
-  const int P1 = std::stoi(argv[4]);
-  const int P2 = std::stoi(argv[5]);
-  const int consistency_threshold = std::stoi(argv[6]);
+  std::string out_folder = argv[arg];
+  const int P1 = std::stoi(argv[arg + 1]);
+  const int P2 = std::stoi(argv[arg + 2]);
+  const int consistency_threshold = std::stoi(argv[arg + 3]);
+  recon::DescriptorCost descriptor_cost = recon::DescriptorCost::kL2;
+  if (argc > arg + 4) {
+    std::string cost_name = argv[arg + 4];
+    if (cost_name == "cosine") descriptor_cost = recon::DescriptorCost::kCosine;
+    else if (cost_name == "dot") descriptor_cost = recon::DescriptorCost::kDotProduct;
+    else if (cost_name != "l2") {
+      std::cerr << "unknown descriptor cost: " << cost_name << std::endl;
+      exit(1);
+    }
+  }
+  // cap of the buffers of every engine, large images are then matched in strips
+  size_t memory_limit = 0;
+  if (argc > arg + 5) memory_limit = static_cast<size_t>(std::stoul(argv[arg + 5])) << 20;
+  // reduces the descriptors before matching, written by tools/projection_fit
+  recon::DescriptorProjection projection;
+  if (argc > arg + 6) {
+    try {
+      projection.Load(argv[arg + 6]);
+    } catch (const std::exception& e) {
+      std::cerr << e.what() << std::endl;
+      exit(1);
+    }
+  }
 
   //png::image<png::rgb_pixel> leftImage(leftImageFilename);
   //png::image<png::rgb_pixel> rightImage(rightImageFilename);
 
-  recon::SGMStereo sgm;
-  sgm.SetSmoothnessCostParameters(P1, P2);
-  sgm.SetConsistencyThreshold(consistency_threshold);
-  //sps.setIterationTotal(outerIterationTotal, innerIterationTotal);
-  //sps.setWeightParameter(lambda_pos, lambda_depth, lambda_bou, lambda_smo);
-  //sps.setInlierThreshold(lambda_d);
-  //sps.setPenaltyParameter(lambda_hinge, lambda_occ, lambda_pen);
+  auto factory = [=]() {
+    std::unique_ptr<recon::SGMStereo> sgm(new recon::SGMStereo);
+    sgm->SetSmoothnessCostParameters(P1, P2);
+    sgm->SetConsistencyThreshold(consistency_threshold);
+    sgm->SetOverlappedLoading(true);
+    sgm->SetDescriptorCost(descriptor_cost);
+    sgm->SetSingleAggregation(true);
+    sgm->SetMemoryLimit(memory_limit);
+    sgm->SetProjection(projection);
+    //sps.setIterationTotal(outerIterationTotal, innerIterationTotal);
+    //sps.setWeightParameter(lambda_pos, lambda_depth, lambda_bou, lambda_smo);
+    //sps.setInlierThreshold(lambda_d);
+    //sps.setPenaltyParameter(lambda_hinge, lambda_occ, lambda_pen);
+    return sgm;
+  };
+  if (batch) return RunBatch(pairs, out_folder, factory) == 0 ? 0 : 2;
 
   //int width = leftImage.get_width();
   //int height = leftImage.get_height();
   //float* disparities = reinterpret_cast<float*>(malloc(width * height * sizeof(float)));
+  std::unique_ptr<recon::SGMStereo> sgm = factory();
   cv::Mat img16;
-  sgm.Compute(left_desc_path, right_desc_path, &img16);
+  sgm->Compute(pairs[0].first, pairs[0].second, &img16);
   //for (int i = 0; i < height; i++) {
   //  for (int j = 0; j < width; j++) {
   //    std::cout << disparities[i*width + j] << "\n";
   //  }
   //}
 
-
-  std::string outputBaseFilename = left_desc_path;
-  size_t slashPosition = outputBaseFilename.rfind('/');
-  if (slashPosition != std::string::npos) outputBaseFilename.erase(0, slashPosition+1);
-  size_t dotPosition = outputBaseFilename.rfind('.');
-  if (dotPosition != std::string::npos) outputBaseFilename.erase(dotPosition);
-  std::string save_name = outputBaseFilename + ".png";
-  cv::Mat img8;
-  //ConvertFloatDispToMat16(disparities, width, height, &img16);
-  //cv::medianBlur(img16, img16, 3);
-  ConvertMat16ToMat8(img16, &img8);
-  cv::normalize(img8, img8, 0, 255, cv::NORM_MINMAX);
-  cv::imwrite(out_folder + "/disparities/" + save_name, img16);
-  cv::imwrite(out_folder + "/norm_hist/" + save_name, img8);
+  try {
+    WriteDisparity(out_folder, pairs[0].first, img16);
+  } catch (const std::exception& e) {
+    std::cerr << "failed " << pairs[0].first << ": " << e.what() << std::endl;
+    return 2;
+  }
 
   return 0;
 }
@@ -0,0 +1,57 @@
+#include "sgm_stereo_stream.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+#include <opencv2/highgui/highgui.hpp>
+
+namespace recon {
+
+SGMStereoStream::SGMStereoStream(const EngineFactory& factory, const int num_engines,
+                                 const size_t max_in_flight)
+    : pipeline_(max_in_flight) {
+  for (int i = 0; i < std::max(1, num_engines); i++) {
+    engines_.push_back(factory());
+    if (engines_.back() == nullptr) {
+      throw std::invalid_argument("[SGMStereoStream::SGMStereoStream] the factory returned no engine");
+    }
+  }
+  // all engines share the loading mode of the first one
+  const bool overlapped = engines_[0]->overlapped_loading();
+
+  pipeline_.AddStage([overlapped](SGMStereoFrame& frame, int) {
+    ScopedStage stage(&frame.stats, "load");
+    frame.left_descriptors = std::make_shared<DescriptorTensor>();
+    frame.right_descriptors = std::make_shared<DescriptorTensor>();
+    frame.left_descriptors->Load(frame.left_descriptors_path, overlapped);
+    frame.right_descriptors->Load(frame.right_descriptors_path, overlapped);
+  });
+  pipeline_.AddStage([this](SGMStereoFrame& frame, int worker) {
+    engines_[worker]->Compute(*frame.left_descriptors, *frame.right_descriptors, &frame.disparity,
+                              &frame.stats);
+    frame.left_descriptors.reset();
+    frame.right_descriptors.reset();
+  }, static_cast<int>(engines_.size()));
+  pipeline_.AddStage([](SGMStereoFrame& frame, int) {
+    if (frame.output_path.empty()) return;
+    ScopedStage stage(&frame.stats, "encode");
+    if (!cv::imwrite(frame.output_path, frame.disparity)) {
+      throw std::runtime_error("[SGMStereoStream] can not write " + frame.output_path);
+    }
+  });
+  pipeline_.Start();
+}
+
+SGMStereoStream::~SGMStereoStream() {
+  Close();
+}
+
+std::future<SGMStereoFrame> SGMStereoStream::Submit(SGMStereoFrame frame) {
+  return pipeline_.Submit(std::move(frame));
+}
+
+void SGMStereoStream::Close() {
+  pipeline_.Stop();
+}
+
+} // namespace recon
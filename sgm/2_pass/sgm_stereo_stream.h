@@ -0,0 +1,54 @@
+#ifndef RECONSTRUCTION_BASE_SGM_STEREO_STREAM_H_
+#define RECONSTRUCTION_BASE_SGM_STEREO_STREAM_H_
+
+#include <functional>
+#include <future>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+
+#include "sgm_stereo.h"
+#include "../common/frame_pipeline.h"
+#include "../common/stage_stats.h"
+
+namespace recon {
+
+struct SGMStereoFrame {
+  std::string left_descriptors_path;
+  std::string right_descriptors_path;
+  // the 16-bit disparity map is written here in the encode stage when set
+  std::string output_path;
+
+  cv::Mat disparity;
+  FrameStats stats;
+
+  // mapped in the load stage and released after the compute stage
+  std::shared_ptr<DescriptorTensor> left_descriptors;
+  std::shared_ptr<DescriptorTensor> right_descriptors;
+};
+
+// Streaming front end of SGMStereo: load -> compute -> encode, each stage on its own threads
+// so that consecutive frames overlap. The compute stage runs num_engines SGMStereo instances
+// made by the factory, each with its own workspace. With overlapped loading the load stage
+// only maps the files and compute waits for the rows it needs. Submit blocks while
+// max_in_flight frames are unfinished.
+class SGMStereoStream {
+ public:
+  typedef std::function<std::unique_ptr<SGMStereo>()> EngineFactory;
+
+  SGMStereoStream(const EngineFactory& factory, const int num_engines = 2, const size_t max_in_flight = 4);
+  ~SGMStereoStream();
+
+  std::future<SGMStereoFrame> Submit(SGMStereoFrame frame);
+  // finishes the submitted frames
+  void Close();
+
+ private:
+  std::vector<std::unique_ptr<SGMStereo>> engines_;
+  FramePipeline<SGMStereoFrame> pipeline_;
+};
+
+} // namespace recon
+#endif
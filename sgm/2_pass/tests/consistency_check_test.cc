@@ -0,0 +1,75 @@
+// Checks that the vectorized LR consistency check writes the same 16-bit disparities as the
+// scalar one, on random rows and on values which have to saturate at 0 and 65535.
+
+#include <cstdint>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include "../consistency_check.h"
+
+namespace {
+
+int CompareRow(const std::vector<float>& left, const std::vector<float>& right, const double inverse_factor,
+               const int threshold) {
+  const int width = static_cast<int>(left.size());
+  std::vector<uint16_t> expected(width, 1), output(width, 2);
+  recon::internal::WriteConsistentRowScalar(left.data(), right.data(), 0, width, inverse_factor, threshold,
+                                            expected.data());
+  recon::WriteConsistentRow(left.data(), right.data(), width, inverse_factor, threshold, output.data());
+  int failures = 0;
+  for (int x = 0; x < width; x++) {
+    if (output[x] != expected[x]) {
+      std::cerr << "x " << x << " left " << left[x] << " wrote " << output[x] << ", expected " << expected[x]
+                << std::endl;
+      failures++;
+    }
+  }
+  return failures;
+}
+
+} // namespace
+
+int main() {
+  const double inverse_factor = 1.0 / 256;
+  std::mt19937 random(7);
+  int failures = 0;
+
+  // random sub-pixel disparities, a few zeros and widths which leave a scalar tail
+  for (int width : {1, 3, 4, 17, 640, 1023}) {
+    for (int threshold : {0, 1, 3}) {
+      std::uniform_real_distribution<float> disparity(0.0f, 64.0f * 256);
+      std::vector<float> left(width), right(width);
+      for (int x = 0; x < width; x++) {
+        left[x] = random() % 8 == 0 ? 0.0f : disparity(random);
+        right[x] = random() % 8 == 0 ? 0.0f : disparity(random);
+      }
+      // make most of the pixels consistent so the written values are compared as well
+      for (int x = 0; x < width; x++) {
+        const int d = static_cast<int>(left[x] * inverse_factor + 0.5);
+        if (x - d >= 0 && random() % 4 != 0) right[x - d] = left[x] + (random() % 512) - 256.0f;
+      }
+      failures += CompareRow(left, right, inverse_factor, threshold);
+    }
+  }
+
+  // half-way values, negative values and values beyond the 16-bit range of a consistent pixel
+  const std::vector<float> values = { 0.5f, 1.5f, 255.5f, 256.5f, -0.5f, -3.0f, -200.0f, 65534.5f,
+                                      65535.0f, 65535.5f, 65536.0f, 70000.0f, 300.0f * 256, 1e6f };
+  for (float value : values) {
+    const int width = 4100;
+    std::vector<float> left(width, value), right(width, value);
+    failures += CompareRow(left, right, inverse_factor, 1);
+    // the last pixel is consistent with every one of them which is a valid match
+    if (value >= 65535.0f) {
+      std::vector<uint16_t> output(width);
+      recon::WriteConsistentRow(left.data(), right.data(), width, inverse_factor, 1, output.data());
+      if (output[width - 1] != 65535) {
+        std::cerr << "left " << value << " wrote " << output[width - 1] << ", expected 65535" << std::endl;
+        failures++;
+      }
+    }
+  }
+
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,63 @@
+// Checks the census hamming costs of hamming_cost_row, which runs 4 disparities at a time with
+// AVX2, against a plain popcount: on random census values, on the 0 and 64 bit extremes and for
+// every max_disp around the 4 disparity steps so the scalar tail is covered too.
+
+#include <cstdint>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include "../../8_pass/stereo_costs.h"
+
+namespace {
+
+int CompareRow(const std::vector<uint64_t>& left, const std::vector<uint64_t>& right, const int x,
+               const int max_disp) {
+  std::vector<uint8_t> costs(max_disp + 4, 0xAA);
+  recon::StereoCosts::hamming_cost_row(left.data(), right.data(), x, max_disp, costs.data());
+  int failures = 0;
+  for (int d = 0; d < max_disp; d++) {
+    const int expected = __builtin_popcountll(left[x] ^ right[x - d]);
+    if (costs[d] != expected) {
+      std::cerr << "x " << x << " max_disp " << max_disp << " d " << d << ": " << static_cast<int>(costs[d])
+                << ", expected " << expected << std::endl;
+      failures++;
+    }
+  }
+  // nothing is written past max_disp
+  for (int d = max_disp; d < max_disp + 4; d++) {
+    if (costs[d] != 0xAA) {
+      std::cerr << "x " << x << " max_disp " << max_disp << " wrote past the end at " << d << std::endl;
+      failures++;
+    }
+  }
+  return failures;
+}
+
+} // namespace
+
+int main() {
+  const int width = 320;
+  std::mt19937_64 random(5);
+  int failures = 0;
+
+  std::vector<uint64_t> left(width), right(width);
+  for (int x = 0; x < width; x++) {
+    left[x] = random();
+    right[x] = random();
+  }
+  for (int max_disp = 1; max_disp <= 70; max_disp++) {
+    // the first pixel which can search max_disp disparities, and one further in
+    failures += CompareRow(left, right, max_disp - 1, max_disp);
+    failures += CompareRow(left, right, width - 1, max_disp);
+  }
+
+  // identical and complementary census values give 0 and 64
+  const std::vector<uint64_t> zeros(width, 0), ones(width, ~0ull);
+  for (int max_disp : {3, 4, 5, 16, 64, 256}) {
+    failures += CompareRow(zeros, zeros, width - 1, max_disp);
+    failures += CompareRow(zeros, ones, width - 1, max_disp);
+    failures += CompareRow(ones, zeros, max_disp - 1, max_disp);
+  }
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,123 @@
+// Checks that the AVX2 and SSE4.1 steps of the 16-bit path aggregation give the same costs and
+// minimum as the scalar step: on random inputs, on costs which saturate at 65535, and on priors
+// whose minimum sits at the 8 and 16 disparity boundaries the vector versions shift across.
+
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "../../common/path_aggregation.h"
+
+namespace {
+
+struct Step {
+  std::vector<uint16_t> prior;
+  uint16_t min_prior;
+  uint16_t P1;
+  uint16_t P2;
+};
+
+uint16_t MinPrior(const std::vector<uint16_t>& prior) {
+  uint16_t min_prior = 0xFFFF;
+  for (uint16_t value : prior) min_prior = std::min(min_prior, value);
+  return min_prior;
+}
+
+template<typename CostT, typename Kernel>
+int CompareStep(const std::string& name, Kernel kernel, const Step& step, const std::vector<CostT>& local) {
+  const int disp_range = static_cast<int>(step.prior.size());
+  std::vector<uint16_t> expected(disp_range), costs(disp_range);
+  const uint16_t expected_min = recon::internal::aggregate_path_16u_scalar(
+      step.prior.data(), step.min_prior, local.data(), expected.data(), disp_range, step.P1, step.P2);
+  const uint16_t min_cost = kernel(step.prior.data(), step.min_prior, local.data(), costs.data(), disp_range,
+                                   step.P1, step.P2);
+  int failures = 0;
+  for (int d = 0; d < disp_range; d++) {
+    if (costs[d] != expected[d]) {
+      std::cerr << name << " disp_range " << disp_range << " d " << d << ": " << costs[d] << ", expected "
+                << expected[d] << std::endl;
+      failures++;
+    }
+  }
+  if (min_cost != expected_min) {
+    std::cerr << name << " disp_range " << disp_range << " min " << min_cost << ", expected " << expected_min
+              << std::endl;
+    failures++;
+  }
+  return failures;
+}
+
+// every vector version which can run disp_range
+template<typename CostT>
+int CompareKernels(const Step& step, const std::vector<CostT>& local) {
+  const int disp_range = static_cast<int>(step.prior.size());
+  int failures = 0;
+#ifdef __AVX2__
+  if (disp_range % 16 == 0)
+    failures += CompareStep("avx2", recon::internal::aggregate_path_16u_avx2<CostT>, step, local);
+#endif
+#ifdef __SSE4_1__
+  if (disp_range % 8 == 0)
+    failures += CompareStep("sse4", recon::internal::aggregate_path_16u_sse4<CostT>, step, local);
+#endif
+  failures += CompareStep("dispatch", recon::aggregate_path_16u<CostT>, step, local);
+  return failures;
+}
+
+template<typename CostT>
+std::vector<CostT> RandomCosts(std::mt19937* random, const int disp_range, const uint32_t max_cost) {
+  std::uniform_int_distribution<uint32_t> cost(0, max_cost);
+  std::vector<CostT> local(disp_range);
+  for (CostT& value : local) value = static_cast<CostT>(cost(*random));
+  return local;
+}
+
+} // namespace
+
+int main() {
+  std::mt19937 random(11);
+  int failures = 0;
+  for (int disp_range : {8, 16, 24, 32, 40, 64, 128, 256}) {
+    // random priors and costs with small and large penalties
+    for (int i = 0; i < 50; i++) {
+      std::uniform_int_distribution<uint32_t> prior_value(0, i % 2 == 0 ? 2000 : 0xFFFF);
+      Step step;
+      step.prior.resize(disp_range);
+      for (uint16_t& value : step.prior) value = static_cast<uint16_t>(prior_value(random));
+      step.min_prior = MinPrior(step.prior);
+      step.P1 = static_cast<uint16_t>(random() % 64);
+      step.P2 = static_cast<uint16_t>(step.P1 + random() % 512);
+      failures += CompareKernels(step, RandomCosts<uint8_t>(&random, disp_range, 0xFF));
+      failures += CompareKernels(step, RandomCosts<uint16_t>(&random, disp_range, 0xFFFF));
+    }
+
+    // saturated priors, penalties and costs
+    Step saturated;
+    saturated.prior.assign(disp_range, 0xFFFF);
+    saturated.prior[disp_range / 2] = 0xFFF0;
+    saturated.min_prior = MinPrior(saturated.prior);
+    saturated.P1 = 0xFFFF;
+    saturated.P2 = 0xFFFF;
+    failures += CompareKernels(saturated, std::vector<uint16_t>(disp_range, 0xFFFF));
+    failures += CompareKernels(saturated, RandomCosts<uint16_t>(&random, disp_range, 0xFFFF));
+    failures += CompareKernels(saturated, std::vector<uint8_t>(disp_range, 0xFF));
+
+    // a single low prior on either side of every 8 and 16 disparity boundary, so the P1 neighbours
+    // have to be shifted in from the next or the previous vector
+    for (int low = 0; low < disp_range; low++) {
+      if (low % 8 != 0 && low % 8 != 7) continue;
+      Step boundary;
+      boundary.prior.assign(disp_range, 1000);
+      boundary.prior[low] = 10;
+      boundary.min_prior = MinPrior(boundary.prior);
+      boundary.P1 = 3;
+      boundary.P2 = 500;
+      failures += CompareKernels(boundary, std::vector<uint8_t>(disp_range, 0));
+      failures += CompareKernels(boundary, RandomCosts<uint16_t>(&random, disp_range, 100));
+    }
+  }
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,27 @@
+// Checks that QuantizeCosts saturates at both ends of the 16-bit range. Negative costs come
+// from the dot product on int8 or projected descriptors and must become 0, not wrap.
+
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+#include "../descriptor_costs.h"
+
+int main() {
+  const float scale = 64.0f;
+  const uint16_t max_cost = 4000;
+  const std::vector<float> costs = { -100.0f, -1.0f, -0.01f, 0.0f, 0.5f, 1.0f, 62.5f, 1000.0f };
+  const std::vector<uint16_t> expected = { 0, 0, 0, 0, 32, 64, 4000, 4000 };
+  std::vector<uint16_t> quantized(costs.size());
+  recon::QuantizeCosts(costs.data(), costs.size(), scale, max_cost, quantized.data());
+
+  int failures = 0;
+  for (size_t i = 0; i < costs.size(); i++) {
+    if (quantized[i] != expected[i]) {
+      std::cerr << "cost " << costs[i] << " quantized to " << quantized[i] << ", expected " << expected[i]
+                << std::endl;
+      failures++;
+    }
+  }
+  return failures == 0 ? 0 : 1;
+}
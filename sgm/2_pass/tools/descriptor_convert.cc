@@ -0,0 +1,58 @@
+// Converts descriptor files to the reduced precision layouts of DescriptorTensor.
+// usage: ./descriptor_convert --type=fp16|int8|fp32 [--scale=S] in out [in out ...]
+// Without --scale every int8 file gets the scale max |v| / 127 of its own descriptors. Any layout
+// can be read, so a reduced precision file can also be widened back to fp32.
+
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "../descriptor_tensor.h"
+
+int main(int argc, char** argv) {
+  const std::string usage = std::string("usage: ") + argv[0] +
+                            " --type=fp16|int8|fp32 [--scale=S] in out [in out ...]";
+  recon::DescriptorType type = recon::DescriptorType::kFloat16;
+  bool has_type = false;
+  float scale = 0.0f;
+  std::vector<std::string> paths;
+  for (int i = 1; i < argc; i++) {
+    const std::string arg = argv[i];
+    if (arg.compare(0, 7, "--type=") == 0) {
+      const std::string name = arg.substr(7);
+      has_type = true;
+      if (name == "fp16") type = recon::DescriptorType::kFloat16;
+      else if (name == "int8") type = recon::DescriptorType::kInt8;
+      else if (name == "fp32") type = recon::DescriptorType::kFloat32;
+      else has_type = false;
+    }
+    else if (arg.compare(0, 8, "--scale=") == 0) {
+      scale = std::stof(arg.substr(8));
+    }
+    else {
+      paths.push_back(arg);
+    }
+  }
+  if (!has_type || paths.empty() || paths.size() % 2 != 0) {
+    std::cerr << usage << std::endl;
+    return 1;
+  }
+
+  try {
+    recon::DescriptorTensor source, converted;
+    for (size_t i = 0; i < paths.size(); i += 2) {
+      source.Load(paths[i]);
+      converted.Convert(source, type, scale);
+      converted.Save(paths[i + 1]);
+      std::cout << paths[i] << " -> " << paths[i + 1] << ": " << converted.height() << " x " << converted.width()
+                << " x " << converted.channels();
+      if (type == recon::DescriptorType::kInt8) std::cout << ", scale " << converted.scale();
+      std::cout << std::endl;
+    }
+  } catch (const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
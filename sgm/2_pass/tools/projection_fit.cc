@@ -0,0 +1,66 @@
+// Fits the descriptor projection of SGMStereo::SetProjection on sample descriptor files.
+// usage: ./projection_fit --dims=k [--cost=l2|cosine|dot] [--samples=100000] out in [in ...]
+// The projection keeps the k principal components of up to --samples pixels of every input,
+// centered for the L2 cost. The share of the sample energy they keep is printed.
+
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "../descriptor_projection.h"
+
+int main(int argc, char** argv) {
+  const std::string usage = std::string("usage: ") + argv[0] +
+                            " --dims=k [--cost=l2|cosine|dot] [--samples=100000] out in [in ...]";
+  int dims = 0;
+  size_t max_samples = 100000;
+  recon::DescriptorCost cost = recon::DescriptorCost::kL2;
+  std::vector<std::string> paths;
+  for (int i = 1; i < argc; i++) {
+    const std::string arg = argv[i];
+    if (arg.compare(0, 7, "--dims=") == 0) {
+      dims = std::stoi(arg.substr(7));
+    }
+    else if (arg.compare(0, 10, "--samples=") == 0) {
+      max_samples = std::stoul(arg.substr(10));
+    }
+    else if (arg.compare(0, 7, "--cost=") == 0) {
+      const std::string name = arg.substr(7);
+      if (name == "l2") cost = recon::DescriptorCost::kL2;
+      else if (name == "cosine") cost = recon::DescriptorCost::kCosine;
+      else if (name == "dot") cost = recon::DescriptorCost::kDotProduct;
+      else {
+        std::cerr << "unknown descriptor cost: " << name << std::endl;
+        return 1;
+      }
+    }
+    else {
+      paths.push_back(arg);
+    }
+  }
+  if (dims <= 0 || paths.size() < 2) {
+    std::cerr << usage << std::endl;
+    return 1;
+  }
+
+  try {
+    std::vector<std::unique_ptr<recon::DescriptorTensor>> tensors;
+    std::vector<const recon::DescriptorTensor*> samples;
+    for (size_t i = 1; i < paths.size(); i++) {
+      tensors.emplace_back(new recon::DescriptorTensor);
+      tensors.back()->Load(paths[i]);
+      samples.push_back(tensors.back().get());
+    }
+    recon::DescriptorProjection projection;
+    const double kept = projection.Fit(samples, dims, cost, max_samples);
+    projection.Save(paths[0]);
+    std::cout << paths[0] << ": " << projection.input_dims() << " -> " << projection.output_dims()
+              << " channels, keeps " << 100.0 * kept << "% of the sample energy" << std::endl;
+  } catch (const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,250 @@
+#ifndef RECONSTRUCTION_BASE_COST_POLICIES_
+#define RECONSTRUCTION_BASE_COST_POLICIES_
+
+#include <cmath>
+#include <vector>
+#include <limits>
+#include <algorithm>
+
+#include <opencv2/core/core.hpp>
+
+#include <omp.h>
+
+#include "stereo_costs.h"
+#include "cost_volume.h"
+#include "../common/disparity_band.h"
+
+namespace recon
+{
+
+// Matching cost policies for StereoSGM.
+// A policy is constructed once per image pair and precomputes what its cost needs (means, census
+// signatures, ...). get_costs() then fills the costs of the pixel (x,y) of the cropped image for
+// disparities [0, max_disp) and fill_costs() the whole pixel-major cost volume, disparities which
+// fall outside the right image get the largest cost. get_band_costs() fills the costs of the disparities
+// [lo, lo + count) only, the band never reaches past the left image border. The typedefs choose the storage of the three
+// cost volumes:
+//   CostType     - matching cost
+//   PathCostType - cost aggregated along one path, uint16_t selects the saturating SIMD kernel
+//   ACostType    - sum over all paths
+
+// Fills the volume pixel by pixel with get_costs(), walking it in memory order (y, x, d)
+// so that each thread writes its rows sequentially.
+template<typename CostPolicy>
+inline
+void fill_costs_per_pixel(const CostPolicy& policy, CostVolume<typename CostPolicy::CostType>& costs)
+{
+  typedef typename CostPolicy::CostType CostType;
+  int height = costs.height();
+  int width = costs.width();
+  int disp_range = costs.disp_range();
+  #pragma omp parallel for
+  for(int y = 0; y < height; y++) {
+    for(int x = 0; x < width; x++) {
+      CostType* pix_costs = costs.ptr(y,x);
+      int max_disp = std::min(disp_range, x+1);
+      policy.get_costs(x, y, max_disp, pix_costs);
+      // disparities which fall outside the right image
+      // CostType needs to be smaller then ACostType for int types
+      for(int d = max_disp; d < disp_range; d++)
+        pix_costs[d] = std::numeric_limits<CostType>::max();
+    }
+  }
+}
+
+// Fills the costs of the rows [first_row, first_row + num_rows) like fill_costs_per_pixel,
+// num_rows x width x disp_range in pixel-major order without padding
+template<typename CostPolicy>
+inline
+void fill_row_costs(const CostPolicy& policy, int first_row, int num_rows, int width, int disp_range,
+                    typename CostPolicy::CostType* costs)
+{
+  typedef typename CostPolicy::CostType CostType;
+  #pragma omp parallel for
+  for(int i = 0; i < num_rows; i++) {
+    for(int x = 0; x < width; x++) {
+      CostType* pix_costs = costs + (static_cast<size_t>(i)*width + x)*disp_range;
+      int max_disp = std::min(disp_range, x+1);
+      policy.get_costs(x, first_row + i, max_disp, pix_costs);
+      for(int d = max_disp; d < disp_range; d++)
+        pix_costs[d] = std::numeric_limits<CostType>::max();
+    }
+  }
+}
+
+// Fills a ragged band volume, the costs of the pixel (x,y) start at band.Offset(y,x)
+template<typename CostPolicy>
+inline
+void fill_band_costs(const CostPolicy& policy, const DisparityBand& band, typename CostPolicy::CostType* costs)
+{
+  int height = band.height();
+  int width = band.width();
+  #pragma omp parallel for
+  for(int y = 0; y < height; y++) {
+    for(int x = 0; x < width; x++)
+      policy.get_band_costs(x, y, band.Lo(y,x), band.Count(y,x), costs + band.Offset(y,x));
+  }
+}
+
+// SAD
+struct CostSAD
+{
+  typedef uint16_t CostType;
+  typedef uint32_t ACostType;
+  typedef uint16_t PathCostType;
+
+  CostSAD(const cv::Mat& left_img, const cv::Mat& right_img, int wsz)
+      : left_img_(left_img), right_img_(right_img), wsz_(wsz), mc_((wsz-1)/2) {}
+
+  void get_costs(int x, int y, int max_disp, CostType* costs) const {
+    int ix = x + mc_;
+    int iy = y + mc_;
+    for(int d = 0; d < max_disp; d++)
+      costs[d] = StereoCosts::get_cost_SAD(left_img_, right_img_, wsz_, ix, iy, d);
+  }
+
+  void get_band_costs(int x, int y, int lo, int count, CostType* costs) const {
+    for(int i = 0; i < count; i++)
+      costs[i] = StereoCosts::get_cost_SAD(left_img_, right_img_, wsz_, x + mc_, y + mc_, lo + i);
+  }
+
+  // box filtered, the cost of a pixel does not depend on the window size
+  void fill_costs(CostVolume<CostType>& costs) const {
+    int height = costs.height();
+    int disp_range = costs.disp_range();
+    // the running sums are sequential in y so every thread takes one band of rows
+    #pragma omp parallel
+    {
+      int num_threads = omp_get_num_threads();
+      int band = (height + num_threads - 1) / num_threads;
+      int y_begin = std::min(height, omp_get_thread_num() * band);
+      int y_end = std::min(height, y_begin + band);
+      if(y_begin < y_end)
+        StereoCosts::sad_cost_rows(left_img_, right_img_, wsz_, disp_range, y_begin, y_end,
+                                   costs.row(y_begin), costs.row_stride(), costs.x_stride());
+    }
+  }
+
+  const cv::Mat& left_img_;
+  const cv::Mat& right_img_;
+  int wsz_;
+  int mc_;
+};
+
+// ZSAD - 3x3, 2, 130
+struct CostZSAD
+{
+  typedef float CostType;
+  typedef float ACostType;
+  typedef float PathCostType;
+
+  CostZSAD(const cv::Mat& left_img, const cv::Mat& right_img, int wsz)
+      : left_img_(left_img), right_img_(right_img), wsz_(wsz), mc_((wsz-1)/2) {
+    StereoCosts::calcPatchMeans(left_img, left_means_, wsz);
+    StereoCosts::calcPatchMeans(right_img, right_means_, wsz);
+  }
+
+  void get_costs(int x, int y, int max_disp, CostType* costs) const {
+    int ix = x + mc_;
+    int iy = y + mc_;
+    for(int d = 0; d < max_disp; d++)
+      costs[d] = StereoCosts::get_cost_ZSAD(left_img_, right_img_, left_means_, right_means_, wsz_, ix, iy, d);
+  }
+
+  void get_band_costs(int x, int y, int lo, int count, CostType* costs) const {
+    for(int i = 0; i < count; i++)
+      costs[i] = StereoCosts::get_cost_ZSAD(left_img_, right_img_, left_means_, right_means_, wsz_,
+                                            x + mc_, y + mc_, lo + i);
+  }
+
+  void fill_costs(CostVolume<CostType>& costs) const { fill_costs_per_pixel(*this, costs); }
+
+  const cv::Mat& left_img_;
+  const cv::Mat& right_img_;
+  cv::Mat left_means_, right_means_;
+  int wsz_;
+  int mc_;
+};
+
+// Census with up to 64-bit signatures
+// Daimler: Traffic - 10, 50; Middlebury - 7, 20
+struct CostCensus
+{
+  typedef uint8_t CostType;  // for 1x1 SAD, up to 64-bit Census
+  typedef uint32_t ACostType;
+  typedef uint16_t PathCostType;
+
+  CostCensus(const cv::Mat& left_img, const cv::Mat& right_img, int wsz) : mc_((wsz-1)/2) {
+    StereoCosts::CensusWindow window = census_window(wsz);
+    StereoCosts::census_transform_64(left_img, window, left_census_);
+    StereoCosts::census_transform_64(right_img, window, right_census_);
+  }
+
+  // dense square windows up to 7x7, 9 uses the 62-bit 9x7 window and larger ones a sparse census
+  static StereoCosts::CensusWindow census_window(int wsz) {
+    if(wsz*wsz - 1 <= 64)
+      return StereoCosts::CensusWindow{wsz, wsz, 1};
+    if(wsz == 9)
+      return StereoCosts::CensusWindow{9, 7, 1};
+    return StereoCosts::CensusWindow{wsz, wsz, 2};
+  }
+
+  void get_costs(int x, int y, int max_disp, CostType* costs) const {
+    // the census images are not cropped
+    const uint64_t* left_row = left_census_.ptr<uint64_t>(y + mc_) + mc_;
+    const uint64_t* right_row = right_census_.ptr<uint64_t>(y + mc_) + mc_;
+    StereoCosts::hamming_cost_row(left_row, right_row, x, max_disp, costs);
+  }
+
+  void get_band_costs(int x, int y, int lo, int count, CostType* costs) const {
+    const uint64_t* left_row = left_census_.ptr<uint64_t>(y + mc_) + mc_;
+    const uint64_t* right_row = right_census_.ptr<uint64_t>(y + mc_) + mc_;
+    // shifting the left row by lo makes the disparity i of the row kernel the disparity lo + i
+    StereoCosts::hamming_cost_row(left_row + lo, right_row, x - lo, count, costs);
+  }
+
+  void fill_costs(CostVolume<CostType>& costs) const { fill_costs_per_pixel(*this, costs); }
+
+  int mc_;
+  cv::Mat left_census_, right_census_;
+};
+
+// NCC mapped to [0, 2*kScale] so that it can be minimized and aggregated in 16-bit ints,
+// patches without texture get the largest cost
+struct CostNCC
+{
+  typedef uint16_t CostType;
+  typedef uint32_t ACostType;
+  typedef uint16_t PathCostType;
+  static constexpr double kScale = 128.0;
+
+  CostNCC(const cv::Mat& left_img, const cv::Mat& right_img, int wsz) : width_(left_img.cols - (wsz-1)) {
+    StereoCosts::compute_image_ncc_descriptors(left_img, wsz, left_desc_);
+    StereoCosts::compute_image_ncc_descriptors(right_img, wsz, right_desc_);
+  }
+
+  void get_costs(int x, int y, int max_disp, CostType* costs) const {
+    const core::DescriptorNCC& left = left_desc_[y*width_ + x];
+    for(int d = 0; d < max_disp; d++) {
+      double ncc = StereoCosts::get_cost_NCC(left, right_desc_[y*width_ + x - d]);
+      costs[d] = static_cast<CostType>(std::round((1.0 - ncc) * kScale));
+    }
+  }
+
+  void get_band_costs(int x, int y, int lo, int count, CostType* costs) const {
+    const core::DescriptorNCC& left = left_desc_[y*width_ + x];
+    for(int i = 0; i < count; i++) {
+      double ncc = StereoCosts::get_cost_NCC(left, right_desc_[y*width_ + x - lo - i]);
+      costs[i] = static_cast<CostType>(std::round((1.0 - ncc) * kScale));
+    }
+  }
+
+  void fill_costs(CostVolume<CostType>& costs) const { fill_costs_per_pixel(*this, costs); }
+
+  int width_;
+  std::vector<core::DescriptorNCC> left_desc_, right_desc_;
+};
+
+}
+
+#endif
@@ -0,0 +1,116 @@
+#ifndef RECONSTRUCTION_BASE_COST_VOLUME_
+#define RECONSTRUCTION_BASE_COST_VOLUME_
+
+#include <cstdlib>
+#include <cstddef>
+#include <cassert>
+#include <new>
+#include <utility>
+#include <algorithm>
+
+namespace recon
+{
+
+// Single contiguous, cache line aligned H x W x D cost volume with explicit strides.
+// All disparities of one pixel are contiguous ([y][x][d]) and padded to a multiple of
+// kAlignment bytes so that every pixel starts at an aligned address.
+template<typename T>
+class CostVolume
+{
+ public:
+  static const size_t kAlignment = 64;
+
+  CostVolume() {}
+  CostVolume(int height, int width, int disp_range) {
+    create(height, width, disp_range);
+  }
+  ~CostVolume() { std::free(data_); }
+
+  CostVolume(const CostVolume&) = delete;
+  CostVolume& operator=(const CostVolume&) = delete;
+  CostVolume(CostVolume&& other) { *this = std::move(other); }
+  CostVolume& operator=(CostVolume&& other);
+
+  // the buffer is reallocated only if the new volume does not fit into the current one
+  void create(int height, int width, int disp_range);
+  void fill(T val) { std::fill(data_, data_ + size(), val); }
+
+  T* data() { return data_; }
+  const T* data() const { return data_; }
+  T* row(int y) { return data_ + y*row_stride_; }
+  const T* row(int y) const { return data_ + y*row_stride_; }
+  // contiguous costs of the pixel (y,x)
+  T* ptr(int y, int x) { return data_ + y*row_stride_ + x*x_stride_; }
+  const T* ptr(int y, int x) const { return data_ + y*row_stride_ + x*x_stride_; }
+  T& at(int y, int x, int d) { return data_[y*row_stride_ + x*x_stride_ + d]; }
+  const T& at(int y, int x, int d) const { return data_[y*row_stride_ + x*x_stride_ + d]; }
+
+  int height() const { return height_; }
+  int width() const { return width_; }
+  int disp_range() const { return disp_range_; }
+  // strides are given in elements
+  size_t row_stride() const { return row_stride_; }
+  size_t x_stride() const { return x_stride_; }
+  // number of elements including the padding
+  size_t size() const { return height_ * row_stride_; }
+  bool empty() const { return data_ == nullptr; }
+
+ private:
+  static size_t aligned_extent(size_t n) {
+    size_t bytes = (n * sizeof(T) + kAlignment - 1) / kAlignment * kAlignment;
+    return bytes / sizeof(T);
+  }
+
+  T* data_ = nullptr;
+  size_t capacity_ = 0;
+  int height_ = 0;
+  int width_ = 0;
+  int disp_range_ = 0;
+  size_t row_stride_ = 0;
+  size_t x_stride_ = 0;
+};
+
+template<typename T>
+inline
+CostVolume<T>& CostVolume<T>::operator=(CostVolume&& other)
+{
+  if(this != &other) {
+    std::free(data_);
+    data_ = other.data_;
+    capacity_ = other.capacity_;
+    height_ = other.height_;
+    width_ = other.width_;
+    disp_range_ = other.disp_range_;
+    row_stride_ = other.row_stride_;
+    x_stride_ = other.x_stride_;
+    other.data_ = nullptr;
+    other.capacity_ = 0;
+    other.height_ = other.width_ = other.disp_range_ = 0;
+    other.row_stride_ = other.x_stride_ = 0;
+  }
+  return *this;
+}
+
+template<typename T>
+inline
+void CostVolume<T>::create(int height, int width, int disp_range)
+{
+  assert(height > 0 && width > 0 && disp_range > 0);
+  height_ = height;
+  width_ = width;
+  disp_range_ = disp_range;
+  x_stride_ = aligned_extent(disp_range);
+  row_stride_ = x_stride_ * width;
+
+  if(size() > capacity_) {
+    std::free(data_);
+    data_ = nullptr;
+    if(posix_memalign(reinterpret_cast<void**>(&data_), kAlignment, size() * sizeof(T)) != 0)
+      throw std::bad_alloc();
+    capacity_ = size();
+  }
+}
+
+}
+
+#endif
@@ -1,30 +1,20 @@
+#include <deque>
+#include <future>
 #include <vector>
 #include <string>
 #include <iostream>
+#include <memory>
+#include <stdexcept>
 
 #include <opencv2/imgproc/imgproc.hpp>
 #include <opencv2/highgui/highgui.hpp>
 
 #include "../stereo_sgm.h"
+#include "../stereo_stream.h"
+#include "../../common/pair_list.h"
 
-void RunSGM(const int P1, const int P2, const std::string left_img_fname, const std::string right_img_fname,
-            const std::string output_folder)
+recon::StereoSGMParams MakeParams(const int P1, const int P2, const recon::StereoCost cost)
 {
-  std::vector<int> compression_params;
-  compression_params.push_back(CV_IMWRITE_PNG_COMPRESSION);
-  compression_params.push_back(9);
-
-  //cv::Mat img_disp, img_disp_subpixel, mat_disp;
-  cv::Mat img_disp, img8_disp;
-  cv::Mat img_left = cv::imread(left_img_fname, CV_LOAD_IMAGE_GRAYSCALE);
-  cv::Mat img_right = cv::imread(right_img_fname, CV_LOAD_IMAGE_GRAYSCALE);
-  //cv::imshow("img_left", img_left);
-  //cv::waitKey(0);
-
-  //double sigma = 0.7;
-  //cv::GaussianBlur(img_left, img_left, cv::Size(3,3), sigma);
-  //cv::GaussianBlur(img_right, img_right, cv::Size(3,3), sigma);
-
   recon::StereoSGMParams sgm_params;
   sgm_params.disp_range = 256;
   //sgm_params.window_sz = 1;
@@ -35,9 +25,15 @@ void RunSGM(const int P1, const int P2, const std::string left_img_fname, const
   //sgm_params.penalty2 = 100;
   //sgm_params.penalty2 = 50;        // best - 60 Daimler - 50
   sgm_params.penalty2 = P2;          // best - 60 Daimler - 50
+  // each concurrent direction needs its own W x H x D path volume
+  sgm_params.num_concurrent_paths = 4;
+  sgm_params.cost = cost;
+  return sgm_params;
+}
 
-  recon::StereoSGM sgm(sgm_params);
-  sgm.compute(img_left, img_right, img_disp);
+void WriteDisparity(const cv::Mat& img_disp, const std::string& left_img_fname, const std::string& output_folder)
+{
+  cv::Mat img8_disp;
   img_disp.convertTo(img8_disp, CV_8U, 1.0/256.0);
 
   std::string prefix = left_img_fname;
@@ -49,30 +45,128 @@ void RunSGM(const int P1, const int P2, const std::string left_img_fname, const
   //cv::Mat img8_disp_eq;
   //cv::equalizeHist(img8_disp, img8_disp);
   cv::Mat img_norm_hist;
-  cv::imwrite(output_folder + "/disparities/" + prefix + ".png", img_disp);
+  if (!cv::imwrite(output_folder + "/disparities/" + prefix + ".png", img_disp))
+    throw std::runtime_error("[WriteDisparity] can not write the disparities of " + left_img_fname);
   cv::normalize(img8_disp, img_norm_hist, 0, 255, cv::NORM_MINMAX);
-  cv::imwrite(output_folder + "/norm_hist/" + prefix + ".png", img_norm_hist);
+  if (!cv::imwrite(output_folder + "/norm_hist/" + prefix + ".png", img_norm_hist))
+    throw std::runtime_error("[WriteDisparity] can not write the normalized disparities of " + left_img_fname);
   //cv::imwrite(output_folder + "_disp/" + prefix + "_disp.png", img8_disp);
+}
+
+void RunSGM(const recon::StereoSGMParams& sgm_params, const std::string left_img_fname,
+            const std::string right_img_fname, const std::string output_folder)
+{
+  //cv::Mat img_disp, img_disp_subpixel, mat_disp;
+  cv::Mat img_disp;
+  cv::Mat img_left = cv::imread(left_img_fname, CV_LOAD_IMAGE_GRAYSCALE);
+  cv::Mat img_right = cv::imread(right_img_fname, CV_LOAD_IMAGE_GRAYSCALE);
+  //cv::imshow("img_left", img_left);
+  //cv::waitKey(0);
+
+  //double sigma = 0.7;
+  //cv::GaussianBlur(img_left, img_left, cv::Size(3,3), sigma);
+  //cv::GaussianBlur(img_right, img_right, cv::Size(3,3), sigma);
+
+  std::unique_ptr<recon::StereoSGMBase> sgm = sgm_params.create();
+  sgm->compute(img_left, img_right, img_disp);
+  WriteDisparity(img_disp, left_img_fname, output_folder);
 
   //cout << img_disp << "\n\n";
   //imshow("disparity", img_disp);
   //waitKey(0);
 }
 
+// one engine and workspace for the whole dataset, the stream decodes the next pairs while
+// the current one is matched and the finished maps are written here
+// returns the number of pairs which failed
+int RunBatch(const recon::StereoSGMParams& sgm_params, const recon::PairList& pairs,
+             const std::string output_folder)
+{
+  const size_t max_in_flight = 3;
+  recon::StereoStream stream(sgm_params, 1, max_in_flight);
+  std::deque<std::pair<std::string, std::future<recon::StereoFrame>>> pending;
+  int failed = 0;
+  auto finish_oldest = [&]() {
+    const std::string left_img_fname = pending.front().first;
+    try {
+      recon::StereoFrame frame = pending.front().second.get();
+      WriteDisparity(frame.disparity, left_img_fname, output_folder);
+    }
+    catch (const std::exception& e) {
+      std::cerr << "failed " << left_img_fname << ": " << e.what() << std::endl;
+      failed++;
+    }
+    pending.pop_front();
+  };
+  for (const auto& pair : pairs) {
+    recon::StereoFrame frame;
+    frame.left_path = pair.first;
+    frame.right_path = pair.second;
+    if (pending.size() == max_in_flight)
+      finish_oldest();
+    pending.push_back(std::make_pair(pair.first, stream.submit(std::move(frame))));
+  }
+  while (!pending.empty())
+    finish_oldest();
+  std::cerr << pairs.size() - failed << "/" << pairs.size() << " pairs done" << std::endl;
+  return failed;
+}
+
 int main(int argc, char** argv)
 {
-  if (argc != 6) {
-    std::cerr << "usage:\n" << argv[0] << " left right out_folder P1 P2" << std::endl;
+  const std::string usage = std::string("usage:\n") +
+      argv[0] + " left right out_folder P1 P2 [sad|zsad|census|ncc]\n" +
+      argv[0] + " --list pairs.txt out_folder P1 P2 [sad|zsad|census|ncc]\n" +
+      argv[0] + " --glob 'left/*.png' 'right/*.png' out_folder P1 P2 [sad|zsad|census|ncc]";
+  // pairs.txt holds one "left right" pair of image paths per line
+  recon::PairList pairs;
+  const std::string mode = argc > 1 ? argv[1] : "";
+  const bool batch = mode == "--list" || mode == "--glob";
+  int arg = 3;
+  try {
+    if (mode == "--list" && argc > 2)
+      pairs = recon::ReadPairList(argv[2]);
+    else if (mode == "--glob" && argc > 3) {
+      pairs = recon::GlobPairs(argv[2], argv[3]);
+      arg = 4;
+    }
+    else if (!batch && argc > 2)
+      pairs.push_back(std::make_pair(std::string(argv[1]), std::string(argv[2])));
+  }
+  catch (const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+  if (argc != arg + 3 && argc != arg + 4) {
+    std::cerr << usage << std::endl;
     return 1;
   }
 
-  std::string left_img_fname = argv[1];
-  std::string right_img_fname = argv[2];
-  std::string out_folder = argv[3];
-  int P1 = std::stoi(argv[4]);
-  int P2 = std::stoi(argv[5]);
+  std::string out_folder = argv[arg];
+  int P1 = std::stoi(argv[arg + 1]);
+  int P2 = std::stoi(argv[arg + 2]);
+  recon::StereoCost cost = recon::StereoCost::kZSAD;
+  if (argc == arg + 4) {
+    std::string cost_name = argv[arg + 3];
+    if (cost_name == "sad") cost = recon::StereoCost::kSAD;
+    else if (cost_name == "zsad") cost = recon::StereoCost::kZSAD;
+    else if (cost_name == "census") cost = recon::StereoCost::kCensus;
+    else if (cost_name == "ncc") cost = recon::StereoCost::kNCC;
+    else {
+      std::cerr << "unknown cost: " << cost_name << std::endl;
+      return 1;
+    }
+  }
 
-  RunSGM(P1, P2, left_img_fname, right_img_fname, out_folder);
+  if (batch)
+    return RunBatch(MakeParams(P1, P2, cost), pairs, out_folder) == 0 ? 0 : 2;
+  try {
+    RunSGM(MakeParams(P1, P2, cost), pairs[0].first, pairs[0].second, out_folder);
+  }
+  catch (const std::exception& e) {
+    std::cerr << "failed " << pairs[0].first << ": " << e.what() << std::endl;
+    return 2;
+  }
 
   return 0;
 }
@@ -1,6 +1,10 @@
 #include "stereo_costs.h"
 
 #include <iostream>
+#include <vector>
+#include <cstdlib>
+#include <algorithm>
+#include <limits>
 
 namespace recon
 {
@@ -12,20 +16,87 @@ void calcPatchMeans(const cv::Mat& img, cv::Mat& means, int wsz)
   int margin_sz = (wsz-1) / 2;
   float N = wsz * wsz;
   means = cv::Mat::zeros(img.rows-(2*margin_sz), img.cols-2*(margin_sz), CV_32F);
+  // box filter with running column sums, the integer sums are exact so the means do not
+  // depend on the summation order
+  std::vector<int> col_sums(img.cols, 0);
+  for(int py = 0; py < wsz-1; py++) {
+    const uint8_t* img_row = img.ptr<uint8_t>(py);
+    for(int px = 0; px < img.cols; px++)
+      col_sums[px] += img_row[px];
+  }
   for(int y = 0; y < means.rows; y++) {
+    // add the bottom row of the window and remove the row above it
+    const uint8_t* add_row = img.ptr<uint8_t>(y + wsz-1);
+    for(int px = 0; px < img.cols; px++)
+      col_sums[px] += add_row[px];
+    if(y > 0) {
+      const uint8_t* sub_row = img.ptr<uint8_t>(y-1);
+      for(int px = 0; px < img.cols; px++)
+        col_sums[px] -= sub_row[px];
+    }
+    int sum = 0;
+    for(int px = 0; px < wsz; px++)
+      sum += col_sums[px];
+    float* means_row = means.ptr<float>(y);
     for(int x = 0; x < means.cols; x++) {
-      int start_y = y;
-      int end_y = y + wsz-1;
-      int start_x = x;
-      int end_x = x + wsz-1;
-      //std::cout << "(" << y << ", " << x << ")\n";
-      for(int py = start_y; py <= end_y; py++) {
-        for(int px = start_x; px <= end_x; px++) {
-          //std::cout << "\t(" << py << ", " << px << ") = " << (float)img.at<uint8_t>(py,px) << "\n";
-          means.at<float>(y,x) += (float)img.at<uint8_t>(py,px);
-        }
+      means_row[x] = static_cast<float>(sum) / N;
+      if(x+1 < means.cols)
+        sum += col_sums[x + wsz] - col_sums[x];
+    }
+  }
+}
+
+void sad_cost_rows(const cv::Mat& left_img, const cv::Mat& right_img, int wsz, int disp_range,
+                   int y_begin, int y_end, uint16_t* costs, size_t row_stride, size_t x_stride)
+{
+  const int img_width = left_img.cols;
+  const int width = img_width - (wsz-1);
+  // column sums of |L(y,x) - R(y,x-d)| over the wsz rows of the window, stored as [x][d]
+  // so that the inner loops run over contiguous disparities, zero where x < d
+  std::vector<int> col_sums(img_width * disp_range, 0);
+  std::vector<int> box_sums(disp_range);
+
+  auto accumulate_row = [&](int py, int sign) {
+    const uint8_t* left_row = left_img.ptr<uint8_t>(py);
+    const uint8_t* right_row = right_img.ptr<uint8_t>(py);
+    for(int px = 0; px < img_width; px++) {
+      int* col = &col_sums[px * disp_range];
+      int max_disp = std::min(disp_range, px+1);
+      int left_val = left_row[px];
+      for(int d = 0; d < max_disp; d++)
+        col[d] += sign * std::abs(left_val - static_cast<int>(right_row[px-d]));
+    }
+  };
+
+  for(int py = y_begin; py < y_begin + wsz-1; py++)
+    accumulate_row(py, 1);
+  for(int y = y_begin; y < y_end; y++) {
+    // slide the window down: rows [y, y + wsz-1] of the image
+    accumulate_row(y + wsz-1, 1);
+    if(y > y_begin)
+      accumulate_row(y-1, -1);
+
+    std::fill(box_sums.begin(), box_sums.end(), 0);
+    for(int px = 0; px < wsz; px++) {
+      const int* col = &col_sums[px * disp_range];
+      for(int d = 0; d < disp_range; d++)
+        box_sums[d] += col[d];
+    }
+    uint16_t* costs_row = costs + (y - y_begin) * row_stride;
+    for(int x = 0; x < width; x++) {
+      uint16_t* pix_costs = costs_row + x * x_stride;
+      int max_disp = std::min(disp_range, x+1);
+      for(int d = 0; d < max_disp; d++)
+        pix_costs[d] = static_cast<uint16_t>(box_sums[d]);
+      for(int d = max_disp; d < disp_range; d++)
+        pix_costs[d] = std::numeric_limits<uint16_t>::max();
+      // slide the window right: columns [x+1, x + wsz]
+      if(x+1 < width) {
+        const int* add_col = &col_sums[(x + wsz) * disp_range];
+        const int* sub_col = &col_sums[x * disp_range];
+        for(int d = 0; d < disp_range; d++)
+          box_sums[d] += add_col[d] - sub_col[d];
       }
-      means.at<float>(y,x) /= N;
     }
   }
 }
@@ -58,6 +129,28 @@ void census_transform(const cv::Mat& img, int wsz, cv::Mat& census)
   }
 }
 
+void census_transform_64(const cv::Mat& img, const CensusWindow& window, cv::Mat& census)
+{
+  if(window.bits() > 64) throw "Error: census window has more than 64 bits\n";
+  int margin_x = (window.width-1) / 2;
+  int margin_y = (window.height-1) / 2;
+  int width = img.cols - 2*margin_x;
+  // no CV_64U but the 8 byte float type can hold the signatures
+  census = cv::Mat::zeros(img.rows, img.cols, CV_64F);
+  #pragma omp parallel for
+  for(int y = margin_y; y < img.rows - margin_y; y++) {
+    uint64_t* census_row = census.ptr<uint64_t>(y) + margin_x;
+    const uint8_t* center = img.ptr<uint8_t>(y) + margin_x;
+    // same bit order as census_transform: row-major from the top left pixel, first bit is the MSB
+    for(int dy = -margin_y; dy <= margin_y; dy += window.step) {
+      for(int dx = -margin_x; dx <= margin_x; dx += window.step) {
+        if(dx == 0 && dy == 0) continue;
+        census_accumulate_row(center, img.ptr<uint8_t>(y+dy) + margin_x + dx, width, census_row);
+      }
+    }
+  }
+}
+
 uint32_t census_transform_point(const core::Point& pt, const cv::Mat& img, int wsz)
 {
   int margin_sz = (wsz-1) / 2;
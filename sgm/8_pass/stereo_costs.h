@@ -2,8 +2,13 @@
 #define RECONSTRUCTION_BASE_STEREO_COSTS_
 
 #include <iostream>
+#include <cstring>
 #include <unordered_map>
 
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
 #include <opencv2/core/core.hpp>
 
 #include <Eigen/Core>
@@ -18,8 +23,24 @@ typedef Eigen::Matrix<uint32_t, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>
 namespace StereoCosts
 {
 
+// Census window of width x height pixels sampled every step pixels (step 2 gives a sparse census),
+// the center pixel is never compared.
+struct CensusWindow
+{
+  int width;
+  int height;
+  int step;
+  int bits() const;
+};
+
 void calcPatchMeans(const cv::Mat& img, cv::Mat& means, int wsz);
 
+// SAD costs of the cropped rows [y_begin, y_end) for all disparities, independent of the window size:
+// the window sums are updated with running column and row sums for every disparity.
+// costs points to row y_begin of a pixel-major volume, disparities d > x get the largest cost.
+void sad_cost_rows(const cv::Mat& left_img, const cv::Mat& right_img, int wsz, int disp_range,
+                   int y_begin, int y_end, uint16_t* costs, size_t row_stride, size_t x_stride);
+
 
 template<typename T>
 uint8_t hamming_dist(T x, T y);
@@ -33,6 +54,13 @@ float get_cost_ZSAD(const cv::Mat& left_img, const cv::Mat& right_img,
 double get_cost_NCC(const core::DescriptorNCC& d1, const core::DescriptorNCC& d2);
 
 void census_transform(const cv::Mat& img, int wsz, cv::Mat& census);
+// Up to 64-bit signatures (7x7 and 9x7 dense, larger windows sparse) computed a row at a time with SIMD.
+// census has the size of img and stores uint64_t in CV_64F elements, the border is left at 0.
+void census_transform_64(const cv::Mat& img, const CensusWindow& window, cv::Mat& census);
+void census_accumulate_row(const uint8_t* center, const uint8_t* neighbour, int width, uint64_t* census);
+// costs[d] = hamming(left_census[x], right_census[x-d]) for d in [0, max_disp), max_disp <= x+1
+void hamming_cost_row(const uint64_t* left_census, const uint64_t* right_census, int x, int max_disp,
+                      uint8_t* costs);
 uint32_t census_transform_point(const core::Point& pt, const cv::Mat& img, int wsz);
 
 template<typename T>
@@ -121,14 +149,79 @@ template<typename T>
 inline
 uint8_t StereoCosts::hamming_dist(T x, T y)
 {
-  uint8_t dist = 0;
-  T val = x ^ y; // XOR
-  // Count the number of set bits
-  while(val) {
-    ++dist;
-    val &= val - 1;
+  // XOR and count the number of set bits with the popcnt instruction
+  return static_cast<uint8_t>(__builtin_popcountll(static_cast<uint64_t>(x ^ y)));
+}
+
+inline
+int StereoCosts::CensusWindow::bits() const
+{
+  int num_bits = 0;
+  for(int dy = -(height-1)/2; dy <= (height-1)/2; dy += step)
+    for(int dx = -(width-1)/2; dx <= (width-1)/2; dx += step)
+      if(dx != 0 || dy != 0)
+        num_bits++;
+  return num_bits;
+}
+
+inline
+void StereoCosts::census_accumulate_row(const uint8_t* center, const uint8_t* neighbour, int width,
+                                        uint64_t* census)
+{
+  int x = 0;
+#ifdef __AVX2__
+  // unsigned compare through the signed one by flipping the sign bits
+  const __m256i sign = _mm256_set1_epi8(-128);
+  const __m256i one = _mm256_set1_epi64x(1);
+  alignas(32) uint8_t greater[32];
+  for(; x + 32 <= width; x += 32) {
+    __m256i c = _mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(center + x)), sign);
+    __m256i n = _mm256_xor_si256(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(neighbour + x)), sign);
+    _mm256_store_si256(reinterpret_cast<__m256i*>(greater), _mm256_cmpgt_epi8(n, c));
+    // shift the new bit into 4 signatures at a time
+    for(int k = 0; k < 32; k += 4) {
+      int32_t mask;
+      std::memcpy(&mask, greater + k, sizeof(mask));
+      __m256i bit = _mm256_and_si256(_mm256_cvtepu8_epi64(_mm_cvtsi32_si128(mask)), one);
+      __m256i* sig = reinterpret_cast<__m256i*>(census + x + k);
+      _mm256_storeu_si256(sig, _mm256_or_si256(_mm256_slli_epi64(_mm256_loadu_si256(sig), 1), bit));
+    }
+  }
+#endif
+  for(; x < width; x++)
+    census[x] = (census[x] << 1) | (neighbour[x] > center[x] ? 1 : 0);
+}
+
+inline
+void StereoCosts::hamming_cost_row(const uint64_t* left_census, const uint64_t* right_census, int x, int max_disp,
+                                   uint8_t* costs)
+{
+  const uint64_t left = left_census[x];
+  int d = 0;
+#ifdef __AVX2__
+  // nibble lookup table popcount (vpshufb) summed per 64-bit lane with vpsadbw
+  const __m256i lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                       0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+  const __m256i low_mask = _mm256_set1_epi8(0x0f);
+  // gathers the low byte of the two 64-bit lanes into the first 2 bytes of each 128-bit half
+  const __m256i pick = _mm256_setr_epi8(0, 8, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                        0, 8, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+  const __m256i vleft = _mm256_set1_epi64x(static_cast<long long>(left));
+  for(; d + 4 <= max_disp; d += 4) {
+    // lane i holds right_census[x-d-i]
+    __m256i right = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(right_census + x - d - 3));
+    right = _mm256_permute4x64_epi64(right, 0x1B);
+    __m256i v = _mm256_xor_si256(vleft, right);
+    __m256i cnt = _mm256_add_epi8(_mm256_shuffle_epi8(lut, _mm256_and_si256(v, low_mask)),
+                                  _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(v, 4), low_mask)));
+    cnt = _mm256_shuffle_epi8(_mm256_sad_epu8(cnt, _mm256_setzero_si256()), pick);
+    uint32_t packed = (static_cast<uint32_t>(_mm_cvtsi128_si32(_mm256_castsi256_si128(cnt))) & 0xFFFF) |
+                      (static_cast<uint32_t>(_mm_cvtsi128_si32(_mm256_extracti128_si256(cnt, 1))) << 16);
+    std::memcpy(costs + d, &packed, sizeof(packed));
   }
-  return dist;
+#endif
+  for(; d < max_disp; d++)
+    costs[d] = static_cast<uint8_t>(__builtin_popcountll(left ^ right_census[x-d]));
 }
 
 inline
@@ -157,9 +250,12 @@ float StereoCosts::get_cost_ZSAD(const cv::Mat& left_img, const cv::Mat& right_i
   int cx2 = cx - ssz;
   int cy2 = cy - ssz;
   float mean_diff = left_means.at<float>(cy2,cx2) - right_means.at<float>(cy2,cx2-d);
+  // the mean offset depends on the window center so ZSAD can not be box filtered like SAD
   for(int y = (cy - ssz); y <= (cy + ssz); y++) {
+    const uint8_t* left_row = left_img.ptr<uint8_t>(y);
+    const uint8_t* right_row = right_img.ptr<uint8_t>(y) - d;
     for(int x = (cx - ssz); x <= (cx + ssz); x++) {
-      float idiff = left_img.at<uint8_t>(y,x) - right_img.at<uint8_t>(y,x-d);
+      float idiff = left_row[x] - right_row[x];
       zsad += std::abs(idiff - mean_diff);
    }
   }
@@ -1,18 +1,74 @@
 #include "stereo_sgm.h"
 
 #include <opencv2/imgproc/imgproc.hpp>
-#include <opencv2/highgui/highgui.hpp>
 
 #include <omp.h>
 
-#include "stereo_costs.h"
+#include <limits>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+
+#include "cost_policies.h"
 
 //#include <Eigen/Core>
 
 namespace recon
 {
 
-void StereoSGM::compute(cv::Mat& left_img, cv::Mat& right_img, cv::Mat& disp)
+namespace
+{
+
+// (DIRX, DIRY) of the 8 aggregation paths
+const int kNumDirections = 8;
+const int kDirections[kNumDirections][2] = {
+  {-1, -1}, {-1, 0}, {-1, 1}, {0, -1}, {0, 1}, {1, -1}, {1, 0}, {1, 1}
+};
+
+}
+
+template<typename CostPolicy>
+void StereoSGM<CostPolicy>::compute(const cv::Mat& left_img, const cv::Mat& right_img, cv::Mat& disp,
+                                    FrameStats* stats)
+{
+  disp.create(left_img.rows, left_img.cols, CV_16U);
+  compute(left_img, right_img, disp.ptr<uint16_t>(), disp.step / sizeof(uint16_t), stats);
+}
+
+template<typename CostPolicy>
+void StereoSGM<CostPolicy>::compute(const cv::Mat& left_img, const cv::Mat& right_img, uint16_t* disp,
+                                    size_t stride, FrameStats* stats)
+{
+  int mc = (params_.window_sz-1)/2;       // margin crop size
+  match(left_img, right_img, stats);
+
+  cv::Mat wta_disp;
+  {
+    ScopedStage stage(stats, "wta");
+    if(banded())
+      wta_disp = get_band_disparity_image_uint16(mc);
+    else if(candidate_aggregation())
+      wta_disp = get_candidate_disparity_image_uint16(mc);
+    else
+      wta_disp = get_disparity_image_uint16(aggr_costs_, mc);
+  }
+  // the median writes straight into the caller's buffer
+  cv::Mat out(left_img.rows, left_img.cols, CV_16U, disp, stride * sizeof(uint16_t));
+  {
+    ScopedStage stage(stats, "median");
+    cv::medianBlur(wta_disp, out, 3);
+  }
+  if(params_.speckle_size > 0) {
+    ScopedStage stage(stats, "speckle");
+    speckle_filter_.Apply(disp, out.cols, out.rows, stride, params_.speckle_size,
+                          static_cast<uint16_t>(256*params_.speckle_range));
+  }
+  if(stats != nullptr)
+    stats->Released(workspace_bytes());
+}
+
+template<typename CostPolicy>
+void StereoSGM<CostPolicy>::match(const cv::Mat& left_img, const cv::Mat& right_img, FrameStats* stats)
 {
   // TODO
   //int p_width = params_.patch_width;
@@ -26,111 +82,76 @@ void StereoSGM::compute(cv::Mat& left_img, cv::Mat& right_img, cv::Mat& disp)
   int img_width = left_img.cols;
   int height = img_height - 2*mc;
   int width = img_width - 2*mc;
-  int disp_range = params_.disp_range;
 
-  CostArray costs;
-  //ACostArray aggr_costs, path_aggr_costs;
-  ACostArray aggr_costs, path_aggr_costs;
-  costs.resize(height);
-  aggr_costs.resize(height);
-  path_aggr_costs.resize(height);
-  for(int i = 0; i < height; i++) {
-    costs[i].resize(width);
-    aggr_costs[i].resize(width);
-    path_aggr_costs[i].resize(width);
-    for(int j = 0; j < width; j++) {
-      // CostType needs to be smaller then ACostType for int types
-      costs[i][j].assign(disp_range, std::numeric_limits<CostType>::max());
-      //costs[i][j].assign(disp_range, 255u);
-      aggr_costs[i][j].assign(disp_range, (ACostType)0);
-      path_aggr_costs[i][j].assign(disp_range, (ACostType)0);
-      //costs[i][j].resize(disp_range);
-      //for(int k = 0; k < disp_range; k++)
-      //  costs[i][j][k] = std::numeric_limits<CostType>::max();
-    }
+  {
+    ScopedStage stage(stats, "init");
+    // the workspace counts towards the peak of every call but is only allocated when it grows
+    if(reserve_workspace(height, width))
+      stage.Allocated(workspace_bytes());
+    else if(stats != nullptr)
+      stats->Allocated(workspace_bytes());
+  }
+  if(banded()) {
+    match_band(left_img, right_img, stats);
+    return;
   }
+  if(candidate_aggregation()) {
+    match_candidates(left_img, right_img, stats);
+    return;
+  }
+  // the cost loop below writes every element of costs so only the sums need to be cleared
+  CostArray& costs = costs_;
+  {
+    ScopedStage stage(stats, "cost");
+    // precomputes the means / census signatures / ... of both images
+    const CostPolicy cost_policy(left_img, right_img, wsz);
 
-#ifdef COST_ZSAD
-  cv::Mat left_means, right_means;
-  StereoCosts::calcPatchMeans(left_img, left_means, wsz);
-  StereoCosts::calcPatchMeans(right_img, right_means, wsz);
-#endif
-#ifdef COST_CENSUS
-  cv::Mat left_census, right_census;
-  StereoCosts::census_transform(left_img, wsz, left_census);
-  StereoCosts::census_transform(right_img, wsz, right_census);
-#endif
-
-#ifdef COST_CENSUS
-  //cv::Mat lcensus, rcensus;
-  //left_census.convertTo(lcensus, CV_8U);
-  //right_census.convertTo(rcensus, CV_8U);
-  //cv::imshow("left_census", lcensus);
-  //cv::imshow("right_census", rcensus);
-  //cv::waitKey(0);
-#endif
-
-  //omp_set_dynamic(0);     // Explicitly disable dynamic teams
-  //omp_set_num_threads(8); // Use 4 threads for all consecutive parallel regions
-  #pragma omp parallel for
-  for(int y = 0; y < height; y++) {
-    for(int d = 0; d < disp_range; d++) {
-      for(int x = d; x < width; x++) {
-#ifdef COST_SAD
-        // SAD 1x1
-        //costs[y][x][d] = std::abs(int(left_img.at<uint8_t>(iy, ix) - int(right_img.at<uint8_t>(iy, ix-d))));
-        int ix = x + mc;
-        int iy = y + mc;
-        // SAD
-        costs[y][x][d] = StereoCosts::get_cost_SAD(left_img, right_img, wsz, ix, iy, d);
-#endif
-#ifdef COST_ZSAD
-        int ix = x + mc;
-        int iy = y + mc;
-        // ZSAD - 3x3, 2, 130
-        costs[y][x][d] = StereoCosts::get_cost_ZSAD(left_img, right_img, left_means, right_means, wsz, ix, iy, d);
-#endif
-#ifdef COST_CENSUS
-        // Census cost
-        // Daimler: Traffic - 10, 50; Middlebury - 7, 20
-        costs[y][x][d] = StereoCosts::hamming_dist<uint32_t>(left_census.at<uint32_t>(y, x),
-                                                             right_census.at<uint32_t>(y, x-d));
-#endif
-      }
-    }
+    //omp_set_dynamic(0);     // Explicitly disable dynamic teams
+    //omp_set_num_threads(8); // Use 4 threads for all consecutive parallel regions
+    cost_policy.fill_costs(costs);
   }
 
   // save scanline cost
   //cv::Mat cost_image = cv::Mat::zeros(disp_range, width, CV_8U);
   //for(int x = 0; x < width; x++) {
   //  for(int d = 0; d < disp_range; d++) {
-  //    cost_image.at<uint8_t>(d,x) = costs[height/2][x][d];
-  //    //std::cout << (int)costs[height/2][x][d] << "\n";
+  //    cost_image.at<uint8_t>(d,x) = costs.at(height/2, x, d);
+  //    //std::cout << (int)costs.at(height/2, x, d) << "\n";
   //  }
   //}
   //cv::equalizeHist(cost_image, cost_image);
   //cv::imwrite("scanline_costs.png", cost_image);
 
-  // TODO change path_aggr_costs to array
-  //int path_id = 0;
-  //#pragma omp parallel for schedule(dynamic,1) private(path_aggr_costs) collapse(2)
-
-  //omp_set_num_threads(4); // Use 4 threads for all consecutive parallel regions
-  //#pragma omp parallel for
-  for(int x = -1; x <= 1; x++) {
-    //#pragma omp parallel for
-    for(int y = -1; y <= 1; y++) {
-      if(x == 0 && y == 0)
-        continue;
-      //printf("Hello from thread %d, nthreads %d\n", omp_get_thread_num(), omp_get_num_threads());
-      //printf("Cost propagation [%d , %d]\n", x, y);
-      aggregate_costs(left_img, costs, x, y, path_aggr_costs);
-      //int tid = omp_get_thread_num();
-      //aggregate_costs(left_img, costs, x, y, path_aggr_costs[tid]);
-
-      //#pragma omp atomic
-      //sum_costs(path_aggr_costs[tid], aggr_costs);
-      sum_costs(path_aggr_costs, aggr_costs);
+  ACostArray& aggr_costs = aggr_costs_;
+  {
+    ScopedStage stage(stats, "aggregate");
+    aggr_costs.fill((ACostType)0);
+    std::vector<PathCostArray>& path_aggr_costs = path_aggr_costs_;
+    int num_concurrent = static_cast<int>(path_aggr_costs.size());
+
+    // wall time of each direction, they overlap within a batch
+    double direction_ms[kNumDirections] = {0.0};
+    // aggregate the directions in batches of num_concurrent independent tasks
+    for(int first = 0; first < kNumDirections; first += num_concurrent) {
+      int num_paths = std::min(num_concurrent, kNumDirections - first);
+      #pragma omp parallel for schedule(dynamic,1)
+      for(int i = 0; i < num_paths; i++) {
+        //printf("Cost propagation [%d , %d]\n", kDirections[first+i][0], kDirections[first+i][1]);
+        ScopedStage::Clock::time_point start;
+        if(stats != nullptr)
+          start = ScopedStage::Clock::now();
+        aggregate_costs(left_img, costs, kDirections[first+i][0], kDirections[first+i][1], path_aggr_costs[i],
+                        min_costs_[i]);
+        if(stats != nullptr)
+          direction_ms[first+i] = ScopedStage::ElapsedMs(start);
+      }
+      ScopedStage sum_stage(stats, "aggregate_sum");
+      sum_costs(path_aggr_costs, num_paths, aggr_costs);
+    }
+    if(stats != nullptr) {
+      for(int i = 0; i < kNumDirections; i++)
+        stats->AddStage("aggregate[" + std::to_string(kDirections[i][0]) + "," +
+                        std::to_string(kDirections[i][1]) + "]", direction_ms[i]);
     }
   }
 
@@ -180,25 +201,244 @@ void StereoSGM::compute(cv::Mat& left_img, cv::Mat& right_img, cv::Mat& disp)
   ////cv::imwrite("path_-1_1.png", get_disparity_image(path_aggr_costs));
   //sum_costs(path_aggr_costs, aggr_costs);
 
-  //disp = get_disparity_matrix(aggr_costs, mc);
-  cv::Mat data_cost_image = GetDisparityImage(costs, mc);
-  cv::imwrite("data_cost_img.png", data_cost_image);
-  disp = get_disparity_image_uint16(aggr_costs, mc);
-  cv::medianBlur(disp, disp, 3);
+}
+
+// only the costs in the band of each pixel are computed and aggregated, the band is given by the
+// disparity bounds of the rows and, in the pyramid mode, by the disparities of the coarse engine
+// which matches the half resolution images
+template<typename CostPolicy>
+void StereoSGM<CostPolicy>::match_band(const cv::Mat& left_img, const cv::Mat& right_img, FrameStats* stats)
+{
+  int mc = (params_.window_sz-1)/2;
+  int height = left_img.rows - 2*mc;
+  int width = left_img.cols - 2*mc;
+  size_t bytes_before = workspace_bytes();
+  if((!params_.row_min_disp.empty() && static_cast<int>(params_.row_min_disp.size()) != left_img.rows) ||
+     (!params_.row_max_disp.empty() && static_cast<int>(params_.row_max_disp.size()) != left_img.rows))
+    throw std::invalid_argument("[StereoSGM::match_band] the row disparity bounds need one entry per image row");
+  // the tables are indexed by the image rows, the band by the cropped ones
+  ComputeRowBounds(params_.min_disp, params_.disp_range - 1, params_.row_min_disp, params_.row_max_disp,
+                   mc, height, &row_lo_, &row_hi_);
+  if(params_.pyramid_levels == 0) {
+    ScopedStage stage(stats, "band");
+    band_.FromRowBounds(width, height, row_lo_.data(), row_hi_.data());
+    reserve_band();
+    stage.Allocated(workspace_bytes() - bytes_before);
+  }
+  else {
+    ScopedStage stage(stats, "coarse");
+    cv::Mat coarse_left, coarse_right;
+    cv::pyrDown(left_img, coarse_left);
+    cv::pyrDown(right_img, coarse_right);
+    if(coarse_left.rows <= 2*mc || coarse_left.cols <= 2*mc)
+      throw std::invalid_argument("[StereoSGM::match_band] image too small for the pyramid levels");
+    StereoSGM& coarse = coarse_engine();
+    coarse.match(coarse_left, coarse_right, nullptr);
+    coarse.wta_disparities(coarse_disp_);
+    band_.FromCoarse(coarse_disp_.ptr<int>(), coarse_disp_.cols, coarse_disp_.rows, width, height, mc,
+                     params_.band_radius, row_lo_.data(), row_hi_.data());
+    reserve_band();
+    // the coarse engine and the band volumes are only known now
+    stage.Allocated(workspace_bytes() - bytes_before);
+  }
+  {
+    ScopedStage stage(stats, "cost");
+    const CostPolicy cost_policy(left_img, right_img, params_.window_sz);
+    fill_band_costs(cost_policy, band_, band_costs_.data());
+  }
+  {
+    ScopedStage stage(stats, "aggregate");
+    std::fill(band_aggr_costs_.begin(), band_aggr_costs_.begin() + band_.Size(), ACostType(0));
+    int num_concurrent = static_cast<int>(band_path_costs_.size());
+    for(int first = 0; first < kNumDirections; first += num_concurrent) {
+      int num_paths = std::min(num_concurrent, kNumDirections - first);
+      #pragma omp parallel for schedule(dynamic,1)
+      for(int i = 0; i < num_paths; i++)
+        aggregate_band_costs(band_costs_.data(), kDirections[first+i][0], kDirections[first+i][1],
+                             band_path_costs_[i].data(), min_costs_[i]);
+      ScopedStage sum_stage(stats, "aggregate_sum");
+      sum_band_costs(num_paths);
+    }
+  }
+}
+
+// the sweeps ask for the costs of a few rows at a time, they are computed in parallel
+template<typename CostPolicy>
+void StereoSGM<CostPolicy>::match_candidates(const cv::Mat& left_img, const cv::Mat& right_img, FrameStats* stats)
+{
+  CandidateAggregatorType& aggregator = candidate_aggregator_;
+  std::unique_ptr<CostPolicy> cost_policy;
+  {
+    ScopedStage stage(stats, "cost");
+    // only the means / census signatures / ... of both images
+    cost_policy.reset(new CostPolicy(left_img, right_img, params_.window_sz));
+  }
+  ScopedStage stage(stats, "aggregate");
+  int width = aggregator.width();
+  int disp_range = params_.disp_range;
+  const CostPolicy& policy = *cost_policy;
+  aggregator.aggregate([&](int first_row, int num_rows, CostType* costs) {
+    fill_row_costs(policy, first_row, num_rows, width, disp_range, costs);
+  }, params_.penalty1, params_.penalty2);
+}
+
+template<typename CostPolicy>
+void StereoSGM<CostPolicy>::wta_disparities(cv::Mat& disp)
+{
+  if(banded()) {
+    disp.create(band_.height(), band_.width(), CV_32S);
+    #pragma omp parallel for
+    for(int y = 0; y < band_.height(); y++) {
+      for(int x = 0; x < band_.width(); x++)
+        disp.at<int>(y,x) = band_.Lo(y,x) + find_min_disp_band(&band_aggr_costs_[band_.Offset(y,x)],
+                                                               band_.Count(y,x));
+    }
+  }
+  else if(candidate_aggregation()) {
+    const CandidateAggregatorType& aggregator = candidate_aggregator_;
+    int num_candidates = aggregator.num_candidates();
+    disp.create(aggregator.height(), aggregator.width(), CV_32S);
+    #pragma omp parallel for
+    for(int y = 0; y < aggregator.height(); y++) {
+      for(int x = 0; x < aggregator.width(); x++) {
+        const typename CandidateAggregatorType::Candidate* cands = aggregator.candidates(y,x);
+        disp.at<int>(y,x) = cands[CandidateAggregatorType::best(cands, num_candidates)].disp;
+      }
+    }
+  }
+  else {
+    disp.create(aggr_costs_.height(), aggr_costs_.width(), CV_32S);
+    #pragma omp parallel for
+    for(int y = 0; y < aggr_costs_.height(); y++) {
+      for(int x = 0; x < aggr_costs_.width(); x++)
+        disp.at<int>(y,x) = find_min_disp(aggr_costs_.ptr(y,x));
+    }
+  }
+}
+
+template<typename CostPolicy>
+StereoSGM<CostPolicy>& StereoSGM<CostPolicy>::coarse_engine()
+{
+  if(!coarse_) {
+    StereoSGMParams coarse_params = params_;
+    coarse_params.disp_range = (params_.disp_range + 1) / 2;
+    coarse_params.pyramid_levels = params_.pyramid_levels - 1;
+    coarse_params.min_disp = params_.min_disp / 2;
+    coarse_params.row_min_disp = HalveRowMin(params_.row_min_disp);
+    coarse_params.row_max_disp = HalveRowMax(params_.row_max_disp);
+    coarse_.reset(new StereoSGM(coarse_params));
+  }
+  return *coarse_;
+}
+
+// sizes the workspace for a height x width cropped image, returns true if anything was allocated
+template<typename CostPolicy>
+bool StereoSGM<CostPolicy>::reserve_workspace(int height, int width)
+{
+  int disp_range = params_.disp_range;
+  // every direction in flight needs its own path volume so the number of
+  // concurrent directions is what bounds the aggregation memory
+  int num_concurrent = std::max(1, std::min(params_.num_concurrent_paths, kNumDirections));
+  if(banded()) {
+    // the band volumes are sized per frame in reserve_band, only the min costs depend on the size
+    bool same = static_cast<int>(min_costs_.size()) == num_concurrent &&
+                min_costs_[0].size() == static_cast<size_t>(width * height);
+    min_costs_.resize(num_concurrent);
+    band_path_costs_.resize(num_concurrent);
+    for(int i = 0; i < num_concurrent; i++)
+      min_costs_[i].resize(width * height);
+    return !same;
+  }
+  if(candidate_aggregation())
+    return candidate_aggregator_.reserve(width, height, disp_range, params_.num_candidates);
+  bool same = costs_.height() == height && costs_.width() == width && costs_.disp_range() == disp_range &&
+              static_cast<int>(path_aggr_costs_.size()) == num_concurrent;
+  if(same)
+    return false;
+  // CostVolume::create only reallocates when the volume grows
+  costs_.create(height, width, disp_range);
+  aggr_costs_.create(height, width, disp_range);
+  path_aggr_costs_.resize(num_concurrent);
+  min_costs_.resize(num_concurrent);
+  for(int i = 0; i < num_concurrent; i++) {
+    path_aggr_costs_[i].create(height, width, disp_range);
+    min_costs_[i].resize(width * height);
+  }
+  return true;
+}
+
+template<typename CostPolicy>
+size_t StereoSGM<CostPolicy>::workspace_bytes() const
+{
+  size_t bytes = costs_.size() * sizeof(CostType) + aggr_costs_.size() * sizeof(ACostType);
+  for(size_t i = 0; i < path_aggr_costs_.size(); i++)
+    bytes += path_aggr_costs_[i].size() * sizeof(PathCostType);
+  for(size_t i = 0; i < min_costs_.size(); i++)
+    bytes += min_costs_[i].capacity() * sizeof(PathCostType);
+  bytes += band_costs_.capacity() * sizeof(CostType) + band_aggr_costs_.capacity() * sizeof(ACostType);
+  for(size_t i = 0; i < band_path_costs_.size(); i++)
+    bytes += band_path_costs_[i].capacity() * sizeof(PathCostType);
+  bytes += candidate_aggregator_.bytes();
+  if(coarse_)
+    bytes += coarse_->workspace_bytes();
+  return bytes;
+}
+
+// the band volumes only grow, a frame with a narrower band reuses them
+template<typename CostPolicy>
+void StereoSGM<CostPolicy>::reserve_band()
+{
+  size_t size = band_.Size();
+  if(band_costs_.size() < size)
+    band_costs_.resize(size);
+  if(band_aggr_costs_.size() < size)
+    band_aggr_costs_.resize(size);
+  for(size_t i = 0; i < band_path_costs_.size(); i++) {
+    if(band_path_costs_[i].size() < size)
+      band_path_costs_[i].resize(size);
+  }
+}
+
+template<typename CostPolicy>
+void StereoSGM<CostPolicy>::warm_up(int img_width, int img_height)
+{
+  int mc = (params_.window_sz - 1) / 2;
+  reserve_workspace(img_height - 2*mc, img_width - 2*mc);
+  // the band volumes depend on the disparities of each frame, only the coarse levels are warmed up
+  if(banded()) {
+    if(params_.pyramid_levels > 0)
+      coarse_engine().warm_up((img_width + 1) / 2, (img_height + 1) / 2);
+    for(size_t i = 0; i < min_costs_.size(); i++)
+      std::fill(min_costs_[i].begin(), min_costs_[i].end(), PathCostType(0));
+    return;
+  }
+  // the candidates are completely overwritten by the first sweep
+  if(candidate_aggregation())
+    return;
+  // writing every buffer once faults all of their pages in
+  costs_.fill(CostType(0));
+  aggr_costs_.fill(ACostType(0));
+  for(size_t i = 0; i < path_aggr_costs_.size(); i++) {
+    path_aggr_costs_[i].fill(PathCostType(0));
+    std::fill(min_costs_[i].begin(), min_costs_[i].end(), PathCostType(0));
+  }
 }
 
 //template<int DIRX, int DIRY>
-void StereoSGM::aggregate_costs(const cv::Mat& img, const CostArray& costs, int DIRX, int DIRY,
-                                ACostArray& aggr_costs) {
-  const int width = costs[0].size();
-  const int height = costs.size();
+template<typename CostPolicy>
+void StereoSGM<CostPolicy>::aggregate_costs(const cv::Mat& img, const CostArray& costs, int DIRX, int DIRY,
+                                            PathCostArray& aggr_costs, std::vector<PathCostType>& min_costs) {
+  const int width = costs.width();
+  const int height = costs.height();
+  // min_costs holds the min over disparities of each aggregated pixel,
+  // used to normalize the next pixel on the path
 
   // Walk along the edges in a clockwise fashion
   if(DIRX > 0) {
     // Process every pixel along left most edge
     for(int y = 0; y < height; y++) {
       //aggr_costs[0][j] += costs[0][j];
-      sum_vectors(costs[y][0], aggr_costs[y][0]);
+      min_costs[y*width] = init_path(costs.ptr(y,0), aggr_costs.ptr(y,0));
     }
     for(int x = 1; x < width; x++) {
       //std::cout << "x = " << x << "\n";
@@ -206,7 +446,8 @@ void StereoSGM::aggregate_costs(const cv::Mat& img, const CostArray& costs, int
       int y_stop  = std::min(height, height + DIRY * x);
       for(int y = y_start; y < y_stop; y++) {
         int gradient = static_cast<int>(std::abs(img.at<uint8_t>(y,x) - img.at<uint8_t>(y-DIRY,x-DIRX)));
-        aggregate_path(aggr_costs[y-DIRY][x-DIRX], costs[y][x], aggr_costs[y][x], gradient);
+        min_costs[y*width + x] = aggregate_path(aggr_costs.ptr(y-DIRY,x-DIRX), min_costs[(y-DIRY)*width + x-DIRX],
+                                                costs.ptr(y,x), aggr_costs.ptr(y,x), gradient);
       }
     }
   }
@@ -215,7 +456,7 @@ void StereoSGM::aggregate_costs(const cv::Mat& img, const CostArray& costs, int
     // Otherwise skip the top-left most pixel because we already processed
     for(int x = (DIRX <= 0 ? 0 : 1); x < width; x++) {
       //aggr_costs[0][j] += costs[0][j];
-      sum_vectors(costs[0][x], aggr_costs[0][x]);
+      min_costs[x] = init_path(costs.ptr(0,x), aggr_costs.ptr(0,x));
     }
     for(int y = 1; y < height; y++) {
       //std::cout << "y = " << y << "\n";
@@ -224,7 +465,8 @@ void StereoSGM::aggregate_costs(const cv::Mat& img, const CostArray& costs, int
       int x_stop  = std::min( width, width + DIRX * y );
       for(int x = x_start; x < x_stop; x++) {
         int gradient = static_cast<int>(std::abs(img.at<uint8_t>(y,x) - img.at<uint8_t>(y-DIRY,x-DIRX)));
-        aggregate_path(aggr_costs[y-DIRY][x-DIRX], costs[y][x], aggr_costs[y][x], gradient);
+        min_costs[y*width + x] = aggregate_path(aggr_costs.ptr(y-DIRY,x-DIRX), min_costs[(y-DIRY)*width + x-DIRX],
+                                                costs.ptr(y,x), aggr_costs.ptr(y,x), gradient);
       }
     }
   }
@@ -233,7 +475,7 @@ void StereoSGM::aggregate_costs(const cv::Mat& img, const CostArray& costs, int
     // Otherwise skip the top-right most pixel because we already processed
     for(int y = (DIRY <= 0 ? 0 : 1); y < height; y++) {
       //aggr_costs[0][j] += costs[0][j];
-      sum_vectors(costs[y][width-1], aggr_costs[y][width-1]);
+      min_costs[y*width + width-1] = init_path(costs.ptr(y,width-1), aggr_costs.ptr(y,width-1));
     }
     for(int x = width-2; x >= 0; x--) {
       //std::cout << "x = " << x << "\n";
@@ -242,7 +484,8 @@ void StereoSGM::aggregate_costs(const cv::Mat& img, const CostArray& costs, int
       int y_stop  = std::min( height, height - DIRY * (x - width + 1) );
       for(int y = y_start; y < y_stop; y++) {
         int gradient = static_cast<int>(std::abs(img.at<uint8_t>(y,x) - img.at<uint8_t>(y-DIRY,x-DIRX)));
-        aggregate_path(aggr_costs[y-DIRY][x-DIRX], costs[y][x], aggr_costs[y][x], gradient);
+        min_costs[y*width + x] = aggregate_path(aggr_costs.ptr(y-DIRY,x-DIRX), min_costs[(y-DIRY)*width + x-DIRX],
+                                                costs.ptr(y,x), aggr_costs.ptr(y,x), gradient);
       }
     }
   }
@@ -251,7 +494,7 @@ void StereoSGM::aggregate_costs(const cv::Mat& img, const CostArray& costs, int
     // Otherwise skip the bottom-left and bottom-right most pixels because we already processed them
     for(int x = (DIRX <= 0 ? 0 : 1); x < (DIRX >= 0 ? width : width-1); x++) {
       //aggr_costs[0][j] += costs[0][j];
-      sum_vectors(costs[height-1][x], aggr_costs[height-1][x]);
+      min_costs[(height-1)*width + x] = init_path(costs.ptr(height-1,x), aggr_costs.ptr(height-1,x));
     }
     for(int y = height-2; y >= 0; y--) {
       //std::cout << "y = " << y << "\n";
@@ -261,10 +504,71 @@ void StereoSGM::aggregate_costs(const cv::Mat& img, const CostArray& costs, int
                               (DIRX >= 0 ? width : width - 1) - DIRX * (y - height + 1) );
       for(int x = x_start; x < x_stop; x++) {
         int gradient = static_cast<int>(std::abs(img.at<uint8_t>(y,x) - img.at<uint8_t>(y-DIRY,x-DIRX)));
-        aggregate_path(aggr_costs[y-DIRY][x-DIRX], costs[y][x], aggr_costs[y][x], gradient);
+        min_costs[y*width + x] = aggregate_path(aggr_costs.ptr(y-DIRY,x-DIRX), min_costs[(y-DIRY)*width + x-DIRX],
+                                                costs.ptr(y,x), aggr_costs.ptr(y,x), gradient);
+      }
+    }
+  }
+}
+
+// rows along DIRY and columns along DIRX visit the previous pixel of every path before the pixel itself
+template<typename CostPolicy>
+void StereoSGM<CostPolicy>::aggregate_band_costs(const CostType* costs, int DIRX, int DIRY, PathCostType* aggr_costs,
+                                                 std::vector<PathCostType>& min_costs)
+{
+  const DisparityBand& band = band_;
+  const int width = band.width();
+  const int height = band.height();
+  int y_start = DIRY >= 0 ? 0 : height-1;
+  int y_step = DIRY >= 0 ? 1 : -1;
+  int x_start = DIRX >= 0 ? 0 : width-1;
+  int x_step = DIRX >= 0 ? 1 : -1;
+  for(int y = y_start; y >= 0 && y < height; y += y_step) {
+    int py = y - DIRY;
+    for(int x = x_start; x >= 0 && x < width; x += x_step) {
+      int px = x - DIRX;
+      size_t offset = band.Offset(y,x);
+      int count = band.Count(y,x);
+      if(py < 0 || py >= height || px < 0 || px >= width) {
+        copy_vector<CostType,PathCostType>(costs + offset, aggr_costs + offset, count);
+        min_costs[y*width + x] = get_min<PathCostType>(aggr_costs + offset, count);
+      }
+      else {
+        min_costs[y*width + x] = aggregate_band_step(aggr_costs + band.Offset(py,px), band.Lo(py,px),
+                                                     band.PathCount(py,px), min_costs[py*width + px],
+                                                     costs + offset, band.Lo(y,x), count, aggr_costs + offset,
+                                                     params_.penalty1, params_.penalty2);
       }
     }
   }
 }
 
+std::unique_ptr<StereoSGMBase> StereoSGMParams::create() const
+{
+  if(pyramid_levels < 0 || band_radius < 0)
+    throw std::invalid_argument("[StereoSGMParams::create] negative pyramid levels or band radius");
+  if(min_disp < 0 || min_disp >= disp_range)
+    throw std::invalid_argument("[StereoSGMParams::create] min_disp is outside the disparity range");
+  if(speckle_size < 0 || speckle_range < 0 || 256*speckle_range > 0xFFFF)
+    throw std::invalid_argument("[StereoSGMParams::create] invalid speckle size or range");
+  if(num_candidates < 0)
+    throw std::invalid_argument("[StereoSGMParams::create] negative number of candidates");
+  switch(cost) {
+    case StereoCost::kSAD:
+      return std::unique_ptr<StereoSGMBase>(new StereoSGM<CostSAD>(*this));
+    case StereoCost::kZSAD:
+      return std::unique_ptr<StereoSGMBase>(new StereoSGM<CostZSAD>(*this));
+    case StereoCost::kCensus:
+      return std::unique_ptr<StereoSGMBase>(new StereoSGM<CostCensus>(*this));
+    case StereoCost::kNCC:
+      return std::unique_ptr<StereoSGMBase>(new StereoSGM<CostNCC>(*this));
+  }
+  throw std::invalid_argument("[StereoSGMParams::create] unknown cost");
+}
+
+template class StereoSGM<CostSAD>;
+template class StereoSGM<CostZSAD>;
+template class StereoSGM<CostCensus>;
+template class StereoSGM<CostNCC>;
+
 }
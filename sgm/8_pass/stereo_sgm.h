@@ -3,147 +3,259 @@
 
 #include <iostream>
 #include <cassert>
+#include <limits>
+#include <memory>
+#include <vector>
+#include <algorithm>
 
 #include <opencv2/core/core.hpp>
 
-//#define COST_CENSUS
-#define COST_ZSAD
+#include "cost_volume.h"
+#include "../common/candidate_aggregation.h"
+#include "../common/disparity_band.h"
+#include "../common/path_aggregation.h"
+#include "../common/speckle_filter.h"
+#include "../common/stage_stats.h"
 
 namespace recon
 {
 
+class StereoSGMBase;
+
+enum class StereoCost
+{
+  kSAD,
+  kZSAD,
+  kCensus,
+  kNCC
+};
+
 struct StereoSGMParams
 {
   int disp_range;
   int window_sz;
   int penalty1;
   int penalty2;
+  // number of aggregation directions processed at once (1 - 8), each one holds a W x H x D path volume
+  int num_concurrent_paths = 4;
+  StereoCost cost = StereoCost::kZSAD;
+  // coarse-to-fine search: the full disparity range is only searched on the image downsampled
+  // pyramid_levels times, every finer level searches band_radius disparities around the
+  // upsampled disparities of the level below, 0 searches the full range at full resolution
+  int pyramid_levels = 0;
+  int band_radius = 4;
+  // disparities below min_disp are never searched, the search window is [min_disp, disp_range)
+  int min_disp = 0;
+  // optional inclusive disparity bounds of every image row which narrow the window further,
+  // e.g. from the ground plane of a fixed rig, empty or one entry per image row
+  std::vector<int> row_min_disp;
+  std::vector<int> row_max_disp;
+  // speckle filter after the median: connected regions of at most speckle_size pixels, whose
+  // neighbours differ by at most speckle_range disparities, are invalidated, 0 turns it off
+  int speckle_size = 0;
+  int speckle_range = 2;
+  // memory efficient full range search: no volume is stored, each pixel keeps the num_candidates
+  // disparities with the smallest sums of each half of the paths and the costs are computed again
+  // by each of the three sweeps (see CandidateAggregator), 0 keeps the volumes. The band modes ignore it.
+  int num_candidates = 0;
+
+  // creates the StereoSGM instantiation for the chosen cost,
+  // only compute() is a virtual call, the cost and aggregation loops are specialized
+  std::unique_ptr<StereoSGMBase> create() const;
 };
 
-#ifdef COST_SAD
-// SAD
-typedef uint16_t CostType;
-typedef uint32_t ACostType;
-#endif
-
-#ifdef COST_ZSAD
-// ZSAD
-typedef float CostType;  // for ZSAD
-typedef float ACostType;  // accumulated cost type
-#endif
-
-#ifdef COST_CENSUS
-// Census
-typedef uint8_t CostType;  // for 1x1 SAD, 5x5 Census
-typedef uint32_t ACostType;  // accumulated cost type, Census
-#endif
-
-//typedef uint8_t ACostType;  // accumulated cost type - byte for Census?
-// if we want to use raw arrays
-//typedef CostType* CostArray1D;
-//typedef CostType*** CostArray3D;
-//typedef ACostType* ACostArray1D;
-//typedef ACostType*** ACostArray3D;
-
-typedef std::vector<CostType> CostArray1D;
-typedef std::vector<ACostType> ACostArray1D;
-typedef std::vector<std::vector<CostArray1D>> CostArray;
-typedef std::vector<std::vector<ACostArray1D>> ACostArray;
+// runtime interface over all StereoSGM instantiations
+class StereoSGMBase
+{
+ public:
+  virtual ~StereoSGMBase() {}
+  // stats is optional, when given it receives the time and memory of every stage
+  virtual void compute(const cv::Mat& left_img, const cv::Mat& right_img, cv::Mat& disp,
+                       FrameStats* stats = nullptr) = 0;
+  // same writing the 16-bit disparities (disparity * 256, 0 is invalid) of the left_img sized map
+  // straight into the caller's buffer whose rows are stride elements apart, nothing is written to disk
+  virtual void compute(const cv::Mat& left_img, const cv::Mat& right_img, uint16_t* disp, size_t stride,
+                       FrameStats* stats = nullptr) = 0;
+  // the volumes are kept between calls and only reallocated when the image size grows,
+  // warm_up allocates them for img_width x img_height images and faults their pages in
+  virtual void warm_up(int img_width, int img_height) = 0;
+};
 
-class StereoSGM
+// CostPolicy is one of the policies from cost_policies.h
+template<typename CostPolicy>
+class StereoSGM : public StereoSGMBase
 {
  public:
-  StereoSGM(StereoSGMParams& params) : params_(params) {}
-  void compute(cv::Mat& left_img, cv::Mat& right_img, cv::Mat& disp);
+  typedef typename CostPolicy::CostType CostType;
+  typedef typename CostPolicy::ACostType ACostType;
+  typedef typename CostPolicy::PathCostType PathCostType;
+  //typedef uint8_t ACostType;  // accumulated cost type - byte for Census?
+
+  // H x W x D volumes, the disparities of a pixel are contiguous
+  typedef CostVolume<CostType> CostArray;
+  typedef CostVolume<ACostType> ACostArray;
+  typedef CostVolume<PathCostType> PathCostArray;
+
+  StereoSGM(const StereoSGMParams& params) : params_(params) {}
+  void compute(const cv::Mat& left_img, const cv::Mat& right_img, cv::Mat& disp,
+               FrameStats* stats = nullptr) override;
+  void compute(const cv::Mat& left_img, const cv::Mat& right_img, uint16_t* disp, size_t stride,
+               FrameStats* stats = nullptr) override;
+  void warm_up(int img_width, int img_height) override;
 
  protected:
-  void aggregate_costs(const cv::Mat& img, CostArray const& costs, int DIRX, int DIRY, ACostArray& aggr_costs);
-  void sum_costs(const ACostArray& costs1, ACostArray& costs2);
+  // costs and aggregated costs of the cropped image, in aggr_costs_ or in the band volumes in the pyramid mode
+  void match(const cv::Mat& left_img, const cv::Mat& right_img, FrameStats* stats);
+  void match_band(const cv::Mat& left_img, const cv::Mat& right_img, FrameStats* stats);
+  void match_candidates(const cv::Mat& left_img, const cv::Mat& right_img, FrameStats* stats);
+  // winner takes all disparities without refinement or checks, used as the prior of the finer level
+  void wta_disparities(cv::Mat& disp);
+  void aggregate_costs(const cv::Mat& img, CostArray const& costs, int DIRX, int DIRY, PathCostArray& aggr_costs,
+                       std::vector<PathCostType>& min_costs);
+  void aggregate_band_costs(const CostType* costs, int DIRX, int DIRY, PathCostType* aggr_costs,
+                            std::vector<PathCostType>& min_costs);
+  // only the band of every pixel is searched when the window is narrowed or the pyramid is used
+  bool banded() const {
+    return params_.pyramid_levels > 0 || params_.min_disp > 0 || !params_.row_min_disp.empty() ||
+           !params_.row_max_disp.empty();
+  }
+  bool candidate_aggregation() const {
+    return params_.num_candidates > 0 && !banded();
+  }
+  bool reserve_workspace(int height, int width);
+  void reserve_band();
+  StereoSGM& coarse_engine();
+  size_t workspace_bytes() const;
+  void sum_costs(const std::vector<PathCostArray>& path_costs, int num_paths, ACostArray& costs);
+  void sum_band_costs(int num_paths);
 
   template<typename T1, typename T2>
-  void copy_vector(const std::vector<T1>& vec1, std::vector<T2>& vec2);
+  void copy_vector(const T1* vec1, T2* vec2, int size);
   template<typename T1, typename T2>
-  void sum_vectors(const std::vector<T1>& vec1, std::vector<T2>& vec2);
+  void sum_vectors(const T1* vec1, T2* vec2, int size);
   template<typename T>
-  T get_min(const std::vector<T>& vec);
-  int FindMinDisp(const std::vector<CostType>& costs);
-  int find_min_disp(const std::vector<ACostType>& costs);
-  int find_min_disp_right(const std::vector<std::vector<ACostType>>& costs, int x);
+  T get_min(const T* vec, int size);
+  int FindMinDisp(const CostType* costs);
+  int find_min_disp(const ACostType* costs);
+  int find_min_disp_band(const ACostType* costs, int count);
+  int find_min_disp_right(const ACostArray& costs, int y, int x);
   void init_costs(ACostType init_val, ACostArray& costs);
 
   cv::Mat GetDisparityImage(const CostArray& costs, int msz);
   cv::Mat get_disparity_matrix_float(const ACostArray& costs, int msz);
   cv::Mat get_disparity_image_uint16(const ACostArray& costs, int msz);
   cv::Mat get_disparity_image(const ACostArray& costs, int msz);
-  void aggregate_path(const std::vector<ACostType>& prior, const std::vector<CostType>& local,
-                      std::vector<ACostType>& costs, int gradient);
+  cv::Mat get_band_disparity_image_uint16(int msz);
+  cv::Mat get_candidate_disparity_image_uint16(int msz);
+  PathCostType init_path(const CostType* local, PathCostType* costs);
+  PathCostType aggregate_path(const PathCostType* prior, PathCostType min_prior, const CostType* local,
+                              PathCostType* costs, int gradient);
 
   //inline getCensusCost();
   StereoSGMParams params_;
+
+  // workspace reused by every call, one path volume and min cost buffer per concurrent direction
+  CostArray costs_;
+  ACostArray aggr_costs_;
+  std::vector<PathCostArray> path_aggr_costs_;
+  std::vector<std::vector<PathCostType>> min_costs_;
+  SpeckleFilter<uint16_t> speckle_filter_;
+
+  // band mode, the bounds of the cropped rows, the engine of the next coarser level and the ragged band volumes
+  std::unique_ptr<StereoSGM> coarse_;
+  cv::Mat coarse_disp_;
+  std::vector<int> row_lo_, row_hi_;
+  DisparityBand band_;
+  std::vector<CostType> band_costs_;
+  std::vector<ACostType> band_aggr_costs_;
+  std::vector<std::vector<PathCostType>> band_path_costs_;
+
+  // candidate mode, the candidates of every pixel and the rows of the sweeps
+  typedef CandidateAggregator<CostType, PathCostType, ACostType> CandidateAggregatorType;
+  CandidateAggregatorType candidate_aggregator_;
 };
 
+template<typename CostPolicy>
 template<typename T1, typename T2>
 inline
-void StereoSGM::sum_vectors(const std::vector<T1>& vec1, std::vector<T2>& vec2)
+void StereoSGM<CostPolicy>::sum_vectors(const T1* vec1, T2* vec2, int size)
 {
-  assert(vec1.size() == vec2.size());
-  for(size_t i = 0; i < vec2.size(); i++)
+  for(int i = 0; i < size; i++)
     vec2[i] += (T2)vec1[i];
 }
 
+template<typename CostPolicy>
 template<typename T1, typename T2>
 inline
-void StereoSGM::copy_vector(const std::vector<T1>& vec1, std::vector<T2>& vec2)
+void StereoSGM<CostPolicy>::copy_vector(const T1* vec1, T2* vec2, int size)
 {
-  assert(vec1.size() == vec2.size());
-  for(size_t i = 0; i < vec1.size(); i++) {
+  for(int i = 0; i < size; i++) {
     vec2[i] = (T2)vec1[i];
     //std::cout << "d = " << i << " - " << (T2)vec1[i] << " == " << vec2[i] << "\n";
   }
 }
 
+// adds the first num_paths path volumes to costs, the rows are split between threads
+// so each output row has a single writer and the paths are always summed in the same order
+template<typename CostPolicy>
 inline
-void StereoSGM::sum_costs(const ACostArray& costs1, ACostArray& costs2)
+void StereoSGM<CostPolicy>::sum_costs(const std::vector<PathCostArray>& path_costs, int num_paths,
+                                      ACostArray& costs)
 {
-  size_t height = costs1.size();
-  size_t width = costs1[0].size();
-  assert(costs1.size() == costs2.size());
-  for(size_t y = 0; y < height; y++) {
-    assert(costs1[y].size() == costs2[y].size());
-    for(size_t x = 0; x < width; x++) {
-      sum_vectors<ACostType,ACostType>(costs1[y][x], costs2[y][x]);
+  int height = costs.height();
+  int width = costs.width();
+  int disp_range = costs.disp_range();
+  #pragma omp parallel for
+  for(int y = 0; y < height; y++) {
+    for(int i = 0; i < num_paths; i++) {
+      // the padding depends on the element type so only the geometry has to match
+      assert(path_costs[i].height() == height && path_costs[i].width() == width &&
+             path_costs[i].disp_range() == disp_range);
+      for(int x = 0; x < width; x++)
+        sum_vectors<PathCostType,ACostType>(path_costs[i].ptr(y,x), costs.ptr(y,x), disp_range);
     }
   }
 }
 
+// the band rows are contiguous so each thread adds whole rows of all paths
+template<typename CostPolicy>
 inline
-void StereoSGM::aggregate_path(const std::vector<ACostType>& prior, const std::vector<CostType>& local,
-                               std::vector<ACostType>& costs, int gradient)
+void StereoSGM<CostPolicy>::sum_band_costs(int num_paths)
+{
+  const DisparityBand& band = band_;
+  int height = band.height();
+  #pragma omp parallel for
+  for(int y = 0; y < height; y++) {
+    size_t offset = band.Offset(y,0);
+    int row_size = static_cast<int>(band.RowSize(y));
+    for(int i = 0; i < num_paths; i++)
+      sum_vectors<PathCostType,ACostType>(&band_path_costs_[i][offset], &band_aggr_costs_[offset], row_size);
+  }
+}
+
+// the first pixel on a path has no prior so L_r = C
+template<typename CostPolicy>
+inline
+typename StereoSGM<CostPolicy>::PathCostType
+StereoSGM<CostPolicy>::init_path(const CostType* local, PathCostType* costs)
+{
+  copy_vector<CostType,PathCostType>(local, costs, params_.disp_range);
+  return get_min<PathCostType>(costs, params_.disp_range);
+}
+
+// min_prior is the minimum of prior over all disparities, returns the same for costs
+template<typename CostPolicy>
+inline
+typename StereoSGM<CostPolicy>::PathCostType
+StereoSGM<CostPolicy>::aggregate_path(const PathCostType* prior, PathCostType min_prior, const CostType* local,
+                                      PathCostType* costs, int gradient)
 {
-  assert(params_.disp_range == costs.size());
   int P1 = params_.penalty1;
   int P2 = params_.penalty2;
-  copy_vector<CostType,ACostType>(local, costs);
-  int max_disp = params_.disp_range;
-
-  ACostType min_prior = get_min<ACostType>(prior);
   // decrease the P2 error if the gradient is big which is a clue for the discontinuites
   // TODO: works very bad on KITTI...
   //P2 = std::max(P1, gradient ? (int)std::round(static_cast<float>(P2/gradient)) : P2);
-  for(int d = 0; d < max_disp; d++) {
-    ACostType error = min_prior + P2;
-    error = std::min(error, prior[d]);
-    if(d > 0)
-      error = std::min(error, prior[d-1] + P1);
-    if(d < (max_disp - 1))
-      error = std::min(error, prior[d+1] + P1);
-
-    // ACostType can be uint8_t and e_smooth int
-    // Normalize by subtracting min of prior cost
-    // Now we have upper limit on cost: e_smooth <= C_max + P2
-    // LR check won't work without this normalization also
-    costs[d] += (error - min_prior);
-  }
+  return aggregate_path_step(prior, min_prior, local, costs, params_.disp_range, P1, P2);
 }
 
 //inline
@@ -182,73 +294,86 @@ void StereoSGM::aggregate_path(const std::vector<ACostType>& prior, const std::v
 //  return curr_cost;
 //}
 
+template<typename CostPolicy>
 inline
-void StereoSGM::init_costs(ACostType init_val, ACostArray& costs)
+void StereoSGM<CostPolicy>::init_costs(ACostType init_val, ACostArray& costs)
 {
-  size_t disp_range = costs[0][0].size();
-  size_t width = costs[0].size();
-  size_t height = costs.size();
-  for(size_t i = 0; i < height; i++)
-    for(size_t j = 0; j < width; j++)
-      for(size_t k = 0; k < disp_range; k++)
-        costs[i][j][k] = init_val;
+  costs.fill(init_val);
 }
 
+template<typename CostPolicy>
 template<typename T>
 inline
-T StereoSGM::get_min(const std::vector<T>& vec)
+T StereoSGM<CostPolicy>::get_min(const T* vec, int size)
 {
   T min = vec[0];
-  for(size_t i = 1; i < vec.size(); i++) {
+  for(int i = 1; i < size; i++) {
     if(vec[i] < min)
       min = vec[i];
   }
   return min;
 }
 
+template<typename CostPolicy>
 inline
-int StereoSGM::find_min_disp(const std::vector<ACostType>& costs) {
+int StereoSGM<CostPolicy>::find_min_disp(const ACostType* costs) {
   int d = 0;
-  for(size_t i = 1; i < costs.size(); i++) {
+  for(int i = 1; i < params_.disp_range; i++) {
     if(costs[i] < costs[d])
       d = i;
   }
   return d;
 }
 
+template<typename CostPolicy>
+inline
+int StereoSGM<CostPolicy>::find_min_disp_band(const ACostType* costs, int count) {
+  int i_min = 0;
+  for(int i = 1; i < count; i++) {
+    if(costs[i] < costs[i_min])
+      i_min = i;
+  }
+  return i_min;
+}
+
+template<typename CostPolicy>
 inline
-int StereoSGM::FindMinDisp(const std::vector<CostType>& costs) {
+int StereoSGM<CostPolicy>::FindMinDisp(const CostType* costs) {
   int d = 0;
-  for(size_t i = 1; i < costs.size(); i++) {
+  for(int i = 1; i < params_.disp_range; i++) {
     if(costs[i] < costs[d])
       d = i;
   }
   return d;
 }
 
+template<typename CostPolicy>
 inline
-int StereoSGM::find_min_disp_right(const std::vector<std::vector<ACostType>>& costs, int x)
+int StereoSGM<CostPolicy>::find_min_disp_right(const ACostArray& costs, int y, int x)
 {
   int d = 0;
-  //ACostType min_cost = costs[x+d][d];
-  int width = costs.size();
+  // right image pixel x matches left pixel x+d so we walk diagonally through the volume
+  const ACostType* row = costs.row(y);
+  const size_t x_stride = costs.x_stride();
+  int width = costs.width();
   int max_disp = std::min(params_.disp_range, (width - x));
   for(int i = 1; i < max_disp; i++) {
-    if(costs[x+i][i] < costs[x+d][d])
+    if(row[(x+i)*x_stride + i] < row[(x+d)*x_stride + d])
       d = i;
   }
   return d;
 }
 
+template<typename CostPolicy>
 inline
-cv::Mat StereoSGM::GetDisparityImage(const CostArray& costs, int msz)
+cv::Mat StereoSGM<CostPolicy>::GetDisparityImage(const CostArray& costs, int msz)
 {
-  int height = costs.size();
-  int width = costs[0].size();
+  int height = costs.height();
+  int width = costs.width();
   cv::Mat img = cv::Mat::zeros(height + 2*msz, width + 2*msz, CV_8U);
   for(int y = 0; y < height; y++) {
     for(int x = 0; x < width; x++) {
-      int d = FindMinDisp(costs[y][x]);
+      int d = FindMinDisp(costs.ptr(y,x));
       //img.at<uint8_t>(y,x) = 4 * d;
       img.at<uint8_t>(msz+y, msz+x) = d;
     }
@@ -256,15 +381,16 @@ cv::Mat StereoSGM::GetDisparityImage(const CostArray& costs, int msz)
   return img;
 }
 
+template<typename CostPolicy>
 inline
-cv::Mat StereoSGM::get_disparity_image(const ACostArray& costs, int msz)
+cv::Mat StereoSGM<CostPolicy>::get_disparity_image(const ACostArray& costs, int msz)
 {
-  int height = costs.size();
-  int width = costs[0].size();
+  int height = costs.height();
+  int width = costs.width();
   cv::Mat img = cv::Mat::zeros(height + 2*msz, width + 2*msz, CV_8U);
   for(int y = 0; y < height; y++) {
     for(int x = 0; x < width; x++) {
-      int d = find_min_disp(costs[y][x]);
+      int d = find_min_disp(costs.ptr(y,x));
       //img.at<uint8_t>(y,x) = 4 * d;
       img.at<uint8_t>(msz+y, msz+x) = d;
     }
@@ -272,19 +398,21 @@ cv::Mat StereoSGM::get_disparity_image(const ACostArray& costs, int msz)
   return img;
 }
 
+template<typename CostPolicy>
 inline
-cv::Mat StereoSGM::get_disparity_image_uint16(const ACostArray& costs, int msz)
+cv::Mat StereoSGM<CostPolicy>::get_disparity_image_uint16(const ACostArray& costs, int msz)
 {
-  int height = costs.size();
-  int width = costs[0].size();
+  int height = costs.height();
+  int width = costs.width();
   cv::Mat img = cv::Mat::zeros(height + 2*msz, width + 2*msz, CV_16U);
   for(int y = 0; y < height; y++) {
     for(int x = 0; x < width; x++) {
+      const ACostType* pix_costs = costs.ptr(y,x);
       // find minimum cost disparity
-      int d = find_min_disp(costs[y][x]);
+      int d = find_min_disp(pix_costs);
       // TODO: do the fast LR check
       if((x-d) >= 0) {
-        int d_right = find_min_disp_right(costs[y], x-d);
+        int d_right = find_min_disp_right(costs, y, x-d);
         //std::cout << "d = " << d << " , " << " d_r = " << d_right << "\n";
         if(std::abs(d - d_right) > 2) {
           img.at<uint16_t>(msz+y, msz+x) = 0;
@@ -297,9 +425,9 @@ cv::Mat StereoSGM::get_disparity_image_uint16(const ACostArray& costs, int msz)
       }
       // perform equiangular subpixel interpolation
       if(d >= 1 && d < (params_.disp_range-1)) {
-        float C_left = costs[y][x][d-1];
-        float C_center = costs[y][x][d];
-        float C_right = costs[y][x][d+1];
+        float C_left = pix_costs[d-1];
+        float C_center = pix_costs[d];
+        float C_right = pix_costs[d+1];
         float d_s = 0;
         if(C_right < C_left)
           d_s = 0.5f * (C_right - C_left) / (C_center - C_left);
@@ -316,20 +444,136 @@ cv::Mat StereoSGM::get_disparity_image_uint16(const ACostArray& costs, int msz)
   return img;
 }
 
+// same output as get_disparity_image_uint16 for the band volumes
+template<typename CostPolicy>
+inline
+cv::Mat StereoSGM<CostPolicy>::get_band_disparity_image_uint16(int msz)
+{
+  const DisparityBand& band = band_;
+  int height = band.height();
+  int width = band.width();
+  cv::Mat img = cv::Mat::zeros(height + 2*msz, width + 2*msz, CV_16U);
+  std::vector<ACostType> right_costs(width);
+  std::vector<int> right_disp(width);
+  for(int y = 0; y < height; y++) {
+    // right pixel x-d matches the left pixel x at d, the right winners are gathered from the left bands
+    std::fill(right_disp.begin(), right_disp.end(), -1);
+    for(int x = 0; x < width; x++) {
+      if(band.Empty(y,x))
+        continue;
+      const ACostType* pix_costs = &band_aggr_costs_[band.Offset(y,x)];
+      int lo = band.Lo(y,x);
+      for(int i = 0; i < band.Count(y,x); i++) {
+        int d = lo + i;
+        int xr = x - d;
+        if(right_disp[xr] < 0 || pix_costs[i] < right_costs[xr] ||
+           (pix_costs[i] == right_costs[xr] && d < right_disp[xr])) {
+          right_costs[xr] = pix_costs[i];
+          right_disp[xr] = d;
+        }
+      }
+    }
+    for(int x = 0; x < width; x++) {
+      // pixels which can not match within the bounds stay invalid
+      if(band.Empty(y,x))
+        continue;
+      const ACostType* pix_costs = &band_aggr_costs_[band.Offset(y,x)];
+      int count = band.Count(y,x);
+      int i = find_min_disp_band(pix_costs, count);
+      int d = band.Lo(y,x) + i;
+      if(std::abs(d - right_disp[x-d]) > 2)
+        continue;
+      // perform equiangular subpixel interpolation when both neighbours were searched
+      if(i >= 1 && i < (count-1)) {
+        float C_left = pix_costs[i-1];
+        float C_center = pix_costs[i];
+        float C_right = pix_costs[i+1];
+        float d_s = 0;
+        if(C_right < C_left)
+          d_s = 0.5f * (C_right - C_left) / (C_center - C_left);
+        else
+          d_s = 0.5f * (C_right - C_left) / (C_center - C_right);
+        img.at<uint16_t>(msz+y, msz+x) = static_cast<uint16_t>(std::round(256.0 * (d + d_s)));
+      }
+      else {
+        img.at<uint16_t>(msz+y, msz+x) = static_cast<uint16_t>(std::round(256.0 * d));
+      }
+    }
+  }
+  return img;
+}
+
+// same output as get_disparity_image_uint16 from the candidates, the right pixel x-d takes the best
+// of the left candidates at d which fall on it
+template<typename CostPolicy>
+inline
+cv::Mat StereoSGM<CostPolicy>::get_candidate_disparity_image_uint16(int msz)
+{
+  const CandidateAggregatorType& aggregator = candidate_aggregator_;
+  int height = aggregator.height();
+  int width = aggregator.width();
+  int num_candidates = aggregator.num_candidates();
+  cv::Mat img = cv::Mat::zeros(height + 2*msz, width + 2*msz, CV_16U);
+  std::vector<ACostType> right_costs(width);
+  std::vector<int> right_disp(width);
+  for(int y = 0; y < height; y++) {
+    std::fill(right_disp.begin(), right_disp.end(), -1);
+    for(int x = 0; x < width; x++) {
+      const typename CandidateAggregatorType::Candidate* cands = aggregator.candidates(y,x);
+      for(int i = 0; i < num_candidates; i++) {
+        int d = cands[i].disp;
+        int xr = x - d;
+        if(xr < 0)
+          continue;
+        if(right_disp[xr] < 0 || cands[i].sums[1] < right_costs[xr] ||
+           (cands[i].sums[1] == right_costs[xr] && d < right_disp[xr])) {
+          right_costs[xr] = cands[i].sums[1];
+          right_disp[xr] = d;
+        }
+      }
+    }
+    for(int x = 0; x < width; x++) {
+      const typename CandidateAggregatorType::Candidate* cands = aggregator.candidates(y,x);
+      const typename CandidateAggregatorType::Candidate& best = cands[CandidateAggregatorType::best(cands, num_candidates)];
+      int d = best.disp;
+      if((x-d) < 0 || std::abs(d - right_disp[x-d]) > 2)
+        continue;
+      // perform equiangular subpixel interpolation
+      if(d >= 1 && d < (params_.disp_range-1)) {
+        float C_left = best.sums[0];
+        float C_center = best.sums[1];
+        float C_right = best.sums[2];
+        float d_s = 0;
+        if(C_right < C_left)
+          d_s = 0.5f * (C_right - C_left) / (C_center - C_left);
+        else
+          d_s = 0.5f * (C_right - C_left) / (C_center - C_right);
+        img.at<uint16_t>(msz+y, msz+x) = static_cast<uint16_t>(std::round(256.0 * (d + d_s)));
+      }
+      else {
+        img.at<uint16_t>(msz+y, msz+x) = static_cast<uint16_t>(std::round(256.0 * d));
+      }
+    }
+  }
+  return img;
+}
+
+template<typename CostPolicy>
 inline
-cv::Mat StereoSGM::get_disparity_matrix_float(const ACostArray& costs, int msz)
+cv::Mat StereoSGM<CostPolicy>::get_disparity_matrix_float(const ACostArray& costs, int msz)
 {
-  int height = costs.size();
-  int width = costs[0].size();
+  int height = costs.height();
+  int width = costs.width();
   cv::Mat img = cv::Mat::zeros(height + 2*msz, width + 2*msz, CV_32F);
   //#pragma omp parallel for
   for(int y = 0; y < height; y++) {
     for(int x = 0; x < width; x++) {
+      const ACostType* pix_costs = costs.ptr(y,x);
       // find minimum cost disparity
-      int d = find_min_disp(costs[y][x]);
+      int d = find_min_disp(pix_costs);
       // TODO: do the fast LR check
       if((x-d) >= 0) {
-        int d_right = find_min_disp_right(costs[y], x-d);
+        int d_right = find_min_disp_right(costs, y, x-d);
         //std::cout << "d = " << d << " , " << " d_r = " << d_right << "\n";
         if(std::abs(d - d_right) > 2) {
           img.at<float>(msz+y, msz+x) = -1.0f;
@@ -342,9 +586,9 @@ cv::Mat StereoSGM::get_disparity_matrix_float(const ACostArray& costs, int msz)
       }
       // perform equiangular subpixel interpolation
       if(d >= 1 && d < (params_.disp_range-1)) {
-        float C_left = costs[y][x][d-1];
-        float C_center = costs[y][x][d];
-        float C_right = costs[y][x][d+1];
+        float C_left = pix_costs[d-1];
+        float C_center = pix_costs[d];
+        float C_right = pix_costs[d+1];
         float d_s = 0;
         if(C_right < C_left)
           d_s = 0.5f * (C_right - C_left) / (C_center - C_left);
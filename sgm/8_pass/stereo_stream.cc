@@ -0,0 +1,57 @@
+#include "stereo_stream.h"
+
+#include <stdexcept>
+
+#include <opencv2/highgui/highgui.hpp>
+
+namespace recon
+{
+
+StereoStream::StereoStream(const StereoSGMParams& params, int num_engines, size_t max_in_flight)
+    : pipeline_(max_in_flight)
+{
+  num_engines = std::max(1, num_engines);
+  for(int i = 0; i < num_engines; i++)
+    engines_.push_back(params.create());
+
+  pipeline_.AddStage([](StereoFrame& frame, int) {
+    ScopedStage stage(&frame.stats, "decode");
+    if(frame.left_img.empty())
+      frame.left_img = cv::imread(frame.left_path, CV_LOAD_IMAGE_GRAYSCALE);
+    if(frame.right_img.empty())
+      frame.right_img = cv::imread(frame.right_path, CV_LOAD_IMAGE_GRAYSCALE);
+    if(frame.left_img.empty() || frame.right_img.empty())
+      throw std::runtime_error("can not read the stereo pair " + frame.left_path + " " + frame.right_path);
+  });
+  pipeline_.AddStage([this](StereoFrame& frame, int worker) {
+    engines_[worker]->compute(frame.left_img, frame.right_img, frame.disparity, &frame.stats);
+    // the images are not needed anymore
+    frame.left_img.release();
+    frame.right_img.release();
+  }, num_engines);
+  pipeline_.AddStage([](StereoFrame& frame, int) {
+    if(frame.output_path.empty())
+      return;
+    ScopedStage stage(&frame.stats, "encode");
+    if(!cv::imwrite(frame.output_path, frame.disparity))
+      throw std::runtime_error("can not write " + frame.output_path);
+  });
+  pipeline_.Start();
+}
+
+StereoStream::~StereoStream()
+{
+  close();
+}
+
+std::future<StereoFrame> StereoStream::submit(StereoFrame frame)
+{
+  return pipeline_.Submit(std::move(frame));
+}
+
+void StereoStream::close()
+{
+  pipeline_.Stop();
+}
+
+}
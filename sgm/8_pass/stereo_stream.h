@@ -0,0 +1,54 @@
+#ifndef RECONSTRUCTION_BASE_STEREO_STREAM_
+#define RECONSTRUCTION_BASE_STEREO_STREAM_
+
+#include <future>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+
+#include "stereo_sgm.h"
+#include "../common/frame_pipeline.h"
+#include "../common/stage_stats.h"
+
+namespace recon
+{
+
+struct StereoFrame
+{
+  // decoded in the load stage when the images are empty
+  std::string left_path;
+  std::string right_path;
+  cv::Mat left_img;
+  cv::Mat right_img;
+  // the 16-bit disparity map is written here in the encode stage when set
+  std::string output_path;
+
+  cv::Mat disparity;
+  FrameStats stats;
+};
+
+// Streaming front end of StereoSGM: load/decode -> compute -> encode.
+// Each stage runs on its own threads so consecutive frames overlap, the compute stage has
+// num_engines StereoSGM instances with their own workspaces so the cost computation of one
+// frame runs next to the aggregation of another. submit() blocks while max_in_flight frames
+// are unfinished.
+class StereoStream
+{
+ public:
+  StereoStream(const StereoSGMParams& params, int num_engines = 2, size_t max_in_flight = 4);
+  ~StereoStream();
+
+  std::future<StereoFrame> submit(StereoFrame frame);
+  // finishes the submitted frames
+  void close();
+
+ private:
+  std::vector<std::unique_ptr<StereoSGMBase>> engines_;
+  FramePipeline<StereoFrame> pipeline_;
+};
+
+}
+
+#endif
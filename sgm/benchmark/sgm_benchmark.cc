@@ -0,0 +1,439 @@
+// Stage level benchmark of both SGM engines on synthetic rectified pairs.
+//
+// The stage times and buffer sizes come from the recon::FrameStats filled by the engines.
+// Every configuration (engine, resolution, disparity range, thread count) runs in a forked
+// process so that the reported peak RSS belongs to that configuration alone.
+//
+// usage: ./sgm_benchmark [--engines=8pass,2pass] [--sizes=vga,720p,1080p,4k] [--disps=64,128,256,512]
+//                        [--threads=1,4] [--cost=census|zsad|sad|ncc] [--channels=64] [--repeat=3]
+//                        [--mem_limit_gb=16] [--tmp=/tmp] [--pyramid=0] [--strip_mb=0]
+//                        [--quantized=0] [--candidates=0] [--descriptors=fp32|fp16|int8] [--projection=0]
+
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <omp.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/highgui/highgui.hpp>
+
+#include "../8_pass/stereo_sgm.h"
+#include "../2_pass/sgm_stereo.h"
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+double ElapsedMs(const Clock::time_point& start) {
+  return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+// sums the stages of several calls, peak_bytes keeps the largest peak
+void Accumulate(const recon::FrameStats& frame, recon::FrameStats* total) {
+  for (const recon::StageStats& stage : frame.stages)
+    total->AddStage(stage.name, stage.ms, stage.bytes_allocated);
+  total->peak_bytes = std::max(total->peak_bytes, frame.peak_bytes);
+}
+
+struct Config {
+  std::string engine;
+  std::string size_name;
+  int width;
+  int height;
+  int disp_range;
+  int threads;
+};
+
+struct Options {
+  std::vector<std::string> engines = {"8pass", "2pass"};
+  std::vector<std::string> sizes = {"vga", "720p"};
+  std::vector<int> disps = {64, 128};
+  std::vector<int> threads = {1, omp_get_max_threads()};
+  std::string cost = "census";
+  int channels = 64;
+  int repeat = 3;
+  double mem_limit_gb = 0.0;
+  std::string tmp = "/tmp";
+  // coarse-to-fine levels of both engines, 0 searches the full range
+  int pyramid = 0;
+  // buffer cap of the 2-pass engine, above it the image is matched in strips, 0 is no cap
+  int strip_mb = 0;
+  // 16-bit costs and path aggregation in the 2-pass engine
+  bool quantized = false;
+  // candidates per pixel of the memory efficient mode of both engines, 0 keeps the volumes
+  int candidates = 0;
+  // element type of the 2-pass descriptor files
+  recon::DescriptorType descriptors = recon::DescriptorType::kFloat32;
+  // channels of the PCA projection of the 2-pass descriptors, 0 matches all channels
+  int projection = 0;
+};
+
+const std::map<std::string, std::pair<int, int>> kSizes = {
+  {"vga", {640, 480}}, {"720p", {1280, 720}}, {"1080p", {1920, 1080}}, {"4k", {3840, 2160}}
+};
+
+std::vector<std::string> Split(const std::string& list) {
+  std::vector<std::string> items;
+  std::stringstream stream(list);
+  std::string item;
+  while (std::getline(stream, item, ','))
+    if (!item.empty()) items.push_back(item);
+  return items;
+}
+
+std::vector<int> SplitInts(const std::string& list) {
+  std::vector<int> values;
+  for (const std::string& item : Split(list)) values.push_back(std::stoi(item));
+  return values;
+}
+
+// ---------------------------------------------------------------------------------------------
+// synthetic data
+
+// disparity of the synthetic scene, a plane slanted from 1/8 to 7/8 of the range
+double SceneDisparity(const int y, const int height, const int disp_range) {
+  return disp_range * (0.125 + 0.75 * y / std::max(1, height - 1));
+}
+
+// smooth random texture, the right image is the left one shifted by the scene disparity
+void MakeImagePair(const int width, const int height, const int disp_range, cv::Mat* left, cv::Mat* right) {
+  std::mt19937 rng(42);
+  std::uniform_int_distribution<int> noise(0, 255);
+  std::vector<float> row(width + disp_range);
+  left->create(height, width, CV_8U);
+  right->create(height, width, CV_8U);
+  for (int y = 0; y < height; y++) {
+    // 1-2-1 smoothed noise, generated disp_range pixels wider than the image
+    int prev = noise(rng), curr = noise(rng);
+    for (size_t x = 0; x < row.size(); x++) {
+      int next = noise(rng);
+      row[x] = (prev + 2*curr + next) / 4.0f;
+      prev = curr;
+      curr = next;
+    }
+    int d = static_cast<int>(std::round(SceneDisparity(y, height, disp_range)));
+    // left pixel x matches right pixel x - d
+    for (int x = 0; x < width; x++) {
+      left->at<uint8_t>(y, x) = static_cast<uint8_t>(row[x + disp_range]);
+      right->at<uint8_t>(y, x) = static_cast<uint8_t>(row[std::min<int>(row.size() - 1, x + disp_range + d)]);
+    }
+  }
+}
+
+// descriptor files in the layout read by recon::DescriptorTensor,
+// the right descriptors are the shifted left ones with a bit of noise
+void WriteDescriptorPair(const int width, const int height, const int channels, const int disp_range,
+                         const std::string& left_path, const std::string& right_path) {
+  std::ofstream left_file(left_path, std::ios::binary);
+  std::ofstream right_file(right_path, std::ios::binary);
+  if (!left_file || !right_file)
+    throw std::runtime_error("can not write descriptors to " + left_path);
+  int32_t dims = 3;
+  uint64_t size[3] = {static_cast<uint64_t>(height), static_cast<uint64_t>(width),
+                      static_cast<uint64_t>(channels)};
+  for (std::ofstream* file : {&left_file, &right_file}) {
+    file->write(reinterpret_cast<const char*>(&dims), sizeof(dims));
+    file->write(reinterpret_cast<const char*>(size), sizeof(size));
+  }
+
+  std::mt19937 rng(7);
+  std::normal_distribution<float> gauss(0.0f, 1.0f);
+  const int row_width = width + disp_range;
+  std::vector<float> source(static_cast<size_t>(row_width) * channels);
+  std::vector<float> left_row(static_cast<size_t>(width) * channels);
+  std::vector<float> right_row(static_cast<size_t>(width) * channels);
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < row_width; x++) {
+      float* desc = &source[static_cast<size_t>(x) * channels];
+      float norm = 0.0f;
+      for (int c = 0; c < channels; c++) {
+        desc[c] = gauss(rng);
+        norm += desc[c] * desc[c];
+      }
+      norm = std::sqrt(norm);
+      for (int c = 0; c < channels; c++) desc[c] /= norm;
+    }
+    int d = static_cast<int>(std::round(SceneDisparity(y, height, disp_range)));
+    for (int x = 0; x < width; x++) {
+      const float* left_src = &source[static_cast<size_t>(x + disp_range) * channels];
+      const float* right_src = &source[static_cast<size_t>(std::min(row_width - 1, x + disp_range + d)) * channels];
+      for (int c = 0; c < channels; c++) {
+        left_row[static_cast<size_t>(x) * channels + c] = left_src[c];
+        right_row[static_cast<size_t>(x) * channels + c] = right_src[c] + 0.05f * gauss(rng) / std::sqrt(channels);
+      }
+    }
+    left_file.write(reinterpret_cast<const char*>(left_row.data()), left_row.size() * sizeof(float));
+    right_file.write(reinterpret_cast<const char*>(right_row.data()), right_row.size() * sizeof(float));
+  }
+}
+
+} // namespace
+
+namespace {
+
+// rough size of the buffers a configuration allocates, used to skip what does not fit
+double EstimateBytes(const Config& config, const Options& options) {
+  double volume = static_cast<double>(config.width) * config.height * config.disp_range;
+  if (options.pyramid > 0) {
+    // full range at the coarsest level, the finer levels hold a band of a few radii per pixel
+    const double kBandWidth = 4 * 4;
+    double pixels = static_cast<double>(config.width) * config.height;
+    volume /= std::pow(8.0, options.pyramid);
+    for (int level = 0; level < options.pyramid; level++) volume += pixels / std::pow(4.0, level) * kBandWidth;
+  }
+  const double descriptors = config.engine == "8pass" ? 0.0 :
+                             2.0 * config.width * config.height * options.channels *
+                             recon::DescriptorTypeSize(options.descriptors);
+  if (options.candidates > 0 && options.pyramid == 0) {
+    // 2 * candidates of 16 bytes per pixel, a block of cost rows and the path rows of the sweeps
+    double rows = static_cast<double>(config.width) * config.disp_range * (16 + 2 * 4 + 1) * sizeof(float);
+    return static_cast<double>(config.width) * config.height * 2 * options.candidates * 16 + rows + descriptors;
+  }
+  if (config.engine == "8pass") {
+    // CostType + ACostType + 4 concurrent PathCostType volumes, ZSAD is all float
+    double element = (options.cost == "zsad") ? 4 + 4 + 4*4 : 2 + 4 + 4*2;
+    return volume * element;
+  }
+  // left cost and summed cost in the single aggregation mode + the mapped descriptors
+  double volumes = volume * 2 * (options.quantized ? sizeof(uint16_t) : sizeof(float));
+  if (options.strip_mb > 0) volumes = std::min(volumes, options.strip_mb * static_cast<double>(1 << 20));
+  return volumes + descriptors;
+}
+
+long PeakRssKb() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+recon::FrameStats RunEightPass(const Config& config, const Options& options, const int repeat) {
+  recon::StereoSGMParams params;
+  if (options.cost == "census") params.cost = recon::StereoCost::kCensus;
+  else if (options.cost == "zsad") params.cost = recon::StereoCost::kZSAD;
+  else if (options.cost == "sad") params.cost = recon::StereoCost::kSAD;
+  else if (options.cost == "ncc") params.cost = recon::StereoCost::kNCC;
+  else throw std::invalid_argument("unknown cost " + options.cost);
+  params.disp_range = config.disp_range;
+  params.window_sz = 5;
+  params.penalty1 = 3;
+  params.penalty2 = 60;
+  params.num_concurrent_paths = 4;
+  params.pyramid_levels = options.pyramid;
+  params.num_candidates = options.candidates;
+  // the cost margins crop the image, add them so that the disparity map has the nominal size
+  int mc = (params.window_sz - 1) / 2;
+  cv::Mat left, right;
+  MakeImagePair(config.width + 2*mc, config.height + 2*mc, config.disp_range, &left, &right);
+
+  std::unique_ptr<recon::StereoSGMBase> sgm = params.create();
+  sgm->warm_up(left.cols, left.rows);
+  recon::FrameStats total;
+  std::string left_path = options.tmp + "/sgm_benchmark_left.png";
+  std::string right_path = options.tmp + "/sgm_benchmark_right.png";
+  for (int i = 0; i < repeat; i++) {
+    recon::FrameStats stats;
+    Clock::time_point start = Clock::now();
+    cv::imwrite(left_path, left);
+    cv::imwrite(right_path, right);
+    cv::Mat left_read = cv::imread(left_path, CV_LOAD_IMAGE_GRAYSCALE);
+    cv::Mat right_read = cv::imread(right_path, CV_LOAD_IMAGE_GRAYSCALE);
+    stats.AddStage("image_io", ElapsedMs(start));
+
+    cv::Mat disp;
+    sgm->compute(left_read, right_read, disp, &stats);
+    Accumulate(stats, &total);
+  }
+  std::remove(left_path.c_str());
+  std::remove(right_path.c_str());
+  return total;
+}
+
+recon::FrameStats RunTwoPass(const Config& config, const Options& options, const int repeat) {
+  std::string left_path = options.tmp + "/sgm_benchmark_left.bin";
+  std::string right_path = options.tmp + "/sgm_benchmark_right.bin";
+  WriteDescriptorPair(config.width, config.height, options.channels, config.disp_range, left_path, right_path);
+  recon::DescriptorProjection projection;
+  if (options.projection > 0) {
+    recon::DescriptorTensor samples;
+    samples.Load(left_path);
+    projection.Fit({&samples}, std::min(options.projection, options.channels), recon::DescriptorCost::kL2);
+  }
+  if (options.descriptors != recon::DescriptorType::kFloat32) {
+    recon::DescriptorTensor source, converted;
+    for (const std::string& path : {left_path, right_path}) {
+      source.Load(path);
+      converted.Convert(source, options.descriptors);
+      source.Close();
+      converted.Save(path);
+    }
+  }
+
+  recon::SGMStereo sgm;
+  sgm.SetSmoothnessCostParameters(3, 40);
+  sgm.SetDisparityRange(config.disp_range);
+  sgm.SetSingleAggregation(true);
+  sgm.SetPyramid(options.pyramid, 4);
+  sgm.SetMemoryLimit(static_cast<size_t>(options.strip_mb) << 20);
+  sgm.SetQuantization(options.quantized);
+  sgm.SetCandidateAggregation(options.candidates);
+  sgm.SetProjection(projection);
+  sgm.Warmup(config.width, config.height);
+  recon::FrameStats total;
+  for (int i = 0; i < repeat; i++) {
+    recon::FrameStats stats;
+    cv::Mat disp;
+    sgm.Compute(left_path, right_path, &disp, &stats);
+    Accumulate(stats, &total);
+  }
+  std::remove(left_path.c_str());
+  std::remove(right_path.c_str());
+  return total;
+}
+
+void PrintRow(const Config& config, const std::string& stage, const double ms, const double mb) {
+  double mpix_disp = static_cast<double>(config.width) * config.height * config.disp_range / 1e6;
+  std::printf("%-6s %-6s %5dx%-5d %4d %3d  %-16s %10.2f %12.1f %9.1f\n", config.engine.c_str(),
+              config.size_name.c_str(), config.width, config.height, config.disp_range, config.threads,
+              stage.c_str(), ms, mpix_disp / (ms / 1000.0), mb);
+}
+
+// runs in the forked child
+void RunConfig(const Config& config, const Options& options) {
+  omp_set_num_threads(config.threads);
+  // the first run warms up the allocator and the page cache and is not reported
+  if (config.engine == "8pass") RunEightPass(config, options, 1);
+  else RunTwoPass(config, options, 1);
+  recon::FrameStats stats = (config.engine == "8pass") ? RunEightPass(config, options, options.repeat)
+                                                       : RunTwoPass(config, options, options.repeat);
+  double total_ms = 0.0;
+  for (const recon::StageStats& stage : stats.stages) {
+    double ms = stage.ms / options.repeat;
+    // the per direction and sum times are part of "aggregate", wta is part of the last 2-pass pass
+    bool nested = stage.name.compare(0, 10, "aggregate[") == 0 || stage.name == "aggregate_sum" ||
+                  (stage.name == "wta" && config.engine == "2pass");
+    bool io = stage.name == "image_io" || stage.name == "load";
+    if (!nested && !io) total_ms += ms;
+    PrintRow(config, stage.name, ms, stage.bytes_allocated / options.repeat / 1048576.0);
+  }
+  PrintRow(config, "total (w/o io)", total_ms, 0.0);
+  std::printf("%-6s %-6s %5dx%-5d %4d %3d  buffers peak %.1f MB, process peak RSS %.1f MB\n",
+              config.engine.c_str(), config.size_name.c_str(), config.width, config.height, config.disp_range,
+              config.threads, stats.peak_bytes / 1048576.0, PeakRssKb() / 1024.0);
+  std::fflush(stdout);
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+  Options options;
+  long pages = sysconf(_SC_PHYS_PAGES);
+  long page_size = sysconf(_SC_PAGE_SIZE);
+  options.mem_limit_gb = 0.5 * pages * static_cast<double>(page_size) / (1 << 30);
+
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    size_t eq = arg.find('=');
+    if (arg.compare(0, 2, "--") != 0 || eq == std::string::npos) {
+      std::cerr << "usage: " << argv[0] << " [--engines=8pass,2pass] [--sizes=vga,720p,1080p,4k]"
+                << " [--disps=64,128,256,512] [--threads=1,4] [--cost=census|zsad|sad|ncc]"
+                << " [--channels=64] [--repeat=3] [--mem_limit_gb=N] [--tmp=/tmp] [--pyramid=0]"
+                << " [--strip_mb=0] [--quantized=0] [--candidates=0] [--descriptors=fp32|fp16|int8]"
+                << " [--projection=0]\n";
+      return 1;
+    }
+    std::string key = arg.substr(2, eq - 2);
+    std::string value = arg.substr(eq + 1);
+    if (key == "engines") options.engines = Split(value);
+    else if (key == "sizes") options.sizes = Split(value);
+    else if (key == "disps") options.disps = SplitInts(value);
+    else if (key == "threads") options.threads = SplitInts(value);
+    else if (key == "cost") options.cost = value;
+    else if (key == "channels") options.channels = std::stoi(value);
+    else if (key == "repeat") options.repeat = std::max(1, std::stoi(value));
+    else if (key == "mem_limit_gb") options.mem_limit_gb = std::stod(value);
+    else if (key == "tmp") options.tmp = value;
+    else if (key == "pyramid") options.pyramid = std::max(0, std::stoi(value));
+    else if (key == "strip_mb") options.strip_mb = std::max(0, std::stoi(value));
+    else if (key == "quantized") options.quantized = std::stoi(value) != 0;
+    else if (key == "candidates") options.candidates = std::max(0, std::stoi(value));
+    else if (key == "descriptors" && value == "fp32") options.descriptors = recon::DescriptorType::kFloat32;
+    else if (key == "descriptors" && value == "fp16") options.descriptors = recon::DescriptorType::kFloat16;
+    else if (key == "descriptors" && value == "int8") options.descriptors = recon::DescriptorType::kInt8;
+    else if (key == "projection") options.projection = std::max(0, std::stoi(value));
+    else {
+      std::cerr << "unknown option " << arg << "\n";
+      return 1;
+    }
+  }
+  std::sort(options.threads.begin(), options.threads.end());
+  options.threads.erase(std::unique(options.threads.begin(), options.threads.end()), options.threads.end());
+
+  std::printf("# 8pass cost: %s, 2pass descriptors: %d channels of %d bytes, %d repeats, memory limit %.1f GB,"
+              " pyramid levels %d, 2pass strip cap %d MB, 2pass quantized %d, candidates %d, 2pass projection %d\n",
+              options.cost.c_str(), options.channels, static_cast<int>(recon::DescriptorTypeSize(options.descriptors)),
+              options.repeat, options.mem_limit_gb, options.pyramid, options.strip_mb, options.quantized ? 1 : 0,
+              options.candidates, options.projection);
+  std::printf("%-6s %-6s %11s %4s %3s  %-16s %10s %12s %9s\n", "engine", "size", "resolution", "disp", "thr",
+              "stage", "ms", "Mpix*disp/s", "alloc MB");
+  for (const std::string& engine : options.engines) {
+    for (const std::string& size_name : options.sizes) {
+      auto size = kSizes.find(size_name);
+      if (size == kSizes.end()) {
+        std::cerr << "unknown size " << size_name << "\n";
+        return 1;
+      }
+      for (int disp_range : options.disps) {
+        for (int threads : options.threads) {
+          Config config = {engine, size_name, size->second.first, size->second.second, disp_range, threads};
+          if (engine == "2pass" && disp_range > recon::SGMStereo::kMaxDisparityRange) {
+            std::printf("%-6s %-6s %5dx%-5d %4d %3d  skipped, the 16-bit output holds at most %d disparities\n",
+                        engine.c_str(), size_name.c_str(), config.width, config.height, disp_range, threads,
+                        recon::SGMStereo::kMaxDisparityRange);
+            continue;
+          }
+          double gb = EstimateBytes(config, options) / (1 << 30);
+          if (gb > options.mem_limit_gb) {
+            std::printf("%-6s %-6s %5dx%-5d %4d %3d  skipped, needs about %.1f GB\n", engine.c_str(),
+                        size_name.c_str(), config.width, config.height, disp_range, threads, gb);
+            continue;
+          }
+          std::fflush(stdout);
+          pid_t pid = fork();
+          if (pid == 0) {
+            try {
+              RunConfig(config, options);
+            } catch (const std::exception& e) {
+              std::fprintf(stderr, "%s %s %d: %s\n", engine.c_str(), size_name.c_str(), disp_range, e.what());
+              _exit(1);
+            }
+            _exit(0);
+          }
+          int status = 0;
+          waitpid(pid, &status, 0);
+          if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            std::printf("%-6s %-6s %5dx%-5d %4d %3d  failed\n", engine.c_str(), size_name.c_str(),
+                        config.width, config.height, disp_range, threads);
+        }
+      }
+    }
+  }
+  return 0;
+}
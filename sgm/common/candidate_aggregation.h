@@ -0,0 +1,246 @@
+#ifndef RECONSTRUCTION_BASE_CANDIDATE_AGGREGATION_
+#define RECONSTRUCTION_BASE_CANDIDATE_AGGREGATION_
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+#include <algorithm>
+#include <functional>
+
+#include "path_aggregation.h"
+
+namespace recon
+{
+
+// Memory efficient SGM after Hirschmueller, Buder and Ernst, "Memory efficient semi-global matching" (2012).
+// The 8 paths are aggregated in two sweeps of 4 paths like the rows of the 2-pass engine: the forward
+// sweep runs top-down and left to right from the left, upper left, upper and upper right neighbours,
+// the backward sweep mirrors it. Neither the cost nor the summed volume is stored, every sweep asks
+// for the costs of kBlockRows rows at a time and only keeps the path rows of the previous image row.
+// Each pixel keeps num_candidates disparities:
+//   1. forward sweep   - the disparities with the smallest forward sums F
+//   2. backward sweep  - their full sums F + B, and the disparities with the smallest backward sums B
+//   3. forward sweep   - the full sums of the backward candidates
+// so every pixel ends up with 2 * num_candidates disparities and their sums over all paths at d-1, d
+// and d+1. The true minimum is found whenever it is among them, which it is for all but a few pixels
+// with ambiguous costs. Memory is W*H*2k candidates plus O(W*D) rows instead of the W*H*D volumes,
+// the price is computing the costs three times.
+template<typename CostT, typename PathT, typename SumT>
+class CandidateAggregator
+{
+ public:
+  static const int kNumPaths = 4;
+  static const int kBlockRows = 16;
+
+  struct Candidate
+  {
+    int disp;
+    // sums of all paths at disp-1, disp and disp+1, 0 outside the disparity range
+    SumT sums[3];
+  };
+  // fills the costs of the image rows [first_row, first_row + num_rows), num_rows x width x disp_range
+  // in pixel-major order, disparities which fall outside the right image are up to the caller
+  typedef std::function<void(int first_row, int num_rows, CostT* costs)> RowCosts;
+
+  // returns true if anything was allocated, the buffers only grow
+  bool reserve(int width, int height, int disp_range, int num_candidates);
+  void aggregate(const RowCosts& row_costs, int P1, int P2);
+
+  int width() const { return width_; }
+  int height() const { return height_; }
+  int num_candidates() const { return 2*k_; }
+  const Candidate* candidates(int y, int x) const { return &candidates_[(static_cast<size_t>(y)*width_ + x)*2*k_]; }
+  // index of the candidate with the smallest sum, the smaller disparity on ties like a full search
+  static int best(const Candidate* candidates, int count);
+  size_t bytes() const;
+
+ private:
+  template<typename Visit>
+  void sweep(bool forward, const RowCosts& row_costs, int P1, int P2, Visit visit);
+  // the k disparities of the smallest row sums of pixel x in increasing order, ties keep the smaller disparity
+  void select(int x, Candidate* out);
+
+  int width_ = 0;
+  int height_ = 0;
+  int disp_range_ = 0;
+  int k_ = 0;
+  std::vector<CostT> costs_;
+  std::vector<PathT> prev_[kNumPaths];
+  std::vector<PathT> curr_[kNumPaths];
+  std::vector<PathT> min_prev_[kNumPaths];
+  std::vector<PathT> min_curr_[kNumPaths];
+  // sum of the 4 paths of the current sweep
+  std::vector<SumT> row_sum_;
+  std::vector<Candidate> candidates_;
+};
+
+template<typename CostT, typename PathT, typename SumT>
+inline
+bool CandidateAggregator<CostT, PathT, SumT>::reserve(int width, int height, int disp_range, int num_candidates)
+{
+  // more candidates than disparities would only repeat them
+  int k = std::max(1, std::min(num_candidates, disp_range));
+  if(width == width_ && height == height_ && disp_range == disp_range_ && k == k_)
+    return false;
+  width_ = width;
+  height_ = height;
+  disp_range_ = disp_range;
+  k_ = k;
+  size_t row_volume = static_cast<size_t>(width) * disp_range;
+  costs_.resize(kBlockRows * row_volume);
+  for(int r = 0; r < kNumPaths; r++) {
+    prev_[r].resize(row_volume);
+    curr_[r].resize(row_volume);
+    min_prev_[r].resize(width);
+    min_curr_[r].resize(width);
+  }
+  row_sum_.resize(row_volume);
+  candidates_.resize(static_cast<size_t>(width) * height * 2*k);
+  return true;
+}
+
+template<typename CostT, typename PathT, typename SumT>
+inline
+size_t CandidateAggregator<CostT, PathT, SumT>::bytes() const
+{
+  size_t bytes = costs_.capacity() * sizeof(CostT) + row_sum_.capacity() * sizeof(SumT) +
+                 candidates_.capacity() * sizeof(Candidate);
+  for(int r = 0; r < kNumPaths; r++)
+    bytes += (prev_[r].capacity() + curr_[r].capacity() + min_prev_[r].capacity() + min_curr_[r].capacity()) *
+             sizeof(PathT);
+  return bytes;
+}
+
+template<typename CostT, typename PathT, typename SumT>
+inline
+int CandidateAggregator<CostT, PathT, SumT>::best(const Candidate* candidates, int count)
+{
+  int i_min = 0;
+  for(int i = 1; i < count; i++) {
+    const Candidate& c = candidates[i];
+    const Candidate& m = candidates[i_min];
+    if(c.sums[1] < m.sums[1] || (c.sums[1] == m.sums[1] && c.disp < m.disp))
+      i_min = i;
+  }
+  return i_min;
+}
+
+template<typename CostT, typename PathT, typename SumT>
+inline
+void CandidateAggregator<CostT, PathT, SumT>::select(int x, Candidate* out)
+{
+  const SumT* sums = &row_sum_[static_cast<size_t>(x) * disp_range_];
+  int count = 0;
+  for(int d = 0; d < disp_range_; d++) {
+    if(count == k_ && !(sums[d] < sums[out[k_-1].disp]))
+      continue;
+    // insertion into the sorted list, the disparities come in increasing order so equal sums stay behind
+    int i = std::min(count, k_ - 1);
+    while(i > 0 && sums[d] < sums[out[i-1].disp]) {
+      out[i].disp = out[i-1].disp;
+      i--;
+    }
+    out[i].disp = d;
+    count = std::min(count + 1, k_);
+  }
+  for(int i = 0; i < k_; i++) {
+    int d = out[i].disp;
+    out[i].sums[0] = d > 0 ? sums[d-1] : SumT(0);
+    out[i].sums[1] = sums[d];
+    out[i].sums[2] = d < disp_range_ - 1 ? sums[d+1] : SumT(0);
+  }
+}
+
+template<typename CostT, typename PathT, typename SumT>
+inline
+void CandidateAggregator<CostT, PathT, SumT>::aggregate(const RowCosts& row_costs, int P1, int P2)
+{
+  const int k = k_;
+  const int disp_range = disp_range_;
+  // 1. the forward candidates with their forward sums
+  sweep(true, row_costs, P1, P2, [&](int y, int x) {
+    select(x, &candidates_[(static_cast<size_t>(y)*width_ + x)*2*k]);
+  });
+  // 2. the paths are added one by one so the forward candidates get the sums of a full search
+  sweep(false, row_costs, P1, P2, [&](int y, int x) {
+    Candidate* cands = &candidates_[(static_cast<size_t>(y)*width_ + x)*2*k];
+    for(int i = 0; i < k; i++) {
+      for(int j = 0; j < 3; j++) {
+        int d = cands[i].disp + j - 1;
+        if(d < 0 || d >= disp_range)
+          continue;
+        for(int r = 0; r < kNumPaths; r++)
+          cands[i].sums[j] += curr_[r][static_cast<size_t>(x)*disp_range + d];
+      }
+    }
+    select(x, cands + k);
+  });
+  // 3. the forward sums of the backward candidates
+  sweep(true, row_costs, P1, P2, [&](int y, int x) {
+    Candidate* cands = &candidates_[(static_cast<size_t>(y)*width_ + x)*2*k] + k;
+    const SumT* sums = &row_sum_[static_cast<size_t>(x) * disp_range];
+    for(int i = 0; i < k; i++) {
+      for(int j = 0; j < 3; j++) {
+        int d = cands[i].disp + j - 1;
+        if(d >= 0 && d < disp_range)
+          cands[i].sums[j] = sums[d] + cands[i].sums[j];
+      }
+    }
+  });
+}
+
+// visit(y, x) is called once the 4 paths of the pixel are in curr_ and their sum in row_sum_
+template<typename CostT, typename PathT, typename SumT>
+template<typename Visit>
+inline
+void CandidateAggregator<CostT, PathT, SumT>::sweep(bool forward, const RowCosts& row_costs, int P1, int P2,
+                                                    Visit visit)
+{
+  const int disp_range = disp_range_;
+  const size_t row_volume = static_cast<size_t>(width_) * disp_range;
+  const int step = forward ? 1 : -1;
+  // rows [block_first, block_first + block_rows) are in costs_
+  int block_first = 0;
+  int block_rows = 0;
+  for(int i = 0; i < height_; i++) {
+    int y = forward ? i : height_ - 1 - i;
+    if(y < block_first || y >= block_first + block_rows) {
+      block_rows = std::min(kBlockRows, forward ? height_ - y : y + 1);
+      block_first = forward ? y : y - block_rows + 1;
+      row_costs(block_first, block_rows, costs_.data());
+    }
+    const CostT* cost_row = &costs_[(y - block_first) * row_volume];
+    for(int j = 0; j < width_; j++) {
+      int x = forward ? j : width_ - 1 - j;
+      size_t x_skip = static_cast<size_t>(x) * disp_range;
+      const CostT* local = cost_row + x_skip;
+      SumT* sum = &row_sum_[x_skip];
+      // previous pixel of each path: left/right in the current row, upper/lower left, center and right
+      const int px[kNumPaths] = { x - step, x - step, x, x + step };
+      for(int r = 0; r < kNumPaths; r++) {
+        PathT* curr = &curr_[r][x_skip];
+        bool has_prior = (r == 0) ? j > 0 : i > 0 && px[r] >= 0 && px[r] < width_;
+        if(has_prior) {
+          const PathT* prior = (r == 0 ? &curr_[r][0] : &prev_[r][0]) + static_cast<size_t>(px[r]) * disp_range;
+          PathT min_prior = (r == 0) ? min_curr_[r][px[r]] : min_prev_[r][px[r]];
+          min_curr_[r][x] = aggregate_path_step(prior, min_prior, local, curr, disp_range, P1, P2);
+        }
+        else {
+          std::copy(local, local + disp_range, curr);
+          min_curr_[r][x] = *std::min_element(curr, curr + disp_range);
+        }
+        for(int d = 0; d < disp_range; d++)
+          sum[d] = (r == 0) ? static_cast<SumT>(curr[d]) : static_cast<SumT>(sum[d] + curr[d]);
+      }
+      visit(y, x);
+    }
+    for(int r = 0; r < kNumPaths; r++) {
+      std::swap(curr_[r], prev_[r]);
+      std::swap(min_curr_[r], min_prev_[r]);
+    }
+  }
+}
+
+}
+
+#endif
@@ -0,0 +1,151 @@
+#ifndef RECONSTRUCTION_BASE_DISPARITY_BAND_H_
+#define RECONSTRUCTION_BASE_DISPARITY_BAND_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <vector>
+
+namespace recon {
+
+// Disparity search interval of every pixel of a width x height image: pixel (y, x) searches
+// [Lo(y, x), Lo(y, x) + Count(y, x)). The band volumes of the engines are ragged, the costs of
+// all searched disparities of a pixel are contiguous and start at Offset(y, x), so a volume
+// holds Size() elements instead of width * height * disp_range.
+// Disparities larger than x fall outside the right image and are never searched.
+// Every row has inclusive bounds [row_lo[y], row_hi[y]] the bands are clipped to. A pixel which can
+// not search any disparity within them (x < row_lo[y]) is Empty: it keeps a single disparity so the
+// aggregation paths stay connected, but the engines report it as invalid.
+class DisparityBand {
+ public:
+  DisparityBand() : width_(0), height_(0), max_count_(0) {}
+
+  // every pixel searches the bounds of its row
+  void FromRowBounds(const int width, const int height, const int* row_lo, const int* row_hi) {
+    Resize(width, height);
+    for (int y = 0; y < height_; y++) {
+      for (int x = 0; x < width_; x++) SetPixel(y, x, row_lo[y], row_hi[y], row_lo[y], row_hi[y]);
+    }
+    ComputeOffsets();
+  }
+
+  // Bands around the integer disparities of the same image at half resolution.
+  // Fine pixel (y, x) lies in the coarse pixel ((y + margin)/2 - margin, (x + margin)/2 - margin),
+  // where margin is the number of border pixels both levels crop. The band spans the 3x3 coarse
+  // neighbourhood scaled to the fine level and widened by radius on both sides, so pixels next to
+  // a depth edge search both surfaces.
+  void FromCoarse(const int* coarse, const int coarse_width, const int coarse_height,
+                  const int width, const int height, const int margin, const int radius,
+                  const int* row_lo, const int* row_hi) {
+    Resize(width, height);
+    for (int y = 0; y < height_; y++) {
+      const int cy = Clamp((y + margin) / 2 - margin, coarse_height);
+      for (int x = 0; x < width_; x++) {
+        const int cx = Clamp((x + margin) / 2 - margin, coarse_width);
+        int min_disp = coarse[cy*coarse_width + cx];
+        int max_disp = min_disp;
+        for (int ny = std::max(0, cy - 1); ny <= std::min(coarse_height - 1, cy + 1); ny++) {
+          for (int nx = std::max(0, cx - 1); nx <= std::min(coarse_width - 1, cx + 1); nx++) {
+            min_disp = std::min(min_disp, coarse[ny*coarse_width + nx]);
+            max_disp = std::max(max_disp, coarse[ny*coarse_width + nx]);
+          }
+        }
+        SetPixel(y, x, 2*min_disp - radius, 2*max_disp + radius, row_lo[y], row_hi[y]);
+      }
+    }
+    ComputeOffsets();
+  }
+
+  int width() const { return width_; }
+  int height() const { return height_; }
+  bool empty() const { return lo_.empty(); }
+  int Lo(const int y, const int x) const { return lo_[y*width_ + x]; }
+  int Count(const int y, const int x) const { return count_[y*width_ + x]; }
+  bool Empty(const int y, const int x) const { return empty_[y*width_ + x] != 0; }
+  // disparities a path carries on to the next pixel, none for Empty pixels so their
+  // placeholder disparity does not pull their neighbours towards it
+  int PathCount(const int y, const int x) const { return Empty(y, x) ? 0 : Count(y, x); }
+  size_t Offset(const int y, const int x) const { return offsets_[y*width_ + x]; }
+  // elements of one row and of the whole band volume
+  size_t RowSize(const int y) const { return offsets_[(y + 1)*width_] - offsets_[y*width_]; }
+  size_t Size() const { return offsets_.empty() ? 0 : offsets_.back(); }
+  size_t MaxRowSize() const {
+    size_t max_size = 0;
+    for (int y = 0; y < height_; y++) max_size = std::max(max_size, RowSize(y));
+    return max_size;
+  }
+  int MaxCount() const { return max_count_; }
+
+ private:
+  static int Clamp(const int v, const int size) { return std::min(std::max(v, 0), size - 1); }
+
+  void Resize(const int width, const int height) {
+    width_ = width;
+    height_ = height;
+    lo_.resize(static_cast<size_t>(width) * height);
+    count_.resize(static_cast<size_t>(width) * height);
+    empty_.resize(static_cast<size_t>(width) * height);
+  }
+
+  // [lo, hi] is moved into the bounds and clipped to x
+  void SetPixel(const int y, const int x, int lo, int hi, const int bound_lo, const int bound_hi) {
+    lo = std::min(std::max(lo, bound_lo), bound_hi);
+    hi = std::min(std::max(hi, bound_lo), std::min(bound_hi, x));
+    const bool empty = bound_lo > bound_hi || hi < lo;
+    if (empty) lo = hi = std::min(x, std::max(bound_lo, 0));
+    lo_[y*width_ + x] = lo;
+    count_[y*width_ + x] = hi - lo + 1;
+    empty_[y*width_ + x] = empty ? 1 : 0;
+  }
+
+  void ComputeOffsets() {
+    offsets_.resize(lo_.size() + 1);
+    offsets_[0] = 0;
+    max_count_ = 0;
+    for (size_t i = 0; i < count_.size(); i++) {
+      offsets_[i + 1] = offsets_[i] + count_[i];
+      max_count_ = std::max(max_count_, count_[i]);
+    }
+  }
+
+  int width_;
+  int height_;
+  int max_count_;
+  std::vector<int> lo_;
+  std::vector<int> count_;
+  std::vector<unsigned char> empty_;
+  std::vector<size_t> offsets_;
+};
+
+// Inclusive disparity bounds of the image rows [first_row, first_row + height): the window
+// [min_disp, max_disp] narrowed by the optional per-row tables row_min / row_max, which are
+// either empty or hold one bound per image row (e.g. from a ground plane prior).
+inline void ComputeRowBounds(const int min_disp, const int max_disp,
+                             const std::vector<int>& row_min, const std::vector<int>& row_max,
+                             const int first_row, const int height,
+                             std::vector<int>* row_lo, std::vector<int>* row_hi) {
+  row_lo->resize(height);
+  row_hi->resize(height);
+  for (int y = 0; y < height; y++) {
+    (*row_lo)[y] = row_min.empty() ? min_disp : std::max(min_disp, row_min[first_row + y]);
+    (*row_hi)[y] = row_max.empty() ? max_disp : std::min(max_disp, row_max[first_row + y]);
+  }
+}
+
+// Per-row tables of an image downsampled 2x, coarse row y covers the rows 2y and 2y + 1
+// and the disparities halve. Empty tables stay empty.
+inline std::vector<int> HalveRowMin(const std::vector<int>& row_min) {
+  std::vector<int> coarse((row_min.size() + 1) / 2);
+  for (size_t y = 0; y < coarse.size(); y++)
+    coarse[y] = std::min(row_min[2*y], row_min[std::min(2*y + 1, row_min.size() - 1)]) / 2;
+  return coarse;
+}
+
+inline std::vector<int> HalveRowMax(const std::vector<int>& row_max) {
+  std::vector<int> coarse((row_max.size() + 1) / 2);
+  for (size_t y = 0; y < coarse.size(); y++)
+    coarse[y] = (std::max(row_max[2*y], row_max[std::min(2*y + 1, row_max.size() - 1)]) + 1) / 2;
+  return coarse;
+}
+
+} // namespace recon
+#endif
@@ -0,0 +1,163 @@
+#ifndef RECONSTRUCTION_BASE_FRAME_PIPELINE_H_
+#define RECONSTRUCTION_BASE_FRAME_PIPELINE_H_
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+namespace recon {
+
+// Runs frames through a fixed sequence of stages, each served by its own worker threads,
+// so that stage k of frame n overlaps stage k-1 of frame n+1. At most max_in_flight frames
+// are between Submit and their completion, Submit blocks until a slot is free.
+// Frames can complete out of order when a stage has several workers. An exception thrown by
+// a stage skips the remaining stages and is delivered through the frame's future.
+template<typename Frame>
+class FramePipeline {
+ public:
+  // worker is the index of the thread within its stage, for per-worker state like engines
+  typedef std::function<void(Frame& frame, int worker)> Stage;
+
+  explicit FramePipeline(const size_t max_in_flight)
+      : max_in_flight_(max_in_flight), in_flight_(0), started_(false), stopped_(false) {
+    if (max_in_flight_ == 0) {
+      throw std::invalid_argument("[FramePipeline::FramePipeline] at least one frame must be in flight");
+    }
+  }
+  ~FramePipeline() { Stop(); }
+  FramePipeline(const FramePipeline&) = delete;
+  FramePipeline& operator=(const FramePipeline&) = delete;
+
+  // stages run in the order they are added, all of them must be added before Start
+  void AddStage(Stage stage, const int num_workers = 1) {
+    std::lock_guard<std::mutex> lock(state_mutex_);
+    if (started_) {
+      throw std::logic_error("[FramePipeline::AddStage] the pipeline is already running");
+    }
+    stages_.emplace_back(new StageQueue(std::move(stage), std::max(1, num_workers)));
+  }
+
+  void Start() {
+    std::lock_guard<std::mutex> lock(state_mutex_);
+    if (started_ || stages_.empty()) return;
+    started_ = true;
+    for (size_t s = 0; s < stages_.size(); s++)
+      for (int w = 0; w < stages_[s]->num_workers; w++)
+        stages_[s]->workers.emplace_back(&FramePipeline::Work, this, s, w);
+  }
+
+  // may be called from several threads, Stop waits for the frames being submitted
+  std::future<Frame> Submit(Frame frame) {
+    std::lock_guard<std::mutex> state_lock(state_mutex_);
+    if (!started_ || stopped_) {
+      throw std::logic_error("[FramePipeline::Submit] the pipeline is not running");
+    }
+    {
+      std::unique_lock<std::mutex> lock(slots_mutex_);
+      slot_free_.wait(lock, [this] { return in_flight_ < max_in_flight_; });
+      in_flight_++;
+    }
+    std::unique_ptr<Item> item(new Item(std::move(frame)));
+    std::future<Frame> result = item->promise.get_future();
+    stages_[0]->Push(std::move(item));
+    return result;
+  }
+
+  // completes the frames which were already submitted and joins all workers
+  void Stop() {
+    std::lock_guard<std::mutex> lock(state_mutex_);
+    if (!started_ || stopped_) return;
+    stopped_ = true;
+    // an empty item tells a worker to exit, it is queued behind all frames of its stage
+    for (auto& stage : stages_) {
+      for (int w = 0; w < stage->num_workers; w++) stage->Push(nullptr);
+      for (std::thread& worker : stage->workers) worker.join();
+    }
+  }
+
+  size_t max_in_flight() const { return max_in_flight_; }
+
+ private:
+  struct Item {
+    explicit Item(Frame&& f) : frame(std::move(f)) {}
+    Frame frame;
+    std::promise<Frame> promise;
+  };
+
+  struct StageQueue {
+    StageQueue(Stage&& s, const int workers) : stage(std::move(s)), num_workers(workers) {}
+    void Push(std::unique_ptr<Item> item) {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        items.push_back(std::move(item));
+      }
+      not_empty.notify_one();
+    }
+    std::unique_ptr<Item> Pop() {
+      std::unique_lock<std::mutex> lock(mutex);
+      not_empty.wait(lock, [this] { return !items.empty(); });
+      std::unique_ptr<Item> item = std::move(items.front());
+      items.pop_front();
+      return item;
+    }
+
+    Stage stage;
+    int num_workers;
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable not_empty;
+    std::deque<std::unique_ptr<Item>> items;
+  };
+
+  void Work(const size_t s, const int w) {
+    StageQueue& queue = *stages_[s];
+    for (;;) {
+      std::unique_ptr<Item> item = queue.Pop();
+      if (item == nullptr) return;
+      try {
+        queue.stage(item->frame, w);
+      } catch (...) {
+        item->promise.set_exception(std::current_exception());
+        Release();
+        continue;
+      }
+      if (s + 1 < stages_.size()) {
+        stages_[s + 1]->Push(std::move(item));
+      }
+      else {
+        item->promise.set_value(std::move(item->frame));
+        Release();
+      }
+    }
+  }
+
+  void Release() {
+    {
+      std::lock_guard<std::mutex> lock(slots_mutex_);
+      in_flight_--;
+    }
+    slot_free_.notify_one();
+  }
+
+  const size_t max_in_flight_;
+  std::vector<std::unique_ptr<StageQueue>> stages_;
+  std::mutex slots_mutex_;
+  std::condition_variable slot_free_;
+  size_t in_flight_;
+  // guards the stage list and the running state against concurrent Submit and Stop
+  std::mutex state_mutex_;
+  bool started_;
+  bool stopped_;
+};
+
+} // namespace recon
+#endif
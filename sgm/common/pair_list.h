@@ -0,0 +1,64 @@
+#ifndef RECONSTRUCTION_BASE_PAIR_LIST_H_
+#define RECONSTRUCTION_BASE_PAIR_LIST_H_
+
+#include <glob.h>
+
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace recon {
+
+typedef std::vector<std::pair<std::string, std::string>> PairList;
+
+// Reads "left right" path pairs, one per line. Empty lines and lines starting with # are skipped.
+inline PairList ReadPairList(const std::string& list_path) {
+  std::ifstream file(list_path);
+  if (!file) {
+    throw std::runtime_error("[ReadPairList] can not open " + list_path);
+  }
+  PairList pairs;
+  std::string line;
+  int line_number = 0;
+  while (std::getline(file, line)) {
+    line_number++;
+    std::istringstream fields(line);
+    std::string left, right;
+    if (!(fields >> left) || left[0] == '#') continue;
+    if (!(fields >> right)) {
+      throw std::runtime_error("[ReadPairList] " + list_path + ":" + std::to_string(line_number) +
+                               " has no right path");
+    }
+    pairs.push_back(std::make_pair(left, right));
+  }
+  return pairs;
+}
+
+// Pairs the sorted matches of two glob patterns, e.g. "left/*.png" and "right/*.png".
+inline PairList GlobPairs(const std::string& left_pattern, const std::string& right_pattern) {
+  auto expand = [](const std::string& pattern) {
+    std::vector<std::string> paths;
+    glob_t matches;
+    // glob sorts its results
+    if (glob(pattern.c_str(), 0, nullptr, &matches) == 0) {
+      for (size_t i = 0; i < matches.gl_pathc; i++) paths.push_back(matches.gl_pathv[i]);
+    }
+    globfree(&matches);
+    return paths;
+  };
+  std::vector<std::string> left = expand(left_pattern);
+  std::vector<std::string> right = expand(right_pattern);
+  if (left.size() != right.size()) {
+    throw std::runtime_error("[GlobPairs] " + left_pattern + " matches " + std::to_string(left.size()) +
+                             " files but " + right_pattern + " matches " + std::to_string(right.size()));
+  }
+  PairList pairs;
+  for (size_t i = 0; i < left.size(); i++) pairs.push_back(std::make_pair(left[i], right[i]));
+  return pairs;
+}
+
+} // namespace recon
+#endif
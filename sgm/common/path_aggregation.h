@@ -0,0 +1,261 @@
+#ifndef RECONSTRUCTION_BASE_PATH_AGGREGATION_
+#define RECONSTRUCTION_BASE_PATH_AGGREGATION_
+
+#include <cstdint>
+#include <limits>
+#include <algorithm>
+
+#if defined(__AVX2__) || defined(__SSE4_1__)
+#include <immintrin.h>
+#endif
+
+namespace recon
+{
+
+// One step of the SGM recursion along a path for all disparities at once:
+//   L(d) = C(d) + min(prior[d], prior[d-1] + P1, prior[d+1] + P1, min_prior + P2) - min_prior
+// All arithmetic is unsigned 16-bit saturating so L stays bounded by C_max + P2 and never wraps.
+// Returns min_d L(d) which is the min_prior of the next pixel on the path.
+template<typename CostT>
+uint16_t aggregate_path_16u(const uint16_t* prior, uint16_t min_prior, const CostT* local,
+                            uint16_t* costs, int disp_range, uint16_t P1, uint16_t P2);
+
+namespace internal
+{
+
+inline uint16_t adds_16u(uint16_t a, uint16_t b)
+{
+  uint32_t sum = static_cast<uint32_t>(a) + b;
+  return static_cast<uint16_t>(std::min(sum, 0xFFFFu));
+}
+
+template<typename CostT>
+inline
+uint16_t aggregate_path_16u_scalar(const uint16_t* prior, uint16_t min_prior, const CostT* local,
+                                   uint16_t* costs, int disp_range, uint16_t P1, uint16_t P2)
+{
+  const uint16_t min_p2 = adds_16u(min_prior, P2);
+  uint16_t min_cost = 0xFFFF;
+  for(int d = 0; d < disp_range; d++) {
+    uint16_t error = std::min(min_p2, prior[d]);
+    if(d > 0)
+      error = std::min(error, adds_16u(prior[d-1], P1));
+    if(d < (disp_range - 1))
+      error = std::min(error, adds_16u(prior[d+1], P1));
+    costs[d] = adds_16u(static_cast<uint16_t>(local[d]), error - min_prior);
+    min_cost = std::min(min_cost, costs[d]);
+  }
+  return min_cost;
+}
+
+#ifdef __AVX2__
+inline __m256i load_costs_16u(const uint8_t* ptr)
+{
+  return _mm256_cvtepu8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(ptr)));
+}
+
+inline __m256i load_costs_16u(const uint16_t* ptr)
+{
+  return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(ptr));
+}
+
+// 16 disparities per iteration, disp_range must be a multiple of 16
+template<typename CostT>
+inline
+uint16_t aggregate_path_16u_avx2(const uint16_t* prior, uint16_t min_prior, const CostT* local,
+                                 uint16_t* costs, int disp_range, uint16_t P1, uint16_t P2)
+{
+  const __m256i inf = _mm256_set1_epi16(-1);
+  const __m256i vP1 = _mm256_set1_epi16(P1);
+  const __m256i vmin_prior = _mm256_set1_epi16(min_prior);
+  const __m256i vmin_p2 = _mm256_adds_epu16(vmin_prior, _mm256_set1_epi16(P2));
+  __m256i vmin = inf;
+  // out of range neighbours d = -1 and d = disp_range are never selected
+  __m256i prev = inf;
+  __m256i curr = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(prior));
+  for(int d = 0; d < disp_range; d += 16) {
+    __m256i next = (d + 16 < disp_range) ?
+                   _mm256_loadu_si256(reinterpret_cast<const __m256i*>(prior + d + 16)) : inf;
+    // prior[d-1] and prior[d+1] built by shifting one element across the 128-bit lanes
+    __m256i left = _mm256_alignr_epi8(curr, _mm256_permute2x128_si256(prev, curr, 0x21), 14);
+    __m256i right = _mm256_alignr_epi8(_mm256_permute2x128_si256(curr, next, 0x21), curr, 2);
+    __m256i error = _mm256_min_epu16(curr, vmin_p2);
+    error = _mm256_min_epu16(error, _mm256_adds_epu16(left, vP1));
+    error = _mm256_min_epu16(error, _mm256_adds_epu16(right, vP1));
+    __m256i cost = _mm256_adds_epu16(load_costs_16u(local + d), _mm256_subs_epu16(error, vmin_prior));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(costs + d), cost);
+    vmin = _mm256_min_epu16(vmin, cost);
+    prev = curr;
+    curr = next;
+  }
+  __m128i vmin128 = _mm_min_epu16(_mm256_castsi256_si128(vmin), _mm256_extracti128_si256(vmin, 1));
+  return static_cast<uint16_t>(_mm_cvtsi128_si32(_mm_minpos_epu16(vmin128)));
+}
+#endif
+
+#ifdef __SSE4_1__
+inline __m128i load_costs_16u_sse(const uint8_t* ptr)
+{
+  return _mm_cvtepu8_epi16(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(ptr)));
+}
+
+inline __m128i load_costs_16u_sse(const uint16_t* ptr)
+{
+  return _mm_loadu_si128(reinterpret_cast<const __m128i*>(ptr));
+}
+
+// 8 disparities per iteration, disp_range must be a multiple of 8
+template<typename CostT>
+inline
+uint16_t aggregate_path_16u_sse4(const uint16_t* prior, uint16_t min_prior, const CostT* local,
+                                 uint16_t* costs, int disp_range, uint16_t P1, uint16_t P2)
+{
+  const __m128i inf = _mm_set1_epi16(-1);
+  const __m128i vP1 = _mm_set1_epi16(P1);
+  const __m128i vmin_prior = _mm_set1_epi16(min_prior);
+  const __m128i vmin_p2 = _mm_adds_epu16(vmin_prior, _mm_set1_epi16(P2));
+  __m128i vmin = inf;
+  __m128i prev = inf;
+  __m128i curr = _mm_loadu_si128(reinterpret_cast<const __m128i*>(prior));
+  for(int d = 0; d < disp_range; d += 8) {
+    __m128i next = (d + 8 < disp_range) ?
+                   _mm_loadu_si128(reinterpret_cast<const __m128i*>(prior + d + 8)) : inf;
+    __m128i left = _mm_alignr_epi8(curr, prev, 14);
+    __m128i right = _mm_alignr_epi8(next, curr, 2);
+    __m128i error = _mm_min_epu16(curr, vmin_p2);
+    error = _mm_min_epu16(error, _mm_adds_epu16(left, vP1));
+    error = _mm_min_epu16(error, _mm_adds_epu16(right, vP1));
+    __m128i cost = _mm_adds_epu16(load_costs_16u_sse(local + d), _mm_subs_epu16(error, vmin_prior));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(costs + d), cost);
+    vmin = _mm_min_epu16(vmin, cost);
+    prev = curr;
+    curr = next;
+  }
+  return static_cast<uint16_t>(_mm_cvtsi128_si32(_mm_minpos_epu16(vmin)));
+}
+#endif
+
+} // end namespace: internal
+
+template<typename CostT>
+inline
+uint16_t aggregate_path_16u(const uint16_t* prior, uint16_t min_prior, const CostT* local,
+                            uint16_t* costs, int disp_range, uint16_t P1, uint16_t P2)
+{
+#ifdef __AVX2__
+  if(disp_range % 16 == 0)
+    return internal::aggregate_path_16u_avx2(prior, min_prior, local, costs, disp_range, P1, P2);
+#endif
+#ifdef __SSE4_1__
+  if(disp_range % 8 == 0)
+    return internal::aggregate_path_16u_sse4(prior, min_prior, local, costs, disp_range, P1, P2);
+#endif
+  return internal::aggregate_path_16u_scalar(prior, min_prior, local, costs, disp_range, P1, P2);
+}
+
+// Generic scalar version of the same step for float or 32-bit path costs.
+template<typename PathT, typename CostT>
+inline
+PathT aggregate_path_scalar(const PathT* prior, PathT min_prior, const CostT* local,
+                            PathT* costs, int disp_range, int P1, int P2)
+{
+  PathT min_cost = std::numeric_limits<PathT>::max();
+  for(int d = 0; d < disp_range; d++) {
+    PathT error = min_prior + P2;
+    error = std::min(error, prior[d]);
+    if(d > 0)
+      error = std::min(error, static_cast<PathT>(prior[d-1] + P1));
+    if(d < (disp_range - 1))
+      error = std::min(error, static_cast<PathT>(prior[d+1] + P1));
+
+    // ACostType can be uint8_t and e_smooth int
+    // Normalize by subtracting min of prior cost
+    // Now we have upper limit on cost: e_smooth <= C_max + P2
+    // LR check won't work without this normalization also
+    costs[d] = static_cast<PathT>(local[d]) + (error - min_prior);
+    min_cost = std::min(min_cost, costs[d]);
+  }
+  return min_cost;
+}
+
+// Picks the kernel from the path cost type, uint16_t path costs use the saturating SIMD kernel.
+template<typename PathT, typename CostT>
+inline
+PathT aggregate_path_step(const PathT* prior, PathT min_prior, const CostT* local,
+                          PathT* costs, int disp_range, int P1, int P2)
+{
+  return aggregate_path_scalar<PathT, CostT>(prior, min_prior, local, costs, disp_range, P1, P2);
+}
+
+template<typename CostT>
+inline
+uint16_t aggregate_path_step(const uint16_t* prior, uint16_t min_prior, const CostT* local,
+                             uint16_t* costs, int disp_range, int P1, int P2)
+{
+  return aggregate_path_16u<CostT>(prior, min_prior, local, costs, disp_range,
+                                   static_cast<uint16_t>(std::min(P1, 0xFFFF)),
+                                   static_cast<uint16_t>(std::min(P2, 0xFFFF)));
+}
+
+// Band limited step, the prior pixel on the path searched the disparities [prior_lo, prior_lo + prior_count)
+// and the current one searches [lo, lo + count). Disparities the prior did not search are treated like
+// the ones outside the disparity range, min_prior + P2 is the only way to reach them.
+template<typename PathT, typename CostT>
+inline
+PathT aggregate_band_scalar(const PathT* prior, int prior_lo, int prior_count, PathT min_prior,
+                            const CostT* local, int lo, int count, PathT* costs, int P1, int P2)
+{
+  PathT min_cost = std::numeric_limits<PathT>::max();
+  for(int i = 0; i < count; i++) {
+    // index of the same disparity in the prior band
+    int j = lo + i - prior_lo;
+    PathT error = min_prior + P2;
+    if(j >= 0 && j < prior_count)
+      error = std::min(error, prior[j]);
+    if(j >= 1 && j <= prior_count)
+      error = std::min(error, static_cast<PathT>(prior[j-1] + P1));
+    if(j >= -1 && j < (prior_count - 1))
+      error = std::min(error, static_cast<PathT>(prior[j+1] + P1));
+    costs[i] = static_cast<PathT>(local[i]) + (error - min_prior);
+    min_cost = std::min(min_cost, costs[i]);
+  }
+  return min_cost;
+}
+
+template<typename CostT>
+inline
+uint16_t aggregate_band_scalar(const uint16_t* prior, int prior_lo, int prior_count, uint16_t min_prior,
+                               const CostT* local, int lo, int count, uint16_t* costs, int P1, int P2)
+{
+  const uint16_t P1_16 = static_cast<uint16_t>(std::min(P1, 0xFFFF));
+  const uint16_t min_p2 = internal::adds_16u(min_prior, static_cast<uint16_t>(std::min(P2, 0xFFFF)));
+  uint16_t min_cost = 0xFFFF;
+  for(int i = 0; i < count; i++) {
+    int j = lo + i - prior_lo;
+    uint16_t error = min_p2;
+    if(j >= 0 && j < prior_count)
+      error = std::min(error, prior[j]);
+    if(j >= 1 && j <= prior_count)
+      error = std::min(error, internal::adds_16u(prior[j-1], P1_16));
+    if(j >= -1 && j < (prior_count - 1))
+      error = std::min(error, internal::adds_16u(prior[j+1], P1_16));
+    costs[i] = internal::adds_16u(static_cast<uint16_t>(local[i]), error - min_prior);
+    min_cost = std::min(min_cost, costs[i]);
+  }
+  return min_cost;
+}
+
+// neighbours on a path mostly search the same band, those steps take the full range kernels
+template<typename PathT, typename CostT>
+inline
+PathT aggregate_band_step(const PathT* prior, int prior_lo, int prior_count, PathT min_prior,
+                          const CostT* local, int lo, int count, PathT* costs, int P1, int P2)
+{
+  if(prior_lo == lo && prior_count == count)
+    return aggregate_path_step(prior, min_prior, local, costs, count, P1, P2);
+  return aggregate_band_scalar(prior, prior_lo, prior_count, min_prior, local, lo, count, costs, P1, P2);
+}
+
+}
+
+#endif
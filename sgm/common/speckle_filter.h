@@ -0,0 +1,137 @@
+#ifndef RECONSTRUCTION_BASE_SPECKLE_FILTER_H_
+#define RECONSTRUCTION_BASE_SPECKLE_FILTER_H_
+
+#include <algorithm>
+#include <cstddef>
+#include <vector>
+
+namespace recon {
+
+// Removes speckles from a disparity image: every connected region of at most max_size pixels is
+// set to 0 (invalid). Two 4-neighbours are connected when both are non-zero and differ by at most
+// max_difference, the result is the same as flood filling each region.
+// The rows are run-length encoded and the runs of neighbouring rows are joined with union-find.
+// Strips of rows are labeled in parallel and joined at their boundaries afterwards. The buffers
+// are kept between calls.
+template<typename T>
+class SpeckleFilter {
+ public:
+  // stride is the distance between rows in elements
+  void Apply(T* image, const int width, const int height, const size_t stride, const int max_size,
+             const T max_difference) {
+    if (width <= 0 || height <= 0) return;
+    // runs of connected pixels of each row, counted first so every row can write its own range
+    row_first_.resize(height + 1);
+    #pragma omp parallel for
+    for (int y = 0; y < height; y++) {
+      const T* row = image + y*stride;
+      int count = 0;
+      for (int x = 0; x < width; x++)
+        if (row[x] != 0 && (x == 0 || !Connected(row[x - 1], row[x], max_difference))) count++;
+      row_first_[y + 1] = count;
+    }
+    row_first_[0] = 0;
+    for (int y = 0; y < height; y++) row_first_[y + 1] += row_first_[y];
+    const int num_runs = row_first_[height];
+    runs_.resize(num_runs);
+    parent_.resize(num_runs);
+    size_.assign(num_runs, 0);
+
+    #pragma omp parallel for
+    for (int y = 0; y < height; y++) {
+      const T* row = image + y*stride;
+      int run = row_first_[y];
+      for (int x = 0; x < width; x++) {
+        if (row[x] == 0) continue;
+        if (x > 0 && Connected(row[x - 1], row[x], max_difference)) {
+          runs_[run - 1].end = x + 1;
+        }
+        else {
+          runs_[run] = Run{x, x + 1};
+          parent_[run] = run;
+          run++;
+        }
+      }
+    }
+
+    // the unions of a strip only touch the runs of its rows
+    const int num_strips = (height + kStripRows - 1) / kStripRows;
+    #pragma omp parallel for schedule(dynamic, 1)
+    for (int s = 0; s < num_strips; s++) {
+      const int end = std::min(height, (s + 1)*kStripRows);
+      for (int y = s*kStripRows + 1; y < end; y++) JoinRows(image, stride, y, max_difference);
+    }
+    for (int s = 1; s < num_strips; s++) JoinRows(image, stride, s*kStripRows, max_difference);
+
+    // parents never have a larger index than their children, so one pass in order flattens the trees
+    for (int i = 0; i < num_runs; i++) {
+      parent_[i] = parent_[parent_[i]];
+      size_[parent_[i]] += runs_[i].end - runs_[i].start;
+    }
+
+    #pragma omp parallel for
+    for (int y = 0; y < height; y++) {
+      T* row = image + y*stride;
+      for (int i = row_first_[y]; i < row_first_[y + 1]; i++) {
+        if (size_[parent_[i]] <= max_size) std::fill(row + runs_[i].start, row + runs_[i].end, static_cast<T>(0));
+      }
+    }
+  }
+
+ private:
+  static const int kStripRows = 32;
+
+  // pixels [start, end) of a row
+  struct Run {
+    int start;
+    int end;
+  };
+
+  static bool Connected(const T a, const T b, const T max_difference) {
+    return a != 0 && b != 0 && (a > b ? a - b : b - a) <= max_difference;
+  }
+
+  int Find(int i) {
+    while (parent_[i] != i) {
+      parent_[i] = parent_[parent_[i]];
+      i = parent_[i];
+    }
+    return i;
+  }
+
+  // the root with the smaller index becomes the parent
+  void Union(const int a, const int b) {
+    const int root_a = Find(a);
+    const int root_b = Find(b);
+    if (root_a < root_b) parent_[root_b] = root_a;
+    else if (root_b < root_a) parent_[root_a] = root_b;
+  }
+
+  // joins the runs of row y with the runs of row y - 1 they touch
+  void JoinRows(const T* image, const size_t stride, const int y, const T max_difference) {
+    const T* upper = image + (y - 1)*stride;
+    const T* lower = image + y*stride;
+    int i = row_first_[y - 1];
+    int j = row_first_[y];
+    while (i < row_first_[y] && j < row_first_[y + 1]) {
+      const int start = std::max(runs_[i].start, runs_[j].start);
+      const int end = std::min(runs_[i].end, runs_[j].end);
+      for (int x = start; x < end; x++) {
+        if (Connected(upper[x], lower[x], max_difference)) {
+          Union(i, j);
+          break;
+        }
+      }
+      if (runs_[i].end < runs_[j].end) i++;
+      else j++;
+    }
+  }
+
+  std::vector<Run> runs_;
+  std::vector<int> row_first_;
+  std::vector<int> parent_;
+  std::vector<int> size_;
+};
+
+} // namespace recon
+#endif
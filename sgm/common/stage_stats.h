@@ -0,0 +1,93 @@
+#ifndef RECONSTRUCTION_BASE_STAGE_STATS_H_
+#define RECONSTRUCTION_BASE_STAGE_STATS_H_
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace recon {
+
+// Wall time and allocations of one stage of a disparity computation.
+struct StageStats {
+  std::string name;
+  double ms;
+  size_t bytes_allocated;
+};
+
+// Per-call instrumentation filled by the SGM engines when a pointer to it is passed in.
+// Stages are kept in the order they ran, a stage reported twice accumulates.
+struct FrameStats {
+  std::vector<StageStats> stages;
+  // bytes of the engine buffers alive at the moment and the largest value during the call
+  size_t current_bytes = 0;
+  size_t peak_bytes = 0;
+
+  void Clear() {
+    stages.clear();
+    current_bytes = peak_bytes = 0;
+  }
+
+  void AddStage(const std::string& name, const double ms, const size_t bytes_allocated = 0) {
+    for (StageStats& stage : stages) {
+      if (stage.name == name) {
+        stage.ms += ms;
+        stage.bytes_allocated += bytes_allocated;
+        return;
+      }
+    }
+    stages.push_back(StageStats{name, ms, bytes_allocated});
+  }
+
+  void Allocated(const size_t bytes) {
+    current_bytes += bytes;
+    peak_bytes = std::max(peak_bytes, current_bytes);
+  }
+
+  void Released(const size_t bytes) {
+    current_bytes -= std::min(current_bytes, bytes);
+  }
+
+  const StageStats* Find(const std::string& name) const {
+    for (const StageStats& stage : stages)
+      if (stage.name == name) return &stage;
+    return nullptr;
+  }
+};
+
+// Times the enclosing scope as one stage. Does nothing, not even reading the clock,
+// when stats is null so the engines can be instrumented unconditionally.
+class ScopedStage {
+ public:
+  typedef std::chrono::steady_clock Clock;
+
+  ScopedStage(FrameStats* stats, const char* name) : stats_(stats), name_(name), bytes_(0) {
+    if (stats_ != nullptr) start_ = Clock::now();
+  }
+  ~ScopedStage() {
+    if (stats_ != nullptr) stats_->AddStage(name_, ElapsedMs(start_), bytes_);
+  }
+  ScopedStage(const ScopedStage&) = delete;
+  ScopedStage& operator=(const ScopedStage&) = delete;
+
+  // buffers allocated by the stage, they count towards the peak until released
+  void Allocated(const size_t bytes) {
+    if (stats_ == nullptr) return;
+    bytes_ += bytes;
+    stats_->Allocated(bytes);
+  }
+
+  static double ElapsedMs(const Clock::time_point& start) {
+    return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+  }
+
+ private:
+  FrameStats* stats_;
+  const char* name_;
+  size_t bytes_;
+  Clock::time_point start_;
+};
+
+} // namespace recon
+#endif
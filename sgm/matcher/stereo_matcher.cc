@@ -0,0 +1,120 @@
+#include "stereo_matcher.h"
+
+#include <stdexcept>
+#include <string>
+
+#include <opencv2/core/core.hpp>
+
+#include "../2_pass/descriptor_tensor.h"
+#include "../2_pass/sgm_stereo.h"
+
+namespace recon {
+
+namespace {
+
+void CheckSizes(const int left_width, const int left_height, const int right_width, const int right_height,
+                const DisparityView& disparity) {
+  if (left_width != right_width || left_height != right_height) {
+    throw std::invalid_argument("[StereoMatcher::Compute] sizes of left and right inputs are different");
+  }
+  if (disparity.width != left_width || disparity.height != left_height || disparity.data == nullptr ||
+      disparity.stride < static_cast<size_t>(disparity.width)) {
+    throw std::invalid_argument("[StereoMatcher::Compute] the disparity view does not match the inputs");
+  }
+}
+
+class EightPassMatcher : public StereoMatcher {
+ public:
+  explicit EightPassMatcher(const StereoMatcherConfig& config) {
+    StereoSGMParams params;
+    params.disp_range = config.disp_range;
+    params.window_sz = config.window_size;
+    params.penalty1 = config.penalty1;
+    params.penalty2 = config.penalty2;
+    params.num_concurrent_paths = config.num_concurrent_paths;
+    params.cost = config.image_cost;
+    params.pyramid_levels = config.pyramid_levels;
+    params.band_radius = config.band_radius;
+    params.min_disp = config.min_disp;
+    params.row_min_disp = config.row_min_disp;
+    params.row_max_disp = config.row_max_disp;
+    params.speckle_size = config.speckle_size;
+    params.speckle_range = config.speckle_range;
+    params.num_candidates = config.num_candidates;
+    engine_ = params.create();
+  }
+
+  using StereoMatcher::Compute;
+  bool TakesDescriptors() const override { return false; }
+
+  void Compute(const ImageView& left, const ImageView& right, const DisparityView& disparity,
+               FrameStats* stats) override {
+    CheckSizes(left.width, left.height, right.width, right.height, disparity);
+    // headers over the caller's pixels, the engine only reads them
+    const cv::Mat left_img(left.height, left.width, CV_8U, const_cast<uint8_t*>(left.data), left.stride);
+    const cv::Mat right_img(right.height, right.width, CV_8U, const_cast<uint8_t*>(right.data), right.stride);
+    engine_->compute(left_img, right_img, disparity.data, disparity.stride, stats);
+  }
+
+  void Warmup(const int width, const int height) override { engine_->warm_up(width, height); }
+
+ private:
+  std::unique_ptr<StereoSGMBase> engine_;
+};
+
+class TwoPassMatcher : public StereoMatcher {
+ public:
+  explicit TwoPassMatcher(const StereoMatcherConfig& config) {
+    sgm_.SetSmoothnessCostParameters(config.penalty1, config.penalty2);
+    sgm_.SetDisparityBounds(config.min_disp, config.disp_range - 1);
+    sgm_.SetRowDisparityBounds(config.row_min_disp, config.row_max_disp);
+    sgm_.SetConsistencyThreshold(config.consistency_threshold);
+    sgm_.SetDescriptorCost(config.descriptor_cost);
+    sgm_.SetSingleAggregation(config.single_aggregation);
+    sgm_.SetPyramid(config.pyramid_levels, config.band_radius);
+    sgm_.SetMemoryLimit(config.memory_limit);
+    sgm_.SetQuantization(config.quantized);
+    sgm_.SetCandidateAggregation(config.num_candidates);
+    sgm_.SetProjection(config.projection);
+  }
+
+  using StereoMatcher::Compute;
+  bool TakesDescriptors() const override { return true; }
+
+  void Compute(const DescriptorView& left, const DescriptorView& right, const DisparityView& disparity,
+               FrameStats* stats) override {
+    CheckSizes(left.width, left.height, right.width, right.height, disparity);
+    left_.Wrap(left.data, left.height, left.width, left.channels, left.stride, left.type, left.scale);
+    right_.Wrap(right.data, right.height, right.width, right.channels, right.stride, right.type, right.scale);
+    sgm_.Compute(left_, right_, disparity.data, disparity.stride, stats);
+  }
+
+  void Warmup(const int width, const int height) override { sgm_.Warmup(width, height); }
+
+ private:
+  SGMStereo sgm_;
+  DescriptorTensor left_;
+  DescriptorTensor right_;
+};
+
+} // namespace
+
+void StereoMatcher::Compute(const ImageView&, const ImageView&, const DisparityView&, FrameStats*) {
+  throw std::invalid_argument("[StereoMatcher::Compute] this engine matches descriptors, not images");
+}
+
+void StereoMatcher::Compute(const DescriptorView&, const DescriptorView&, const DisparityView&, FrameStats*) {
+  throw std::invalid_argument("[StereoMatcher::Compute] this engine matches images, not descriptors");
+}
+
+std::unique_ptr<StereoMatcher> StereoMatcherConfig::Create() const {
+  switch (engine) {
+    case StereoEngine::kEightPass:
+      return std::unique_ptr<StereoMatcher>(new EightPassMatcher(*this));
+    case StereoEngine::kTwoPass:
+      return std::unique_ptr<StereoMatcher>(new TwoPassMatcher(*this));
+  }
+  throw std::invalid_argument("[StereoMatcherConfig::Create] unknown engine");
+}
+
+} // namespace recon
@@ -0,0 +1,113 @@
+#ifndef RECONSTRUCTION_BASE_STEREO_MATCHER_H_
+#define RECONSTRUCTION_BASE_STEREO_MATCHER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "../2_pass/descriptor_costs.h"
+#include "../2_pass/descriptor_projection.h"
+#include "../2_pass/descriptor_tensor.h"
+#include "../8_pass/stereo_sgm.h"
+#include "../common/stage_stats.h"
+
+namespace recon {
+
+// Views of caller owned buffers, nothing is copied or written to disk by the matchers.
+// Strides are the distances between the starts of two rows in elements.
+
+// 8-bit grayscale image
+struct ImageView {
+  const uint8_t* data;
+  int width;
+  int height;
+  size_t stride;
+};
+
+// H x W x C descriptors of the element type, the descriptors of a row are contiguous. A view
+// initialized without the last two members holds floats.
+struct DescriptorView {
+  const void* data;
+  int width;
+  int height;
+  int channels;
+  size_t stride;
+  DescriptorType type;
+  // int8 descriptors stand for value * scale
+  float scale;
+};
+
+// 16-bit disparities * 256, 0 is invalid
+struct DisparityView {
+  uint16_t* data;
+  int width;
+  int height;
+  size_t stride;
+};
+
+enum class StereoEngine {
+  // 8 path SGM on grayscale images with the cost chosen by image_cost
+  kEightPass,
+  // 2 pass SGM on dense descriptors with the cost chosen by descriptor_cost
+  kTwoPass
+};
+
+class StereoMatcher;
+
+// Parameters of both engines, each engine ignores the ones of the other.
+struct StereoMatcherConfig {
+  StereoEngine engine = StereoEngine::kEightPass;
+  // search window [min_disp, disp_range), narrowed further by the optional per-row bounds which
+  // are empty or hold one inclusive bound per image row
+  int disp_range = 128;
+  int min_disp = 0;
+  std::vector<int> row_min_disp;
+  std::vector<int> row_max_disp;
+  // smoothness penalties in the cost units of the engine
+  int penalty1 = 3;
+  int penalty2 = 40;
+  // coarse-to-fine search, see StereoSGMParams and SGMStereo::SetPyramid
+  int pyramid_levels = 0;
+  int band_radius = 4;
+  // memory efficient full range search keeping num_candidates disparities per pixel, 0 is off
+  int num_candidates = 0;
+
+  // 8-pass engine
+  StereoCost image_cost = StereoCost::kCensus;
+  int window_size = 5;
+  int num_concurrent_paths = 4;
+  int speckle_size = 0;
+  int speckle_range = 2;
+
+  // 2-pass engine
+  DescriptorCost descriptor_cost = DescriptorCost::kL2;
+  bool single_aggregation = true;
+  int consistency_threshold = 1;
+  size_t memory_limit = 0;
+  bool quantized = false;
+  // optional k x C map of the descriptors applied before matching, see SGMStereo::SetProjection
+  DescriptorProjection projection;
+
+  std::unique_ptr<StereoMatcher> Create() const;
+};
+
+// Common interface of both engines. Each engine matches one kind of input, the Compute of the
+// other kind throws std::invalid_argument. The disparity view has the size of the input. The
+// buffers of a matcher are kept between calls, a matcher must not be used by two threads at once.
+class StereoMatcher {
+ public:
+  virtual ~StereoMatcher() {}
+  // true for the engines which match descriptors instead of images
+  virtual bool TakesDescriptors() const = 0;
+  // stats is optional, when given it receives the time and memory of every stage
+  virtual void Compute(const ImageView& left, const ImageView& right, const DisparityView& disparity,
+                       FrameStats* stats = nullptr);
+  virtual void Compute(const DescriptorView& left, const DescriptorView& right, const DisparityView& disparity,
+                       FrameStats* stats = nullptr);
+  // allocates the buffers for width x height inputs ahead of the first call
+  virtual void Warmup(const int width, const int height) = 0;
+};
+
+} // namespace recon
+#endif